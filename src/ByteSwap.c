@@ -0,0 +1,66 @@
+#include "ByteSwap.h"
+
+#include <intrin.h>
+#include <tmmintrin.h>
+#include <Windows.h>
+
+// Only checked once, -1 until then
+static int s_HasSsse3 = -1;
+
+static BOOL HasSsse3(void)
+{
+    if (s_HasSsse3 == -1)
+    {
+        // SSSE3 support is bit 9 of ECX for the function 1 of CPUID
+        int cpuInfo[4] = { 0 };
+        __cpuid(cpuInfo, 1);
+        s_HasSsse3 = (cpuInfo[2] & (1 << 9)) != 0;
+    }
+
+    return s_HasSsse3;
+}
+
+// Swaps the bytes of every element of size elementSize in the 16-byte blocks of pData, shuffleMask says where
+// each byte of a block goes. Returns the number of bytes swapped, the rest needs to be swapped one element at a time.
+static size_t ByteSwapBlocks(void *pData, size_t size, __m128i shuffleMask)
+{
+    if (!HasSsse3())
+        return 0;
+
+    uint8_t *pBytes = pData;
+    size_t numberOfBlocks = size / sizeof(__m128i);
+    for (size_t i = 0; i < numberOfBlocks; i++)
+    {
+        __m128i *pBlock = (__m128i *)(pBytes + i * sizeof(__m128i));
+        _mm_storeu_si128(pBlock, _mm_shuffle_epi8(_mm_loadu_si128(pBlock), shuffleMask));
+    }
+
+    return numberOfBlocks * sizeof(__m128i);
+}
+
+void ByteSwapArray16(uint16_t *pValues, size_t numberOfValues)
+{
+    __m128i shuffleMask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t swappedValues = ByteSwapBlocks(pValues, numberOfValues * sizeof(uint16_t), shuffleMask) / sizeof(uint16_t);
+
+    for (size_t i = swappedValues; i < numberOfValues; i++)
+        pValues[i] = _byteswap_ushort(pValues[i]);
+}
+
+void ByteSwapArray32(uint32_t *pValues, size_t numberOfValues)
+{
+    __m128i shuffleMask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t swappedValues = ByteSwapBlocks(pValues, numberOfValues * sizeof(uint32_t), shuffleMask) / sizeof(uint32_t);
+
+    for (size_t i = swappedValues; i < numberOfValues; i++)
+        pValues[i] = _byteswap_ulong(pValues[i]);
+}
+
+void ByteSwapArray64(uint64_t *pValues, size_t numberOfValues)
+{
+    __m128i shuffleMask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t swappedValues = ByteSwapBlocks(pValues, numberOfValues * sizeof(uint64_t), shuffleMask) / sizeof(uint64_t);
+
+    for (size_t i = swappedValues; i < numberOfValues; i++)
+        pValues[i] = _byteswap_uint64(pValues[i]);
+}
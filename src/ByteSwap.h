@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Swap the bytes of every element of an array in place, to go from the big-endian values of the console to the
+// little-endian values of the PC and the other way around. SSSE3 is used when the CPU supports it.
+void ByteSwapArray16(uint16_t *pValues, size_t numberOfValues);
+
+void ByteSwapArray32(uint32_t *pValues, size_t numberOfValues);
+
+void ByteSwapArray64(uint64_t *pValues, size_t numberOfValues);
@@ -0,0 +1,475 @@
+#include "Daemon.h"
+
+#include <fcntl.h>
+#include <io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "Utils.h"
+
+// A request starts with a RequestHeader, followed by the current directory of the client and its arguments, all
+// null-terminated. The response is the output of the command followed by a null byte and the exit code of the command.
+#define MAX_REQUEST_SIZE 0x10000
+#define MAX_REQUEST_ARGUMENTS 256
+#define END_OF_OUTPUT '\0'
+
+#define PIPE_BUFFER_SIZE 0x1000
+
+// Time a client waits for the daemon to be done with another client
+#define PIPE_BUSY_TIMEOUT 30000
+
+typedef struct _RequestHeader
+{
+    // The strings are counted instead of ending with an empty one, since an argument can be an empty string
+    uint32_t NumberOfStrings;
+
+    // Size of the strings that follow the header, null terminators included
+    uint32_t Size;
+} RequestHeader;
+
+// The notification handlers don't take a context parameter so the state needs to be global
+static volatile LONG s_LoadedModulesChanged = FALSE;
+static Session *s_pDaemonSession = NULL;
+
+static DWORD __stdcall OnModuleNotification(ULONG notification, ULONG_PTR param)
+{
+    UNREFERENCED_PARAMETER(notification);
+
+    // The module table is only used by the thread running the commands so it's just flagged as outdated here
+    InterlockedExchange(&s_LoadedModulesChanged, TRUE);
+
+    // The cached export addresses of the module can't be trusted anymore, this one is safe to call from here
+    const DMN_MODLOAD *pModule = (const DMN_MODLOAD *)param;
+    ForgetVerifiedModule(&s_pDaemonSession->Exports, pModule->Name);
+
+    return 0;
+}
+
+static DWORD WINAPI WakeUpOnStop(void *pParameter)
+{
+    HANDLE stopEvent = pParameter;
+
+    // ConnectNamedPipe can't be interrupted so connect to the pipe to make it return, after the current client
+    // if there is one
+    WaitForSingleObject(stopEvent, INFINITE);
+
+    for (;;)
+    {
+        HANDLE pipe = CreateFileA(DAEMON_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(pipe);
+            return 0;
+        }
+
+        if (GetLastError() != ERROR_PIPE_BUSY)
+            return 0;
+
+        WaitNamedPipeA(DAEMON_PIPE_NAME, NMPWAIT_WAIT_FOREVER);
+    }
+}
+
+static HRESULT WriteToPipe(HANDLE pipe, const void *pData, DWORD size)
+{
+    DWORD bytesWritten = 0;
+    if (!WriteFile(pipe, pData, size, &bytesWritten, NULL) || bytesWritten != size)
+        return E_FAIL;
+
+    return S_OK;
+}
+
+static HRESULT ReadFromPipe(HANDLE pipe, void *pData, size_t size)
+{
+    // A message can arrive in several pieces
+    for (size_t offset = 0; offset < size;)
+    {
+        DWORD bytesRead = 0;
+        if (!ReadFile(pipe, (char *)pData + offset, (DWORD)(size - offset), &bytesRead, NULL) || bytesRead == 0)
+            return E_FAIL;
+
+        offset += bytesRead;
+    }
+
+    return S_OK;
+}
+
+static HRESULT ReadRequest(HANDLE pipe, char *request, RequestHeader *pHeader)
+{
+    HRESULT hr = ReadFromPipe(pipe, pHeader, sizeof(*pHeader));
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // The current directory is always there
+    if (pHeader->NumberOfStrings == 0 || pHeader->NumberOfStrings > MAX_REQUEST_ARGUMENTS + 1 || pHeader->Size == 0 || pHeader->Size > MAX_REQUEST_SIZE)
+        return E_FAIL;
+
+    hr = ReadFromPipe(pipe, request, pHeader->Size);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // The last string needs to be terminated for the strings to stay inside the request
+    if (request[pHeader->Size - 1] != '\0')
+        return E_FAIL;
+
+    return S_OK;
+}
+
+static int RunCommandFromRequest(Session *pSession, DaemonCommandHandler commandHandler, char *request, const RequestHeader *pHeader)
+{
+    // The first string is the current directory of the client, relative paths in the arguments are relative to it
+    const char *currentDirectory = request;
+    if (!SetCurrentDirectoryA(currentDirectory))
+    {
+        LogError("Could not change the current directory to %s.", currentDirectory);
+        return EXIT_FAILURE;
+    }
+
+    // Rebuild argv from the strings that follow, the first one is the name of the program like in main
+    char *argv[MAX_REQUEST_ARGUMENTS + 1] = { "ModuleLoader" };
+    int argc = 1;
+    size_t offset = strlen(currentDirectory) + 1;
+    for (uint32_t i = 1; i < pHeader->NumberOfStrings; i++)
+    {
+        if (offset >= pHeader->Size)
+        {
+            LogError("The request sent to the daemon is invalid.");
+            return EXIT_FAILURE;
+        }
+
+        argv[argc++] = request + offset;
+        offset += strlen(request + offset) + 1;
+    }
+
+    return commandHandler(pSession, argc, argv);
+}
+
+static int RunRequest(Session *pSession, DaemonCommandHandler commandHandler, HANDLE pipe, char *request, const RequestHeader *pHeader)
+{
+    // Redirect stdout and stderr to the pipe while the command runs so that the client gets the output
+    HANDLE outputPipe = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), pipe, GetCurrentProcess(), &outputPipe, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        return EXIT_FAILURE;
+
+    int outputPipeFd = _open_osfhandle((intptr_t)outputPipe, _O_WRONLY | _O_BINARY);
+    if (outputPipeFd == -1)
+    {
+        CloseHandle(outputPipe);
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    int originalStdoutFd = _dup(_fileno(stdout));
+    int originalStderrFd = _dup(_fileno(stderr));
+    _dup2(outputPipeFd, _fileno(stdout));
+    _dup2(outputPipeFd, _fileno(stderr));
+    _close(outputPipeFd);
+
+    int exitCode = RunCommandFromRequest(pSession, commandHandler, request, pHeader);
+
+    fflush(stdout);
+    fflush(stderr);
+    _dup2(originalStdoutFd, _fileno(stdout));
+    _dup2(originalStderrFd, _fileno(stderr));
+    _close(originalStdoutFd);
+    _close(originalStderrFd);
+
+    return exitCode;
+}
+
+static HRESULT OpenNotificationSession(PDMN_SESSION *ppNotificationSession)
+{
+    PDMN_SESSION pNotificationSession = NULL;
+    HRESULT hr = DmOpenNotificationSession(DM_PERSISTENT, &pNotificationSession);
+    if (SUCCEEDED(hr))
+        hr = DmNotify(pNotificationSession, DM_MODLOAD, OnModuleNotification);
+    if (SUCCEEDED(hr))
+        hr = DmNotify(pNotificationSession, DM_MODUNLOAD, OnModuleNotification);
+
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        if (pNotificationSession != NULL)
+            DmCloseNotificationSession(pNotificationSession);
+
+        return E_FAIL;
+    }
+
+    *ppNotificationSession = pNotificationSession;
+
+    return S_OK;
+}
+
+static HRESULT Reconnect(Session *pSession, PDMN_SESSION *ppNotificationSession)
+{
+    // Closed first so that no notification touches the session while it's reopened
+    if (*ppNotificationSession != NULL)
+    {
+        DmCloseNotificationSession(*ppNotificationSession);
+        *ppNotificationSession = NULL;
+    }
+
+    // OpenSession starts from scratch, only the settings the daemon was started with are kept. The console set with
+    // --console stays the target since DmSetXboxNameNoRegister applies to the whole process.
+    RpcTarget defaultRpcTarget = pSession->DefaultRpcTarget;
+    BOOL useAddressCalls = pSession->UseAddressCalls;
+
+    CloseSession(pSession);
+    HRESULT hr = OpenSession(pSession, NULL);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    pSession->DefaultRpcTarget = defaultRpcTarget;
+    pSession->UseAddressCalls = useAddressCalls;
+
+    // Modules could have been loaded or unloaded while the notifications were not received
+    InterlockedExchange(&s_LoadedModulesChanged, FALSE);
+
+    return OpenNotificationSession(ppNotificationSession);
+}
+
+HRESULT RunDaemon(Session *pSession, DaemonCommandHandler commandHandler)
+{
+    HRESULT hr = S_OK;
+
+    // Only one daemon can run at a time and the pipe is not reachable from other machines
+    HANDLE pipe = CreateNamedPipeA(
+        DAEMON_PIPE_NAME,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1,
+        PIPE_BUFFER_SIZE,
+        PIPE_BUFFER_SIZE,
+        0,
+        NULL
+    );
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        LogError("Could not create %s, the daemon is probably already running.", DAEMON_PIPE_NAME);
+        return E_FAIL;
+    }
+
+    char *request = malloc(MAX_REQUEST_SIZE);
+    if (request == NULL)
+    {
+        LogError("Could not allocate memory for the requests.");
+        CloseHandle(pipe);
+
+        return E_FAIL;
+    }
+
+    // Keep the module table in sync with the modules loaded and unloaded by anything else than the daemon
+    s_pDaemonSession = pSession;
+    PDMN_SESSION pNotificationSession = NULL;
+    hr = OpenNotificationSession(&pNotificationSession);
+    if (FAILED(hr))
+    {
+        free(request);
+        CloseHandle(pipe);
+
+        return E_FAIL;
+    }
+
+    HANDLE stopEvent = CreateStopEvent();
+    HANDLE wakeUpThread = stopEvent != NULL ? CreateThread(NULL, 0, WakeUpOnStop, stopEvent, 0, NULL) : NULL;
+    if (wakeUpThread == NULL)
+    {
+        if (stopEvent != NULL)
+            CloseStopEvent(stopEvent);
+        DmCloseNotificationSession(pNotificationSession);
+        free(request);
+        CloseHandle(pipe);
+
+        return E_FAIL;
+    }
+
+    LogInfo("Listening on %s for %s, press Ctrl+C to stop.", DAEMON_PIPE_NAME, pSession->ConsoleName);
+    fflush(stdout);
+
+    // Serve the clients one after the other
+    BOOL isDisconnected = FALSE;
+    for (;;)
+    {
+        BOOL isConnected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+
+        if (WaitForSingleObject(stopEvent, 0) == WAIT_OBJECT_0)
+            break;
+
+        RequestHeader header = { 0 };
+        if (isConnected && SUCCEEDED(ReadRequest(pipe, request, &header)))
+        {
+            // Try again if reconnecting after the previous command failed
+            if (isDisconnected)
+                isDisconnected = FAILED(Reconnect(pSession, &pNotificationSession));
+
+            if (InterlockedExchange(&s_LoadedModulesChanged, FALSE))
+                InvalidateLoadedModules(pSession);
+
+            // Each command has its own stats
+            ZeroMemory(&pSession->Stats, sizeof(pSession->Stats));
+
+            int exitCode = EXIT_FAILURE;
+            if (isDisconnected)
+            {
+                static const char message[] = "The daemon could not reconnect to the console, try again once it's reachable.\n";
+                WriteToPipe(pipe, message, sizeof(message) - 1);
+            }
+            else
+            {
+                exitCode = RunRequest(pSession, commandHandler, pipe, request, &header);
+            }
+
+            char endOfOutput = END_OF_OUTPUT;
+            int32_t exitCodeToSend = exitCode;
+            if (SUCCEEDED(WriteToPipe(pipe, &endOfOutput, sizeof(endOfOutput))))
+                WriteToPipe(pipe, &exitCodeToSend, sizeof(exitCodeToSend));
+
+            FlushFileBuffers(pipe);
+
+            // The command can't tell whether it failed because of the console or because of its arguments, and a lost
+            // connection (XBDM_CONNECTIONLOST) would make every following command fail as well, so both sessions are
+            // opened again once the client has its response
+            if (!isDisconnected && exitCode != EXIT_SUCCESS)
+                isDisconnected = FAILED(Reconnect(pSession, &pNotificationSession));
+        }
+
+        DisconnectNamedPipe(pipe);
+    }
+
+    WaitForSingleObject(wakeUpThread, INFINITE);
+    CloseHandle(wakeUpThread);
+    CloseStopEvent(stopEvent);
+    if (pNotificationSession != NULL)
+        DmCloseNotificationSession(pNotificationSession);
+    free(request);
+    CloseHandle(pipe);
+
+    return S_OK;
+}
+
+static HRESULT ConnectToDaemon(HANDLE *pPipe)
+{
+    for (;;)
+    {
+        HANDLE pipe = CreateFileA(DAEMON_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE)
+        {
+            *pPipe = pipe;
+            return S_OK;
+        }
+
+        // The daemon is not running
+        if (GetLastError() != ERROR_PIPE_BUSY)
+            return S_FALSE;
+
+        // The daemon is running a command for another client
+        if (!WaitNamedPipeA(DAEMON_PIPE_NAME, PIPE_BUSY_TIMEOUT))
+            return S_FALSE;
+    }
+}
+
+static HRESULT SendRequest(HANDLE pipe, int argc, char **argv)
+{
+    char currentDirectory[MAX_PATH] = { 0 };
+    if (GetCurrentDirectoryA(sizeof(currentDirectory), currentDirectory) == 0)
+        return E_FAIL;
+
+    char *request = malloc(sizeof(RequestHeader) + MAX_REQUEST_SIZE);
+    if (request == NULL)
+        return E_FAIL;
+
+    if (argc > MAX_REQUEST_ARGUMENTS + 1)
+    {
+        free(request);
+        return E_FAIL;
+    }
+
+    // Every string is sent with its null terminator after the header, the current directory takes the place of the
+    // name of the program (the first char * of argv)
+    RequestHeader *pHeader = (RequestHeader *)request;
+    size_t requestSize = sizeof(RequestHeader);
+    HRESULT hr = S_OK;
+    for (int i = 0; i < argc && SUCCEEDED(hr); i++)
+    {
+        const char *string = i == 0 ? currentDirectory : argv[i];
+        size_t stringSize = strlen(string) + 1;
+        if (requestSize + stringSize > sizeof(RequestHeader) + MAX_REQUEST_SIZE)
+        {
+            hr = E_FAIL;
+            break;
+        }
+
+        memcpy(request + requestSize, string, stringSize);
+        requestSize += stringSize;
+    }
+
+    pHeader->NumberOfStrings = (uint32_t)argc;
+    pHeader->Size = (uint32_t)(requestSize - sizeof(RequestHeader));
+
+    if (SUCCEEDED(hr))
+        hr = WriteToPipe(pipe, request, (DWORD)requestSize);
+
+    free(request);
+
+    return hr;
+}
+
+HRESULT SendCommandToDaemon(int argc, char **argv, int *pExitCode)
+{
+    HANDLE pipe = NULL;
+    HRESULT hr = ConnectToDaemon(&pipe);
+    if (hr != S_OK)
+        return hr;
+
+    hr = SendRequest(pipe, argc, argv);
+    if (FAILED(hr))
+    {
+        LogError("Could not send the command to the daemon.");
+        CloseHandle(pipe);
+
+        return E_FAIL;
+    }
+
+    // Print the output of the command as it comes until the end of the output, then read the exit code
+    char buffer[PIPE_BUFFER_SIZE] = { 0 };
+    char exitCodeBytes[sizeof(int32_t)] = { 0 };
+    size_t exitCodeBytesRead = 0;
+    BOOL isEndOfOutput = FALSE;
+    DWORD bytesRead = 0;
+    while (exitCodeBytesRead < sizeof(exitCodeBytes) && ReadFile(pipe, buffer, sizeof(buffer), &bytesRead, NULL) && bytesRead > 0)
+    {
+        size_t offset = 0;
+        if (!isEndOfOutput)
+        {
+            char *endOfOutput = memchr(buffer, END_OF_OUTPUT, bytesRead);
+            size_t outputSize = endOfOutput != NULL ? (size_t)(endOfOutput - buffer) : bytesRead;
+            fwrite(buffer, 1, outputSize, stdout);
+            fflush(stdout);
+
+            if (endOfOutput == NULL)
+                continue;
+
+            isEndOfOutput = TRUE;
+            offset = outputSize + 1;
+        }
+
+        for (; offset < bytesRead && exitCodeBytesRead < sizeof(exitCodeBytes); offset++)
+            exitCodeBytes[exitCodeBytesRead++] = buffer[offset];
+    }
+
+    CloseHandle(pipe);
+
+    if (exitCodeBytesRead != sizeof(exitCodeBytes))
+    {
+        LogError("The connection to the daemon was lost.");
+        return E_FAIL;
+    }
+
+    int32_t exitCode = 0;
+    memcpy(&exitCode, exitCodeBytes, sizeof(exitCode));
+    *pExitCode = exitCode;
+
+    return S_OK;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+#define DAEMON_PIPE_NAME "\\\\.\\pipe\\ModuleLoader"
+
+// Runs a command received by the daemon, argv is in the same format as the one main receives
+typedef int (*DaemonCommandHandler)(Session *pSession, int argc, char **argv);
+
+HRESULT RunDaemon(Session *pSession, DaemonCommandHandler commandHandler);
+
+HRESULT SendCommandToDaemon(int argc, char **argv, int *pExitCode);
@@ -0,0 +1,244 @@
+#include "ExportCache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Hash.h"
+#include "Log.h"
+#include "Utils.h"
+
+#define EXPORT_CACHE_MAGIC 0x434C4D45 // "EMLC"
+#define EXPORT_CACHE_VERSION 2
+
+typedef struct _ExportCacheHeader
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t AddressCalls;
+    ModuleBuild AddressCallsBuilds[NUMBER_OF_RPC_MODULES];
+    uint32_t NumberOfEntries;
+} ExportCacheHeader;
+
+static HRESULT GetExportCachePath(const char *consoleName, char *cachePath, size_t cachePathSize)
+{
+    // Name the cache after the console, case-insensitive like console names
+    char key[MAX_PATH] = { 0 };
+    strncpy_s(key, sizeof(key), consoleName, _TRUNCATE);
+    _strlwr_s(key, sizeof(key));
+
+    char cacheName[20] = { 0 };
+    _snprintf_s(cacheName, sizeof(cacheName), _TRUNCATE, "%016llx", HashData(key, strlen(key)));
+
+    return GetLocalDataPath("Exports", cacheName, cachePath, cachePathSize);
+}
+
+static HRESULT GrowExportCache(ExportCache *pCache, size_t minimumCapacity)
+{
+    size_t newCapacity = pCache->Capacity == 0 ? 16 : pCache->Capacity * 2;
+    if (newCapacity < minimumCapacity)
+        newCapacity = minimumCapacity;
+
+    ExportCacheEntry *pEntries = realloc(pCache->pEntries, newCapacity * sizeof(ExportCacheEntry));
+    if (pEntries == NULL)
+    {
+        LogError("Could not allocate memory for the export cache.");
+        return E_FAIL;
+    }
+
+    pCache->pEntries = pEntries;
+    pCache->Capacity = newCapacity;
+
+    return S_OK;
+}
+
+HRESULT LoadExportCache(ExportCache *pCache, const char *consoleName)
+{
+    HRESULT hr = S_OK;
+
+    pCache->IsLoaded = TRUE;
+
+    char cachePath[MAX_PATH] = { 0 };
+    hr = GetExportCachePath(consoleName, cachePath, sizeof(cachePath));
+    if (FAILED(hr))
+        return E_FAIL;
+
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, cachePath, "rb");
+    if (err != 0)
+        return S_FALSE;
+
+    // A cache that can't be read is just ignored, it gets rebuilt as the exports are resolved again
+    ExportCacheHeader header = { 0 };
+    if (fread(&header, sizeof(header), 1, pFile) != 1 || header.Magic != EXPORT_CACHE_MAGIC || header.Version != EXPORT_CACHE_VERSION)
+    {
+        fclose(pFile);
+        return S_FALSE;
+    }
+
+    if (header.NumberOfEntries > pCache->Capacity)
+    {
+        hr = GrowExportCache(pCache, header.NumberOfEntries);
+        if (FAILED(hr))
+        {
+            fclose(pFile);
+            return E_FAIL;
+        }
+    }
+
+    if (fread(pCache->pEntries, sizeof(ExportCacheEntry), header.NumberOfEntries, pFile) != header.NumberOfEntries)
+    {
+        fclose(pFile);
+        return S_FALSE;
+    }
+
+    fclose(pFile);
+
+    // Make sure the module names are terminated even if the file was tampered with
+    for (size_t i = 0; i < header.NumberOfEntries; i++)
+        pCache->pEntries[i].ModuleName[EXPORT_CACHE_MODULE_NAME_SIZE - 1] = '\0';
+
+    pCache->NumberOfEntries = header.NumberOfEntries;
+    pCache->AddressCalls = header.AddressCalls <= AddressCallSupport_Unsupported ? (AddressCallSupport)header.AddressCalls : AddressCallSupport_Unknown;
+    memcpy(pCache->AddressCallsBuilds, header.AddressCallsBuilds, sizeof(pCache->AddressCallsBuilds));
+
+    return S_OK;
+}
+
+HRESULT SaveExportCache(const ExportCache *pCache, const char *consoleName)
+{
+    HRESULT hr = S_OK;
+
+    char cachePath[MAX_PATH] = { 0 };
+    hr = GetExportCachePath(consoleName, cachePath, sizeof(cachePath));
+    if (FAILED(hr))
+        return E_FAIL;
+
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, cachePath, "wb");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", cachePath);
+        return E_FAIL;
+    }
+
+    ExportCacheHeader header = { 0 };
+    header.Magic = EXPORT_CACHE_MAGIC;
+    header.Version = EXPORT_CACHE_VERSION;
+    header.AddressCalls = (uint32_t)pCache->AddressCalls;
+    memcpy(header.AddressCallsBuilds, pCache->AddressCallsBuilds, sizeof(header.AddressCallsBuilds));
+    header.NumberOfEntries = (uint32_t)pCache->NumberOfEntries;
+
+    fwrite(&header, sizeof(header), 1, pFile);
+    fwrite(pCache->pEntries, sizeof(ExportCacheEntry), pCache->NumberOfEntries, pFile);
+
+    fclose(pFile);
+
+    return S_OK;
+}
+
+void FreeExportCache(ExportCache *pCache)
+{
+    free(pCache->pEntries);
+    ZeroMemory(pCache, sizeof(*pCache));
+}
+
+static BOOL IsSameExport(const ExportCacheEntry *pEntry, const ExportCacheEntry *pKey)
+{
+    return pEntry->Ordinal == pKey->Ordinal && !_stricmp(pEntry->ModuleName, pKey->ModuleName);
+}
+
+const ExportCacheEntry *FindCachedExport(const ExportCache *pCache, const ExportCacheEntry *pKey)
+{
+    // There are only a handful of functions called with XDRPC so a linear search is enough
+    for (size_t i = 0; i < pCache->NumberOfEntries; i++)
+    {
+        const ExportCacheEntry *pEntry = &pCache->pEntries[i];
+        if (IsSameExport(pEntry, pKey) &&
+            pEntry->CheckSum == pKey->CheckSum &&
+            pEntry->TimeStamp == pKey->TimeStamp &&
+            pEntry->BaseAddress == pKey->BaseAddress)
+            return pEntry;
+    }
+
+    return NULL;
+}
+
+HRESULT AddCachedExport(ExportCache *pCache, const ExportCacheEntry *pEntry)
+{
+    // The address resolved for a previous build of the module is not valid anymore
+    for (size_t i = 0; i < pCache->NumberOfEntries; i++)
+    {
+        if (IsSameExport(&pCache->pEntries[i], pEntry))
+        {
+            pCache->pEntries[i] = *pEntry;
+            pCache->IsDirty = TRUE;
+
+            return S_OK;
+        }
+    }
+
+    if (pCache->NumberOfEntries == pCache->Capacity && FAILED(GrowExportCache(pCache, 0)))
+        return E_FAIL;
+
+    pCache->pEntries[pCache->NumberOfEntries++] = *pEntry;
+    pCache->IsDirty = TRUE;
+
+    return S_OK;
+}
+
+BOOL FindVerifiedModule(ExportCache *pCache, const char *moduleName, VerifiedModule *pModule)
+{
+    BOOL isFound = FALSE;
+
+    AcquireSRWLockShared(&pCache->VerifiedModulesLock);
+
+    for (size_t i = 0; i < pCache->NumberOfVerifiedModules; i++)
+    {
+        if (!_stricmp(pCache->VerifiedModules[i].Name, moduleName))
+        {
+            *pModule = pCache->VerifiedModules[i];
+            isFound = TRUE;
+            break;
+        }
+    }
+
+    ReleaseSRWLockShared(&pCache->VerifiedModulesLock);
+
+    return isFound;
+}
+
+void AddVerifiedModule(ExportCache *pCache, const VerifiedModule *pModule)
+{
+    AcquireSRWLockExclusive(&pCache->VerifiedModulesLock);
+
+    // When full, the module just keeps being looked up in the loaded modules
+    size_t i = 0;
+    while (i < pCache->NumberOfVerifiedModules && _stricmp(pCache->VerifiedModules[i].Name, pModule->Name))
+        i++;
+
+    if (i < MAX_VERIFIED_MODULES)
+    {
+        pCache->VerifiedModules[i] = *pModule;
+        if (i == pCache->NumberOfVerifiedModules)
+            pCache->NumberOfVerifiedModules++;
+    }
+
+    ReleaseSRWLockExclusive(&pCache->VerifiedModulesLock);
+}
+
+void ForgetVerifiedModule(ExportCache *pCache, const char *moduleName)
+{
+    AcquireSRWLockExclusive(&pCache->VerifiedModulesLock);
+
+    for (size_t i = 0; i < pCache->NumberOfVerifiedModules; i++)
+    {
+        if (!_stricmp(pCache->VerifiedModules[i].Name, moduleName))
+        {
+            pCache->VerifiedModules[i] = pCache->VerifiedModules[--pCache->NumberOfVerifiedModules];
+            break;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&pCache->VerifiedModulesLock);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <Windows.h>
+
+#define EXPORT_CACHE_MODULE_NAME_SIZE 64
+
+typedef enum _AddressCallSupport
+{
+    // Not tried on the console yet
+    AddressCallSupport_Unknown,
+    AddressCallSupport_Supported,
+    AddressCallSupport_Unsupported,
+} AddressCallSupport;
+
+typedef struct _ExportCacheEntry
+{
+    char ModuleName[EXPORT_CACHE_MODULE_NAME_SIZE];
+    uint32_t Ordinal;
+
+    // The build of the module and where it's loaded, the address is only valid for these
+    uint32_t CheckSum;
+    uint32_t TimeStamp;
+    uint32_t BaseAddress;
+
+    uint32_t Address;
+} ExportCacheEntry;
+
+// The RPCs are run by xbdm.xex, and by XDRPC.xex on consoles that aren't devkits, on top of the kernel
+#define NUMBER_OF_RPC_MODULES 3
+
+typedef struct _ModuleBuild
+{
+    uint32_t CheckSum;
+    uint32_t TimeStamp;
+} ModuleBuild;
+
+// A few modules (xam.xex and xboxkrnl.exe in practice) are enough for all the functions called with XDRPC
+#define MAX_VERIFIED_MODULES 8
+
+// The build of a module as it was found loaded during the session
+typedef struct _VerifiedModule
+{
+    char Name[EXPORT_CACHE_MODULE_NAME_SIZE];
+    uint32_t CheckSum;
+    uint32_t TimeStamp;
+    uint32_t BaseAddress;
+} VerifiedModule;
+
+// The addresses of the functions called with XDRPC on a console, kept on the PC between runs
+typedef struct _ExportCache
+{
+    ExportCacheEntry *pEntries;
+    size_t NumberOfEntries;
+    size_t Capacity;
+
+    // Whether the console runs RPCs sent with the address of the function instead of a module name and an ordinal,
+    // found with the modules running the RPCs in these builds (zeros for the ones that weren't loaded). It's probed
+    // again when any of them changes.
+    AddressCallSupport AddressCalls;
+    ModuleBuild AddressCallsBuilds[NUMBER_OF_RPC_MODULES];
+
+    // Not saved, whether the builds were compared with the loaded modules during the session
+    BOOL AreAddressCallsBuildsChecked;
+
+    BOOL IsLoaded;
+    BOOL IsDirty;
+
+    // Not saved. The loaded build of these modules was already checked during the session, so their entries are
+    // used without walking the loaded modules again until a module load or unload notification concerns them. The
+    // notifications come from another thread, hence the lock (ready to use when zeroed).
+    VerifiedModule VerifiedModules[MAX_VERIFIED_MODULES];
+    size_t NumberOfVerifiedModules;
+    SRWLOCK VerifiedModulesLock;
+} ExportCache;
+
+// Reads the cache of the console from the disk, the cache is just left empty if there is none yet
+HRESULT LoadExportCache(ExportCache *pCache, const char *consoleName);
+
+HRESULT SaveExportCache(const ExportCache *pCache, const char *consoleName);
+
+void FreeExportCache(ExportCache *pCache);
+
+// Finds the entry matching everything in pKey except the address
+const ExportCacheEntry *FindCachedExport(const ExportCache *pCache, const ExportCacheEntry *pKey);
+
+// Adds pEntry to the cache, replacing the entry of a previous build of the module if there is one
+HRESULT AddCachedExport(ExportCache *pCache, const ExportCacheEntry *pEntry);
+
+// Copies the build of moduleName to pModule if it was verified during the session
+BOOL FindVerifiedModule(ExportCache *pCache, const char *moduleName, VerifiedModule *pModule);
+
+void AddVerifiedModule(ExportCache *pCache, const VerifiedModule *pModule);
+
+// Called when moduleName was loaded or unloaded, its build needs to be verified again. Can be called from any thread.
+void ForgetVerifiedModule(ExportCache *pCache, const char *moduleName);
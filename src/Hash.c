@@ -0,0 +1,114 @@
+#include "Hash.h"
+
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+uint64_t HashData(const void *pData, size_t size)
+{
+    const uint8_t *pBytes = pData;
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    // 64-bit FNV-1a, it's not meant to be cryptographically secure, only to detect changes
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= pBytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static uint32_t RotateLeft(uint32_t value, int count)
+{
+    return (value << count) | (value >> (32 - count));
+}
+
+static void Sha1ProcessBlock(uint32_t *state, const uint8_t *pBlock)
+{
+    uint32_t w[80] = { 0 };
+    for (size_t i = 0; i < 16; i++)
+        w[i] = ((uint32_t)pBlock[i * 4] << 24) | ((uint32_t)pBlock[i * 4 + 1] << 16) | ((uint32_t)pBlock[i * 4 + 2] << 8) | pBlock[i * 4 + 3];
+
+    for (size_t i = 16; i < 80; i++)
+        w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+
+    for (size_t i = 0; i < 80; i++)
+    {
+        uint32_t f = 0;
+        uint32_t k = 0;
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        uint32_t temp = RotateLeft(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = RotateLeft(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void HashDataSha1(const void *pData, size_t size, uint8_t *pDigest)
+{
+    const uint8_t *pBytes = pData;
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    size_t offset = 0;
+    for (; size - offset >= 64; offset += 64)
+        Sha1ProcessBlock(state, pBytes + offset);
+
+    // The rest of the data is padded with 0x80, zeros and the size in bits, which takes a second block when there's
+    // no room for the size after the data
+    uint8_t lastBlocks[128] = { 0 };
+    size_t remainingSize = size - offset;
+    memcpy(lastBlocks, pBytes + offset, remainingSize);
+    lastBlocks[remainingSize] = 0x80;
+
+    size_t lastBlocksSize = remainingSize < 56 ? 64 : 128;
+    uint64_t sizeInBits = (uint64_t)size * 8;
+    for (size_t i = 0; i < 8; i++)
+        lastBlocks[lastBlocksSize - 1 - i] = (uint8_t)(sizeInBits >> (i * 8));
+
+    for (size_t i = 0; i < lastBlocksSize; i += 64)
+        Sha1ProcessBlock(state, lastBlocks + i);
+
+    for (size_t i = 0; i < 5; i++)
+    {
+        pDigest[i * 4] = (uint8_t)(state[i] >> 24);
+        pDigest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        pDigest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        pDigest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
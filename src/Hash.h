@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+uint64_t HashData(const void *pData, size_t size);
+
+// SHA-1, the hash XeCryptSha computes on the console, so that data on both sides can be compared by digest
+void HashDataSha1(const void *pData, size_t size, uint8_t *pDigest);
@@ -0,0 +1,169 @@
+#include "HotReload.h"
+
+#include <stdlib.h>
+
+#include "Log.h"
+#include "Modules.h"
+#include "Upload.h"
+#include "Utils.h"
+
+// Amount of time without any write to the watched directory after which the build is considered done
+#define DEBOUNCE_DELAY 250
+
+static HRESULT GetLastWriteTime(const char *filePath, ULONGLONG *pLastWriteTime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fileAttributes = { 0 };
+    if (!GetFileAttributesExA(filePath, GetFileExInfoStandard, &fileAttributes))
+        return E_FAIL;
+
+    *pLastWriteTime = ((ULONGLONG)fileAttributes.ftLastWriteTime.dwHighDateTime << 32) | fileAttributes.ftLastWriteTime.dwLowDateTime;
+
+    return S_OK;
+}
+
+static HRESULT GetDirectoryFromPath(const char *filePath, char *directory, size_t directorySize)
+{
+    char drive[_MAX_DRIVE] = { 0 };
+    char directoryWithoutDrive[_MAX_DIR] = { 0 };
+
+    // Isolate the drive and the directory of filePath
+    errno_t err = _splitpath_s(filePath, drive, sizeof(drive), directoryWithoutDrive, sizeof(directoryWithoutDrive), NULL, 0, NULL, 0);
+    if (err != 0)
+    {
+        LogError("Could not split path: %s.", filePath);
+        return E_FAIL;
+    }
+
+    // filePath is just a file name so it's in the current directory
+    if (drive[0] == '\0' && directoryWithoutDrive[0] == '\0')
+    {
+        strncpy_s(directory, directorySize, ".", _TRUNCATE);
+        return S_OK;
+    }
+
+    err = _makepath_s(directory, directorySize, drive, directoryWithoutDrive, NULL, NULL);
+    if (err != 0)
+    {
+        LogError("Could not get the directory of %s.", filePath);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static BOOL WaitForEndOfWrites(HANDLE changeNotification, HANDLE stopEvent)
+{
+    HANDLE handles[2] = { stopEvent, changeNotification };
+
+    // Builds write the output file several times in a row so wait until there hasn't been any write for
+    // DEBOUNCE_DELAY milliseconds, returns FALSE if a stop was requested in the meantime
+    for (;;)
+    {
+        FindNextChangeNotification(changeNotification);
+
+        DWORD result = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, DEBOUNCE_DELAY);
+        if (result == WAIT_OBJECT_0)
+            return FALSE;
+
+        if (result != WAIT_OBJECT_0 + 1)
+            return TRUE;
+    }
+}
+
+HRESULT HotReload(Session *pSession, const char *localPath, const char *modulePath, BOOL force)
+{
+    HRESULT hr = S_OK;
+
+    // The directory needs to be watched because the file can be deleted and recreated by the build
+    char directory[MAX_PATH] = { 0 };
+    hr = GetDirectoryFromPath(localPath, directory, sizeof(directory));
+    if (FAILED(hr))
+        return E_FAIL;
+
+    HANDLE changeNotification = FindFirstChangeNotificationA(
+        directory,
+        FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE
+    );
+    if (changeNotification == INVALID_HANDLE_VALUE)
+    {
+        LogError("Could not watch %s.", directory);
+        return E_FAIL;
+    }
+
+    HANDLE stopEvent = CreateStopEvent();
+    if (stopEvent == NULL)
+    {
+        FindCloseChangeNotification(changeNotification);
+        return E_FAIL;
+    }
+
+    // The file may not exist yet if it was never built, in which case any write to it will be a change
+    ULONGLONG lastDeployedWriteTime = 0;
+    GetLastWriteTime(localPath, &lastDeployedWriteTime);
+
+    LogInfo("Watching %s, press Ctrl+C to stop.", localPath);
+
+    HANDLE handles[2] = { stopEvent, changeNotification };
+    for (;;)
+    {
+        DWORD result = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE);
+        if (result != WAIT_OBJECT_0 + 1)
+            break;
+
+        double changeTime = GetTimeInMilliseconds();
+
+        if (WaitForEndOfWrites(changeNotification, stopEvent) == FALSE)
+            break;
+
+        // Something else in the directory could have changed, or the file could be in the middle of being recreated
+        ULONGLONG lastWriteTime = 0;
+        hr = GetLastWriteTime(localPath, &lastWriteTime);
+        if (FAILED(hr) || lastWriteTime == lastDeployedWriteTime)
+            continue;
+
+        LogInfo("Waited %.0fms for the build to finish.", GetTimeInMilliseconds() - changeTime);
+        DeployModule(pSession, localPath, modulePath, force);
+
+        // Even if deploying failed, there is no point in trying again until the file changes
+        lastDeployedWriteTime = lastWriteTime;
+    }
+
+    CloseStopEvent(stopEvent);
+    FindCloseChangeNotification(changeNotification);
+
+    return S_OK;
+}
+
+HRESULT DeployModule(Session *pSession, const char *localPath, const char *modulePath, BOOL force)
+{
+    HRESULT hr = S_OK;
+
+    // Make sure the module can be loaded before spending time uploading it
+    hr = CheckLocalModule(pSession, localPath, modulePath);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    double uploadStartTime = GetTimeInMilliseconds();
+
+    hr = UploadFile(pSession, localPath, modulePath);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    double reloadStartTime = GetTimeInMilliseconds();
+
+    hr = UnloadThenLoad(pSession, modulePath, force);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    double endTime = GetTimeInMilliseconds();
+
+    LogInfo(
+        "Uploaded in %.0fms, reloaded in %.0fms (%.0fms total).",
+        reloadStartTime - uploadStartTime,
+        endTime - reloadStartTime,
+        endTime - uploadStartTime
+    );
+
+    return S_OK;
+}
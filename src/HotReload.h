@@ -0,0 +1,9 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+HRESULT DeployModule(Session *pSession, const char *localPath, const char *modulePath, BOOL force);
+
+HRESULT HotReload(Session *pSession, const char *localPath, const char *modulePath, BOOL force);
@@ -0,0 +1,491 @@
+#include "ImageDiff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Hash.h"
+#include "Log.h"
+#include "MemoryIO.h"
+#include "Stats.h"
+#include "Utils.h"
+#include "XDRPC.h"
+#include "Xex.h"
+
+// Both images are hashed by chunks of this size and only the chunks whose digests differ are read from the console
+// and compared byte by byte
+#define DIFF_CHUNK_SIZE 0x1000
+
+// The live chunks are hashed by this many RPCs at a time, each RPC in flight takes a thread until it's done
+#define CONSOLE_HASH_BATCH_SIZE 64
+
+// Differing bytes this close to each other are reported as a single range (a patched instruction often keeps
+// some of its bytes)
+#define DIFF_MERGE_GAP 4
+
+// Only the start of each range is printed byte by byte
+#define MAX_PRINTED_BYTES 32
+
+#define DIFF_RECORD_MAGIC 0x444C4D44 // "DMLD"
+#define DIFF_RECORD_VERSION 2
+
+typedef struct _ChunkDigest
+{
+    uint8_t Bytes[SHA1_DIGEST_SIZE];
+} ChunkDigest;
+
+// The digests of the live chunks of the last diff of a module, to tell which differences are new
+typedef struct _DiffRecord
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t ChunkSize;
+    uint32_t NumberOfChunks;
+} DiffRecord;
+
+typedef struct _DiffRange
+{
+    size_t Start;
+    size_t End;
+    BOOL IsNew;
+} DiffRange;
+
+static HRESULT GetDiffRecordPath(Session *pSession, const DMN_MODLOAD *pModule, char *recordPath, size_t recordPathSize)
+{
+    // Name the record after the console and the build of the module, a new build starts from scratch
+    char key[MAX_PATH * 2] = { 0 };
+    _snprintf_s(key, sizeof(key), _TRUNCATE, "%s|%s|%08x|%08x|%p", pSession->ConsoleName, pModule->Name, pModule->CheckSum, pModule->TimeStamp, pModule->BaseAddress);
+    _strlwr_s(key, sizeof(key));
+
+    char recordName[20] = { 0 };
+    _snprintf_s(recordName, sizeof(recordName), _TRUNCATE, "%016llx", HashData(key, strlen(key)));
+
+    return GetLocalDataPath("Diffs", recordName, recordPath, recordPathSize);
+}
+
+static ChunkDigest *ReadDiffRecord(const char *recordPath, size_t numberOfChunks)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, recordPath, "rb");
+    if (err != 0)
+        return NULL;
+
+    DiffRecord record = { 0 };
+    ChunkDigest *pChunkDigests = malloc(numberOfChunks * sizeof(ChunkDigest));
+    if (pChunkDigests == NULL ||
+        fread(&record, sizeof(record), 1, pFile) != 1 ||
+        record.Magic != DIFF_RECORD_MAGIC ||
+        record.Version != DIFF_RECORD_VERSION ||
+        record.ChunkSize != DIFF_CHUNK_SIZE ||
+        record.NumberOfChunks != numberOfChunks ||
+        fread(pChunkDigests, sizeof(ChunkDigest), numberOfChunks, pFile) != numberOfChunks)
+    {
+        free(pChunkDigests);
+        fclose(pFile);
+
+        return NULL;
+    }
+
+    fclose(pFile);
+
+    return pChunkDigests;
+}
+
+static void WriteDiffRecord(const char *recordPath, const ChunkDigest *pChunkDigests, size_t numberOfChunks)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, recordPath, "wb");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", recordPath);
+        return;
+    }
+
+    DiffRecord record = { 0 };
+    record.Magic = DIFF_RECORD_MAGIC;
+    record.Version = DIFF_RECORD_VERSION;
+    record.ChunkSize = DIFF_CHUNK_SIZE;
+    record.NumberOfChunks = (uint32_t)numberOfChunks;
+
+    fwrite(&record, sizeof(record), 1, pFile);
+    fwrite(pChunkDigests, sizeof(ChunkDigest), numberOfChunks, pFile);
+
+    fclose(pFile);
+}
+
+static void PrintBytes(const char *label, const uint8_t *pBytes, size_t size)
+{
+    printf("    %s", label);
+
+    for (size_t i = 0; i < size && i < MAX_PRINTED_BYTES; i++)
+        printf(" %02X", pBytes[i]);
+
+    printf(size > MAX_PRINTED_BYTES ? " ...\n" : "\n");
+}
+
+static void PrintRange(uint32_t baseAddress, const uint8_t *pImage, const uint8_t *pLive, const DiffRange *pRange)
+{
+    size_t size = pRange->End - pRange->Start;
+
+    printf("0x%08X (+0x%zX), %zu bytes%s\n", baseAddress + (uint32_t)pRange->Start, pRange->Start, size, pRange->IsNew ? " (changed since the last diff)" : "");
+    PrintBytes("Image:", pImage + pRange->Start, size);
+    PrintBytes("Live: ", pLive + pRange->Start, size);
+}
+
+static size_t GetChunkSize(size_t size, size_t chunkIndex)
+{
+    size_t chunkStart = chunkIndex * DIFF_CHUNK_SIZE;
+
+    return size - chunkStart < DIFF_CHUNK_SIZE ? size - chunkStart : DIFF_CHUNK_SIZE;
+}
+
+static void HashChunks(const uint8_t *pData, size_t size, ChunkDigest *pDigests, size_t numberOfChunks)
+{
+    for (size_t chunkIndex = 0; chunkIndex < numberOfChunks; chunkIndex++)
+        HashDataSha1(pData + chunkIndex * DIFF_CHUNK_SIZE, GetChunkSize(size, chunkIndex), pDigests[chunkIndex].Bytes);
+}
+
+static HRESULT AddXeCryptShaCall(XdrpcBatch *pBatch, uint32_t address, const void *pInput, size_t size, ChunkDigest *pDigest)
+{
+    XdrpcArgInfo args[8] = { { 0 }, { 0 }, { 0 }, { 0 }, { 0 }, { 0 }, { 0 }, { 0 } };
+    uint64_t inputAddress = address;
+    uint64_t inputSize = size;
+    uint64_t zero = 0;
+    uint64_t digestSize = SHA1_DIGEST_SIZE;
+
+    // XeCryptSha(pbInp1, cbInp1, pbInp2, cbInp2, pbInp3, cbInp3, pbOut, cbOut) hashes up to three inputs, only the
+    // first one is used. It's either in the memory of the console or, when pInput is not NULL, copied in the RPC
+    // buffer.
+    if (pInput != NULL)
+    {
+        args[0].pData = pInput;
+        args[0].Type = XdrpcArgType_Buffer;
+        args[0].Size = size;
+    }
+    else
+    {
+        args[0].pData = &inputAddress;
+        args[0].Type = XdrpcArgType_Integer;
+    }
+
+    args[1].pData = &inputSize;
+    args[1].Type = XdrpcArgType_Integer;
+
+    for (size_t i = 2; i < 6; i++)
+    {
+        args[i].pData = &zero;
+        args[i].Type = XdrpcArgType_Integer;
+    }
+
+    args[6].Type = XdrpcArgType_Buffer;
+    args[6].Size = SHA1_DIGEST_SIZE;
+    args[6].pOutData = pDigest->Bytes;
+    args[7].pData = &digestSize;
+    args[7].Type = XdrpcArgType_Integer;
+
+    return XdrpcBatchCall(pBatch, NULL, "xboxkrnl.exe", 402, args, 8, NULL);
+}
+
+static BOOL CanHashOnConsole(Session *pSession)
+{
+    // The ordinal of XeCryptSha is not documented, so a known input is hashed first to make sure the export is the
+    // SHA-1 this side computes
+    static const char input[] = "abc";
+    static const ChunkDigest expectedDigest = {
+        { 0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E, 0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D }
+    };
+    ChunkDigest digest = { 0 };
+
+    XdrpcBatch *pBatch = NULL;
+    HRESULT hr = XdrpcCreateBatch(pSession, &pBatch);
+    if (FAILED(hr))
+        return FALSE;
+
+    AddXeCryptShaCall(pBatch, 0, input, sizeof(input) - 1, &digest);
+    hr = XdrpcRunBatch(pBatch);
+
+    return SUCCEEDED(hr) && !memcmp(&digest, &expectedDigest, sizeof(digest));
+}
+
+static HRESULT HashLiveChunks(Session *pSession, uint32_t baseAddress, size_t size, ChunkDigest *pDigests, size_t numberOfChunks)
+{
+    HRESULT hr = S_OK;
+
+    for (size_t firstChunk = 0; firstChunk < numberOfChunks; firstChunk += CONSOLE_HASH_BATCH_SIZE)
+    {
+        XdrpcBatch *pBatch = NULL;
+        hr = XdrpcCreateBatch(pSession, &pBatch);
+        if (FAILED(hr))
+            return E_FAIL;
+
+        // A call that can't be added is remembered by the batch and makes XdrpcRunBatch fail
+        size_t lastChunk = numberOfChunks - firstChunk < CONSOLE_HASH_BATCH_SIZE ? numberOfChunks : firstChunk + CONSOLE_HASH_BATCH_SIZE;
+        for (size_t chunkIndex = firstChunk; chunkIndex < lastChunk; chunkIndex++)
+            AddXeCryptShaCall(pBatch, baseAddress + (uint32_t)(chunkIndex * DIFF_CHUNK_SIZE), NULL, GetChunkSize(size, chunkIndex), &pDigests[chunkIndex]);
+
+        hr = XdrpcRunBatch(pBatch);
+        if (FAILED(hr))
+            return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT ReadDifferentChunks(Session *pSession, uint32_t baseAddress, uint8_t *pLive, size_t size, const ChunkDigest *pImageDigests, const ChunkDigest *pLiveDigests, size_t numberOfChunks, size_t *pReadSize)
+{
+    MemoryRequest *pReads = malloc(numberOfChunks * sizeof(MemoryRequest));
+    if (pReads == NULL)
+    {
+        LogError("Could not allocate memory for the reads of the chunks.");
+        return E_FAIL;
+    }
+
+    // The chunks next to each other are merged into a single read by TransferMemory
+    size_t numberOfReads = 0;
+    for (size_t chunkIndex = 0; chunkIndex < numberOfChunks; chunkIndex++)
+    {
+        if (!memcmp(&pImageDigests[chunkIndex], &pLiveDigests[chunkIndex], sizeof(ChunkDigest)))
+            continue;
+
+        size_t chunkStart = chunkIndex * DIFF_CHUNK_SIZE;
+        MemoryRequest *pRead = &pReads[numberOfReads++];
+        pRead->Type = MemoryRequestType_Read;
+        pRead->Address = baseAddress + (uint32_t)chunkStart;
+        pRead->pData = pLive + chunkStart;
+        pRead->Size = GetChunkSize(size, chunkIndex);
+        *pReadSize += pRead->Size;
+    }
+
+    HRESULT hr = numberOfReads > 0 ? TransferMemory(pSession, pReads, numberOfReads) : S_OK;
+    free(pReads);
+
+    return hr;
+}
+
+static HRESULT ReadLiveChunks(Session *pSession, uint32_t baseAddress, uint8_t *pLive, size_t size, const ChunkDigest *pImageDigests, ChunkDigest *pLiveDigests, size_t numberOfChunks, size_t *pReadSize)
+{
+    *pReadSize = 0;
+
+    // Only the chunks that differ from the image are read when the console can hash its memory, the others are
+    // left as they are in pLive
+    if (CanHashOnConsole(pSession))
+    {
+        if (SUCCEEDED(HashLiveChunks(pSession, baseAddress, size, pLiveDigests, numberOfChunks)))
+            return ReadDifferentChunks(pSession, baseAddress, pLive, size, pImageDigests, pLiveDigests, numberOfChunks, pReadSize);
+
+        LogInfo("Hashing the chunks on the console failed, the whole image is read instead.");
+    }
+    else
+        LogInfo("XeCryptSha could not be called on the console, the whole image is read instead.");
+
+    HRESULT hr = ReadMemory(pSession, baseAddress, pLive, size);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    *pReadSize = size;
+    HashChunks(pLive, size, pLiveDigests, numberOfChunks);
+
+    return S_OK;
+}
+
+static HRESULT CompareImages(Session *pSession, const DMN_MODLOAD *pModule, const uint8_t *pImage, const uint8_t *pLive, size_t size, const ChunkDigest *pImageDigests, const ChunkDigest *pLiveDigests)
+{
+    uint32_t baseAddress = (uint32_t)(uintptr_t)pModule->BaseAddress;
+    size_t numberOfChunks = (size + DIFF_CHUNK_SIZE - 1) / DIFF_CHUNK_SIZE;
+
+    char recordPath[MAX_PATH] = { 0 };
+    HRESULT hr = GetDiffRecordPath(pSession, pModule, recordPath, sizeof(recordPath));
+    ChunkDigest *pPreviousDigests = SUCCEEDED(hr) ? ReadDiffRecord(recordPath, numberOfChunks) : NULL;
+
+    size_t numberOfDifferentChunks = 0;
+    size_t numberOfNewChunks = 0;
+    size_t numberOfRanges = 0;
+    size_t numberOfDifferentBytes = 0;
+    DiffRange range = { 0 };
+    BOOL hasRange = FALSE;
+
+    for (size_t chunkIndex = 0; chunkIndex < numberOfChunks; chunkIndex++)
+    {
+        size_t chunkStart = chunkIndex * DIFF_CHUNK_SIZE;
+        size_t chunkSize = GetChunkSize(size, chunkIndex);
+
+        // Only the chunks whose digests differ were read from the console
+        if (!memcmp(&pImageDigests[chunkIndex], &pLiveDigests[chunkIndex], sizeof(ChunkDigest)))
+            continue;
+
+        // Without a previous diff everything is new
+        BOOL isNew = pPreviousDigests == NULL || memcmp(&pPreviousDigests[chunkIndex], &pLiveDigests[chunkIndex], sizeof(ChunkDigest));
+        numberOfDifferentChunks++;
+        if (isNew)
+            numberOfNewChunks++;
+
+        for (size_t i = chunkStart; i < chunkStart + chunkSize; i++)
+        {
+            if (pImage[i] == pLive[i])
+                continue;
+
+            numberOfDifferentBytes++;
+
+            if (hasRange && i - range.End <= DIFF_MERGE_GAP)
+            {
+                range.End = i + 1;
+                range.IsNew |= isNew;
+                continue;
+            }
+
+            if (hasRange)
+            {
+                PrintRange(baseAddress, pImage, pLive, &range);
+                numberOfRanges++;
+            }
+
+            range.Start = i;
+            range.End = i + 1;
+            range.IsNew = isNew;
+            hasRange = TRUE;
+        }
+    }
+
+    if (hasRange)
+    {
+        PrintRange(baseAddress, pImage, pLive, &range);
+        numberOfRanges++;
+    }
+
+    LogInfo(
+        "%zu bytes differ in %zu ranges (%zu of %zu chunks), %zu of these chunks changed since the last diff.",
+        numberOfDifferentBytes,
+        numberOfRanges,
+        numberOfDifferentChunks,
+        numberOfChunks,
+        numberOfNewChunks
+    );
+
+    if (SUCCEEDED(hr))
+        WriteDiffRecord(recordPath, pLiveDigests, numberOfChunks);
+
+    free(pPreviousDigests);
+
+    return S_OK;
+}
+
+static HRESULT LoadLocalImage(const char *localPath, XexImageInfo *pInfo, uint8_t **ppImage)
+{
+    MappedFile file = { 0 };
+    HRESULT hr = MapLocalFile(localPath, &file);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    hr = XexParseHeader(file.pData, file.Size, pInfo);
+    if (FAILED(hr))
+    {
+        UnmapLocalFile(&file);
+        return E_FAIL;
+    }
+
+    uint8_t *pImage = malloc(pInfo->ImageSize);
+    if (pImage == NULL)
+    {
+        LogError("Could not allocate memory for the image of %s.", localPath);
+        UnmapLocalFile(&file);
+
+        return E_FAIL;
+    }
+
+    hr = XexExtractImage(file.pData, file.Size, pInfo, pImage);
+    UnmapLocalFile(&file);
+    if (FAILED(hr))
+    {
+        free(pImage);
+        return E_FAIL;
+    }
+
+    *ppImage = pImage;
+
+    return S_OK;
+}
+
+HRESULT DiffModule(Session *pSession, const char *moduleName, const char *localPath)
+{
+    HRESULT hr = S_OK;
+
+    XexImageInfo info = { 0 };
+    uint8_t *pImage = NULL;
+    hr = LoadLocalImage(localPath, &info, &pImage);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // Accept a full path too, only the file name is known by the loaded module list
+    const char *fileName = strrchr(moduleName, '\\');
+    fileName = fileName != NULL ? fileName + 1 : moduleName;
+
+    const ModuleTable *pLoadedModules = NULL;
+    hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
+    {
+        free(pImage);
+        return E_FAIL;
+    }
+
+    const DMN_MODLOAD *pLoadedModule = FindLoadedModule(pLoadedModules, fileName);
+    if (pLoadedModule == NULL)
+    {
+        LogError("%s is not loaded.", fileName);
+        free(pImage);
+
+        return E_FAIL;
+    }
+
+    // The module could be unloaded during the diff so its info is copied
+    DMN_MODLOAD module = *pLoadedModule;
+
+    // Comparing with another build would only show that everything changed
+    if (module.CheckSum != info.Checksum || module.TimeStamp != info.Timestamp)
+    {
+        LogError("The loaded %s is not the same build as %s (different checksum or timestamp).", fileName, localPath);
+        free(pImage);
+
+        return E_FAIL;
+    }
+
+    if ((uint32_t)(uintptr_t)module.BaseAddress != info.BaseAddress)
+        LogInfo("%s was loaded at 0x%p instead of 0x%08X, relocated addresses will show up as differences.", fileName, module.BaseAddress, info.BaseAddress);
+
+    size_t size = module.Size < info.ImageSize ? module.Size : info.ImageSize;
+    if (module.Size != info.ImageSize)
+        LogInfo("%s is 0x%X bytes in memory but 0x%X bytes in %s, only the first 0x%zX bytes are compared.", fileName, module.Size, info.ImageSize, localPath, size);
+
+    size_t numberOfChunks = (size + DIFF_CHUNK_SIZE - 1) / DIFF_CHUNK_SIZE;
+    uint8_t *pLive = malloc(size);
+    ChunkDigest *pImageDigests = malloc(numberOfChunks * sizeof(ChunkDigest));
+    ChunkDigest *pLiveDigests = malloc(numberOfChunks * sizeof(ChunkDigest));
+    if (pLive == NULL || pImageDigests == NULL || pLiveDigests == NULL)
+    {
+        LogError("Could not allocate memory for the image of %s.", fileName);
+        free(pLiveDigests);
+        free(pImageDigests);
+        free(pLive);
+        free(pImage);
+
+        return E_FAIL;
+    }
+
+    HashChunks(pImage, size, pImageDigests, numberOfChunks);
+
+    size_t readSize = 0;
+    double startTime = GetTimeInMilliseconds();
+    hr = ReadLiveChunks(pSession, (uint32_t)(uintptr_t)module.BaseAddress, pLive, size, pImageDigests, pLiveDigests, numberOfChunks, &readSize);
+    double readTime = GetTimeInMilliseconds() - startTime;
+    if (SUCCEEDED(hr))
+    {
+        LogInfo("Read 0x%zX of the 0x%zX bytes of %s in %.0fms.", readSize, size, fileName, readTime);
+        hr = CompareImages(pSession, &module, pImage, pLive, size, pImageDigests, pLiveDigests);
+    }
+
+    free(pLiveDigests);
+    free(pImageDigests);
+    free(pLive);
+    free(pImage);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+// Prints the ranges of the image of the loaded module named moduleName that differ from the image in the XEX file
+// at localPath on the PC
+HRESULT DiffModule(Session *pSession, const char *moduleName, const char *localPath);
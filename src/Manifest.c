@@ -0,0 +1,271 @@
+#include "Manifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "Modules.h"
+#include "Xex.h"
+
+#define MAX_MANIFEST_MODULES 64
+
+typedef struct _ManifestModule
+{
+    char Path[MAX_PATH];
+    char FileName[MAX_PATH];
+
+    // Indices of the modules of the manifest this module imports
+    size_t Dependencies[MAX_MANIFEST_MODULES];
+    size_t NumberOfDependencies;
+
+    BOOL IsLoaded;
+    BOOL NeedsReload;
+    BOOL IsSorted;
+} ManifestModule;
+
+typedef struct _Manifest
+{
+    ManifestModule Modules[MAX_MANIFEST_MODULES];
+    size_t NumberOfModules;
+
+    // Indices of the modules in the order they can be loaded in (dependencies first)
+    size_t LoadOrder[MAX_MANIFEST_MODULES];
+} Manifest;
+
+static char *TrimWhitespace(char *string)
+{
+    while (*string == ' ' || *string == '\t')
+        string++;
+
+    size_t length = strlen(string);
+    while (length > 0 && (string[length - 1] == ' ' || string[length - 1] == '\t' || string[length - 1] == '\r' || string[length - 1] == '\n'))
+        string[--length] = '\0';
+
+    return string;
+}
+
+static HRESULT ReadManifest(const char *manifestPath, Manifest *pManifest)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, manifestPath, "r");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", manifestPath);
+        return E_FAIL;
+    }
+
+    // Each line is the absolute path of a module on the console, empty lines and lines starting with # are ignored
+    char line[MAX_PATH] = { 0 };
+    while (fgets(line, sizeof(line), pFile) != NULL)
+    {
+        char *modulePath = TrimWhitespace(line);
+        if (modulePath[0] == '\0' || modulePath[0] == '#')
+            continue;
+
+        if (pManifest->NumberOfModules == MAX_MANIFEST_MODULES)
+        {
+            LogError("%s contains more than %d modules.", manifestPath, MAX_MANIFEST_MODULES);
+            fclose(pFile);
+
+            return E_FAIL;
+        }
+
+        ManifestModule *pModule = &pManifest->Modules[pManifest->NumberOfModules++];
+        strncpy_s(pModule->Path, sizeof(pModule->Path), modulePath, _TRUNCATE);
+
+        char baseName[MAX_PATH] = { 0 };
+        char extension[MAX_PATH] = { 0 };
+        err = _splitpath_s(modulePath, NULL, 0, NULL, 0, baseName, sizeof(baseName), extension, sizeof(extension));
+        if (err != 0)
+        {
+            LogError("Could not split path: %s.", modulePath);
+            fclose(pFile);
+
+            return E_FAIL;
+        }
+
+        _snprintf_s(pModule->FileName, sizeof(pModule->FileName), _TRUNCATE, "%s%s", baseName, extension);
+    }
+
+    fclose(pFile);
+
+    if (pManifest->NumberOfModules == 0)
+    {
+        LogError("%s doesn't contain any module.", manifestPath);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT FindDependencies(Session *pSession, Manifest *pManifest, size_t moduleIndex)
+{
+    ManifestModule *pModule = &pManifest->Modules[moduleIndex];
+
+    // The import libraries are read from the file on the console because that's what will actually be loaded
+    uint8_t *pHeader = NULL;
+    size_t headerSize = 0;
+    HRESULT hr = ReadModuleHeader(pSession, pModule->Path, &pHeader, &headerSize);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    const char *importLibraryNames[XEX_MAX_IMPORT_LIBRARIES] = { 0 };
+    size_t numberOfImportLibraries = 0;
+    hr = XexGetImportLibraryNames(pHeader, headerSize, importLibraryNames, ARRAYSIZE(importLibraryNames), &numberOfImportLibraries);
+    if (FAILED(hr))
+    {
+        free(pHeader);
+        return E_FAIL;
+    }
+
+    // Only the imports of other modules of the manifest matter, the system libraries are always loaded
+    for (size_t i = 0; i < numberOfImportLibraries; i++)
+    {
+        for (size_t j = 0; j < pManifest->NumberOfModules; j++)
+        {
+            if (j != moduleIndex && !_stricmp(importLibraryNames[i], pManifest->Modules[j].FileName))
+            {
+                pModule->Dependencies[pModule->NumberOfDependencies++] = j;
+                break;
+            }
+        }
+    }
+
+    free(pHeader);
+
+    return S_OK;
+}
+
+static BOOL AreDependenciesSorted(const Manifest *pManifest, const ManifestModule *pModule)
+{
+    for (size_t i = 0; i < pModule->NumberOfDependencies; i++)
+        if (!pManifest->Modules[pModule->Dependencies[i]].IsSorted)
+            return FALSE;
+
+    return TRUE;
+}
+
+static HRESULT SortModules(Manifest *pManifest)
+{
+    // Repeatedly pick the first module of the manifest whose dependencies are all already picked, so that
+    // the manifest order is kept between modules that don't depend on each other
+    for (size_t sortedCount = 0; sortedCount < pManifest->NumberOfModules; sortedCount++)
+    {
+        size_t nextModuleIndex = SIZE_MAX;
+        for (size_t i = 0; i < pManifest->NumberOfModules; i++)
+        {
+            const ManifestModule *pModule = &pManifest->Modules[i];
+            if (!pModule->IsSorted && AreDependenciesSorted(pManifest, pModule))
+            {
+                nextModuleIndex = i;
+                break;
+            }
+        }
+
+        // All the modules left depend on each other one way or another
+        if (nextModuleIndex == SIZE_MAX)
+        {
+            LogError("The following modules have circular dependencies:");
+            for (size_t i = 0; i < pManifest->NumberOfModules; i++)
+                if (!pManifest->Modules[i].IsSorted)
+                    LogError("    %s", pManifest->Modules[i].Path);
+
+            return E_FAIL;
+        }
+
+        pManifest->Modules[nextModuleIndex].IsSorted = TRUE;
+        pManifest->LoadOrder[sortedCount] = nextModuleIndex;
+    }
+
+    return S_OK;
+}
+
+static HRESULT FindModulesToReload(Session *pSession, Manifest *pManifest, BOOL force)
+{
+    // Go through the modules dependencies first so that whether a dependency gets reloaded is known when its
+    // dependents are checked
+    for (size_t i = 0; i < pManifest->NumberOfModules; i++)
+    {
+        ManifestModule *pModule = &pManifest->Modules[pManifest->LoadOrder[i]];
+
+        HRESULT hr = IsModuleLoaded(pSession, pModule->Path, &pModule->IsLoaded);
+        if (FAILED(hr))
+            return E_FAIL;
+
+        if (!pModule->IsLoaded || force)
+        {
+            pModule->NeedsReload = TRUE;
+            continue;
+        }
+
+        // A module needs to be unloaded before any of its dependencies so it's reloaded if one of them is
+        for (size_t j = 0; j < pModule->NumberOfDependencies; j++)
+            if (pManifest->Modules[pModule->Dependencies[j]].NeedsReload)
+                pModule->NeedsReload = TRUE;
+
+        if (pModule->NeedsReload)
+            continue;
+
+        BOOL isModuleUpToDate = FALSE;
+        hr = IsModuleUpToDate(pSession, pModule->Path, &isModuleUpToDate);
+        if (FAILED(hr))
+            return E_FAIL;
+
+        pModule->NeedsReload = !isModuleUpToDate;
+    }
+
+    return S_OK;
+}
+
+HRESULT ReloadManifest(Session *pSession, const char *manifestPath, BOOL force)
+{
+    HRESULT hr = S_OK;
+
+    Manifest *pManifest = calloc(1, sizeof(Manifest));
+    if (pManifest == NULL)
+    {
+        LogError("Could not allocate memory for the manifest.");
+        return E_FAIL;
+    }
+
+    hr = ReadManifest(manifestPath, pManifest);
+    for (size_t i = 0; i < pManifest->NumberOfModules && SUCCEEDED(hr); i++)
+        hr = FindDependencies(pSession, pManifest, i);
+    if (SUCCEEDED(hr))
+        hr = SortModules(pManifest);
+    if (SUCCEEDED(hr))
+        hr = FindModulesToReload(pSession, pManifest, force);
+
+    if (FAILED(hr))
+    {
+        free(pManifest);
+        return E_FAIL;
+    }
+
+    // Unload the modules that need to be reloaded, dependents first
+    const char *modulesToUnload[MAX_MANIFEST_MODULES] = { 0 };
+    size_t numberOfModulesToUnload = 0;
+    for (size_t i = pManifest->NumberOfModules; i-- > 0;)
+    {
+        const ManifestModule *pModule = &pManifest->Modules[pManifest->LoadOrder[i]];
+        if (pModule->NeedsReload && pModule->IsLoaded)
+            modulesToUnload[numberOfModulesToUnload++] = pModule->Path;
+    }
+
+    hr = UnloadModules(pSession, modulesToUnload, numberOfModulesToUnload);
+
+    // Then load them back, dependencies first
+    for (size_t i = 0; i < pManifest->NumberOfModules && SUCCEEDED(hr); i++)
+    {
+        const ManifestModule *pModule = &pManifest->Modules[pManifest->LoadOrder[i]];
+        if (pModule->NeedsReload)
+            hr = Load(pSession, pModule->Path);
+        else
+            LogInfo("%s is already up to date, use --force to reload it anyway.", pModule->Path);
+    }
+
+    free(pManifest);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+HRESULT ReloadManifest(Session *pSession, const char *manifestPath, BOOL force);
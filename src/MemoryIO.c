@@ -0,0 +1,502 @@
+#include "MemoryIO.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ByteSwap.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Utils.h"
+
+// Merged requests are transferred by chunks of this size, several read chunks are in flight at the same time
+#define MEMORY_CHUNK_SIZE 0x10000
+
+// Reading a few bytes nobody asked for is cheaper than another round trip, so reads this close to each other are
+// merged too. Writes are only merged when they touch since the bytes in between would be overwritten.
+#define MAX_READ_GAP 0x400
+
+#define RESPONSE_SIZE 512
+
+// Requests merged together, transferred through a single buffer
+typedef struct _MemoryRange
+{
+    uint32_t Address;
+    size_t Size;
+    uint8_t *pData;
+} MemoryRange;
+
+typedef struct _ReadChunk
+{
+    uint32_t Address;
+    uint8_t *pData;
+    uint32_t Size;
+
+    // E_PENDING until a worker picks the chunk up
+    HRESULT Result;
+} ReadChunk;
+
+typedef struct _ReadQueue
+{
+    Session *pSession;
+    ReadChunk *pChunks;
+    size_t NumberOfChunks;
+    volatile LONG NextChunk;
+} ReadQueue;
+
+typedef struct _ReadWorker
+{
+    ReadQueue *pQueue;
+    HANDLE Thread;
+
+    // Added to the stats of the session once all the workers are done
+    Stats Stats;
+} ReadWorker;
+
+static int CompareRequests(const void *pFirst, const void *pSecond)
+{
+    const MemoryRequest *pFirstRequest = *(const MemoryRequest **)pFirst;
+    const MemoryRequest *pSecondRequest = *(const MemoryRequest **)pSecond;
+
+    if (pFirstRequest->Address != pSecondRequest->Address)
+        return pFirstRequest->Address < pSecondRequest->Address ? -1 : 1;
+
+    return 0;
+}
+
+static void FreeRanges(MemoryRange *pRanges, size_t numberOfRanges)
+{
+    if (pRanges == NULL)
+        return;
+
+    for (size_t i = 0; i < numberOfRanges; i++)
+        free(pRanges[i].pData);
+
+    free(pRanges);
+}
+
+static HRESULT MergeRequests(const MemoryRequest *requests, size_t numberOfRequests, MemoryRequestType type, MemoryRange **ppRanges, size_t *pNumberOfRanges)
+{
+    *ppRanges = NULL;
+    *pNumberOfRanges = 0;
+
+    const MemoryRequest **ppSortedRequests = malloc(numberOfRequests * sizeof(MemoryRequest *));
+    MemoryRange *pRanges = calloc(numberOfRequests, sizeof(MemoryRange));
+    if (ppSortedRequests == NULL || pRanges == NULL)
+    {
+        LogError("Could not allocate memory for the memory requests.");
+        free(ppSortedRequests);
+        free(pRanges);
+
+        return E_FAIL;
+    }
+
+    size_t numberOfSortedRequests = 0;
+    for (size_t i = 0; i < numberOfRequests; i++)
+        if (requests[i].Type == type && requests[i].Size > 0)
+            ppSortedRequests[numberOfSortedRequests++] = &requests[i];
+
+    qsort(ppSortedRequests, numberOfSortedRequests, sizeof(MemoryRequest *), CompareRequests);
+
+    // Grow the current range as long as the next request starts before it ends (or close enough for reads)
+    uint64_t maxGap = type == MemoryRequestType_Read ? MAX_READ_GAP : 0;
+    size_t numberOfRanges = 0;
+    uint64_t rangeEnd = 0;
+    for (size_t i = 0; i < numberOfSortedRequests; i++)
+    {
+        const MemoryRequest *pRequest = ppSortedRequests[i];
+        uint64_t requestEnd = (uint64_t)pRequest->Address + pRequest->Size;
+
+        if (numberOfRanges > 0 && pRequest->Address <= rangeEnd + maxGap)
+        {
+            if (requestEnd > rangeEnd)
+                rangeEnd = requestEnd;
+        }
+        else
+        {
+            numberOfRanges++;
+            pRanges[numberOfRanges - 1].Address = pRequest->Address;
+            rangeEnd = requestEnd;
+        }
+
+        pRanges[numberOfRanges - 1].Size = (size_t)(rangeEnd - pRanges[numberOfRanges - 1].Address);
+    }
+
+    free(ppSortedRequests);
+
+    for (size_t i = 0; i < numberOfRanges; i++)
+    {
+        pRanges[i].pData = malloc(pRanges[i].Size);
+        if (pRanges[i].pData == NULL)
+        {
+            LogError("Could not allocate memory for the memory requests.");
+            FreeRanges(pRanges, numberOfRanges);
+
+            return E_FAIL;
+        }
+    }
+
+    *ppRanges = pRanges;
+    *pNumberOfRanges = numberOfRanges;
+
+    return S_OK;
+}
+
+static const MemoryRange *FindRange(const MemoryRange *pRanges, size_t numberOfRanges, const MemoryRequest *pRequest)
+{
+    // Every request ended up in exactly one range
+    for (size_t i = 0; i < numberOfRanges; i++)
+        if (pRequest->Address >= pRanges[i].Address && pRequest->Address - pRanges[i].Address < pRanges[i].Size)
+            return &pRanges[i];
+
+    return NULL;
+}
+
+static HRESULT ReadChunkOnConnection(PDM_CONNECTION connection, ReadChunk *pChunk, Stats *pStats)
+{
+    HRESULT hr = S_OK;
+
+    // DmGetMemory can't be used because it always goes through the shared connection, getmem2 sends the memory
+    // back as binary data right after the response
+    char command[60] = { 0 };
+    _snprintf_s(command, sizeof(command), _TRUNCATE, "getmem2 addr=0x%08x length=0x%x", pChunk->Address, pChunk->Size);
+
+    char response[RESPONSE_SIZE] = { 0 };
+    size_t responseSize = RESPONSE_SIZE;
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmSendCommand", command);
+    hr = DmSendCommand(connection, command, response, (DWORD *)&responseSize);
+    AddRoundTrip(pStats, strnlen_s(command, sizeof(command)), strnlen_s(response, RESPONSE_SIZE));
+    EndTraceSpan(&span, strnlen_s(command, sizeof(command)), strnlen_s(response, RESPONSE_SIZE));
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    if (strncmp(response, "203", 3))
+    {
+        LogError("Could not read 0x%X bytes at 0x%08X: %s", pChunk->Size, pChunk->Address, response);
+        return E_FAIL;
+    }
+
+    // The connection can't be used anymore if the memory was only partially received
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReceiveBinary", "Memory");
+    hr = DmReceiveBinary(connection, pChunk->pData, pChunk->Size, NULL);
+    EndTraceSpan(&span, 0, pChunk->Size);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_ABORT;
+    }
+
+    pStats->BytesReceived += pChunk->Size;
+
+    return S_OK;
+}
+
+static DWORD WINAPI RunReadWorker(void *pParameter)
+{
+    ReadWorker *pWorker = pParameter;
+    ReadQueue *pQueue = pWorker->pQueue;
+
+    // Each worker reads on its own connection so that the chunks are actually in flight at the same time
+    PDM_CONNECTION connection = NULL;
+    HRESULT hr = AcquireRpcConnection(pQueue->pSession, &connection, &pWorker->Stats);
+    if (FAILED(hr))
+        return 1;
+
+    // Take the next chunk in the queue until it's empty
+    for (;;)
+    {
+        size_t chunkIndex = (size_t)InterlockedIncrement(&pQueue->NextChunk) - 1;
+        if (chunkIndex >= pQueue->NumberOfChunks)
+            break;
+
+        ReadChunk *pChunk = &pQueue->pChunks[chunkIndex];
+        hr = ReadChunkOnConnection(connection, pChunk, &pWorker->Stats);
+        pChunk->Result = SUCCEEDED(hr) ? S_OK : E_FAIL;
+
+        // The console is in an unknown state on this connection, let the other workers finish the queue
+        if (hr == E_ABORT)
+            break;
+    }
+
+    ReleaseRpcConnection(pQueue->pSession, connection, hr == E_ABORT);
+
+    return 0;
+}
+
+static HRESULT ReadRanges(Session *pSession, MemoryRange *pRanges, size_t numberOfRanges)
+{
+    HRESULT hr = S_OK;
+
+    size_t numberOfChunks = 0;
+    for (size_t i = 0; i < numberOfRanges; i++)
+        numberOfChunks += (pRanges[i].Size + MEMORY_CHUNK_SIZE - 1) / MEMORY_CHUNK_SIZE;
+
+    if (numberOfChunks == 0)
+        return S_OK;
+
+    ReadChunk *pChunks = calloc(numberOfChunks, sizeof(ReadChunk));
+    if (pChunks == NULL)
+    {
+        LogError("Could not allocate memory for the memory chunks.");
+        return E_FAIL;
+    }
+
+    // Split the ranges into chunks that point directly into the buffers of the ranges
+    size_t chunkIndex = 0;
+    for (size_t i = 0; i < numberOfRanges; i++)
+    {
+        for (size_t offset = 0; offset < pRanges[i].Size; offset += MEMORY_CHUNK_SIZE)
+        {
+            ReadChunk *pChunk = &pChunks[chunkIndex++];
+            pChunk->Address = pRanges[i].Address + (uint32_t)offset;
+            pChunk->pData = pRanges[i].pData + offset;
+            pChunk->Size = (uint32_t)(pRanges[i].Size - offset < MEMORY_CHUNK_SIZE ? pRanges[i].Size - offset : MEMORY_CHUNK_SIZE);
+            pChunk->Result = E_PENDING;
+        }
+    }
+
+    ReadQueue queue = { 0 };
+    queue.pSession = pSession;
+    queue.pChunks = pChunks;
+    queue.NumberOfChunks = numberOfChunks;
+
+    size_t numberOfWorkers = numberOfChunks < MAX_RPC_CONNECTIONS ? numberOfChunks : MAX_RPC_CONNECTIONS;
+    ReadWorker workers[MAX_RPC_CONNECTIONS] = { 0 };
+    HANDLE threads[MAX_RPC_CONNECTIONS] = { 0 };
+    size_t numberOfThreads = 0;
+
+    // A single chunk doesn't need another thread
+    if (numberOfWorkers == 1)
+    {
+        workers[0].pQueue = &queue;
+        RunReadWorker(&workers[0]);
+    }
+    else
+    {
+        for (size_t i = 0; i < numberOfWorkers; i++)
+        {
+            workers[i].pQueue = &queue;
+            workers[i].Thread = CreateThread(NULL, 0, RunReadWorker, &workers[i], 0, NULL);
+            if (workers[i].Thread == NULL)
+            {
+                LogError("Could not create a thread to read memory.");
+                continue;
+            }
+
+            threads[numberOfThreads++] = workers[i].Thread;
+        }
+
+        // Read from this thread if no thread could be created
+        if (numberOfThreads == 0)
+            RunReadWorker(&workers[0]);
+
+        WaitForMultipleObjects((DWORD)numberOfThreads, threads, TRUE, INFINITE);
+    }
+
+    for (size_t i = 0; i < numberOfWorkers; i++)
+    {
+        if (workers[i].Thread != NULL)
+            CloseHandle(workers[i].Thread);
+
+        AddStats(&pSession->Stats, &workers[i].Stats);
+    }
+
+    for (size_t i = 0; i < numberOfChunks; i++)
+    {
+        if (pChunks[i].Result == E_PENDING)
+            LogError("0x%X bytes at 0x%08X were not read.", pChunks[i].Size, pChunks[i].Address);
+
+        if (FAILED(pChunks[i].Result))
+            hr = E_FAIL;
+    }
+
+    free(pChunks);
+
+    return hr;
+}
+
+static HRESULT WriteRanges(Session *pSession, const MemoryRange *pRanges, size_t numberOfRanges)
+{
+    // DmSetMemory is the only way to write memory so the chunks are written one after the other on the shared
+    // connection, the merging still saves a round trip per request
+    for (size_t i = 0; i < numberOfRanges; i++)
+    {
+        for (size_t offset = 0; offset < pRanges[i].Size; offset += MEMORY_CHUNK_SIZE)
+        {
+            void *pAddress = (void *)(uintptr_t)(pRanges[i].Address + offset);
+            DWORD chunkSize = (DWORD)(pRanges[i].Size - offset < MEMORY_CHUNK_SIZE ? pRanges[i].Size - offset : MEMORY_CHUNK_SIZE);
+
+            DWORD bytesWritten = 0;
+            TraceSpan span;
+            BeginTraceSpan(&span, TRACE_XBDM, "DmSetMemory", NULL);
+            HRESULT hr = DmSetMemory(pAddress, chunkSize, pRanges[i].pData + offset, &bytesWritten);
+            RecordRoundTrip(pSession, chunkSize, 0);
+            EndTraceSpan(&span, chunkSize, 0);
+            if (FAILED(hr))
+            {
+                LogXbdmError(hr);
+                return E_FAIL;
+            }
+
+            if (bytesWritten != chunkSize)
+            {
+                LogError("Expected to write %d bytes at %p but only wrote %d.", chunkSize, pAddress, bytesWritten);
+                return E_FAIL;
+            }
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT TransferMemory(Session *pSession, const MemoryRequest *requests, size_t numberOfRequests)
+{
+    HRESULT hr = S_OK;
+
+    if (numberOfRequests == 0)
+        return S_OK;
+
+    MemoryRange *pRanges = NULL;
+    size_t numberOfRanges = 0;
+
+    // Writes first, each request is copied to its range in the order they were given so that the last one wins
+    hr = MergeRequests(requests, numberOfRequests, MemoryRequestType_Write, &pRanges, &numberOfRanges);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    for (size_t i = 0; i < numberOfRequests; i++)
+    {
+        const MemoryRequest *pRequest = &requests[i];
+        if (pRequest->Type != MemoryRequestType_Write || pRequest->Size == 0)
+            continue;
+
+        const MemoryRange *pRange = FindRange(pRanges, numberOfRanges, pRequest);
+        memcpy(pRange->pData + (pRequest->Address - pRange->Address), pRequest->pData, pRequest->Size);
+    }
+
+    hr = WriteRanges(pSession, pRanges, numberOfRanges);
+    FreeRanges(pRanges, numberOfRanges);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // Then reads, each request gets its part of the range it ended up in
+    hr = MergeRequests(requests, numberOfRequests, MemoryRequestType_Read, &pRanges, &numberOfRanges);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    hr = ReadRanges(pSession, pRanges, numberOfRanges);
+    if (FAILED(hr))
+    {
+        FreeRanges(pRanges, numberOfRanges);
+        return E_FAIL;
+    }
+
+    for (size_t i = 0; i < numberOfRequests; i++)
+    {
+        const MemoryRequest *pRequest = &requests[i];
+        if (pRequest->Type != MemoryRequestType_Read || pRequest->Size == 0)
+            continue;
+
+        const MemoryRange *pRange = FindRange(pRanges, numberOfRanges, pRequest);
+        memcpy(pRequest->pData, pRange->pData + (pRequest->Address - pRange->Address), pRequest->Size);
+    }
+
+    FreeRanges(pRanges, numberOfRanges);
+
+    return S_OK;
+}
+
+HRESULT ReadMemory(Session *pSession, uint32_t address, void *pData, size_t size)
+{
+    MemoryRequest request = { 0 };
+    request.Type = MemoryRequestType_Read;
+    request.Address = address;
+    request.pData = pData;
+    request.Size = size;
+
+    return TransferMemory(pSession, &request, 1);
+}
+
+HRESULT WriteMemory(Session *pSession, uint32_t address, const void *pData, size_t size)
+{
+    MemoryRequest request = { 0 };
+    request.Type = MemoryRequestType_Write;
+    request.Address = address;
+    request.pData = (void *)pData;
+    request.Size = size;
+
+    return TransferMemory(pSession, &request, 1);
+}
+
+HRESULT ReadMemory16(Session *pSession, uint32_t address, uint16_t *pValues, size_t numberOfValues)
+{
+    HRESULT hr = ReadMemory(pSession, address, pValues, numberOfValues * sizeof(uint16_t));
+    if (SUCCEEDED(hr))
+        ByteSwapArray16(pValues, numberOfValues);
+
+    return hr;
+}
+
+HRESULT ReadMemory32(Session *pSession, uint32_t address, uint32_t *pValues, size_t numberOfValues)
+{
+    HRESULT hr = ReadMemory(pSession, address, pValues, numberOfValues * sizeof(uint32_t));
+    if (SUCCEEDED(hr))
+        ByteSwapArray32(pValues, numberOfValues);
+
+    return hr;
+}
+
+HRESULT ReadMemory64(Session *pSession, uint32_t address, uint64_t *pValues, size_t numberOfValues)
+{
+    HRESULT hr = ReadMemory(pSession, address, pValues, numberOfValues * sizeof(uint64_t));
+    if (SUCCEEDED(hr))
+        ByteSwapArray64(pValues, numberOfValues);
+
+    return hr;
+}
+
+// The values of the caller are left untouched, they're swapped in a copy
+static HRESULT WriteSwappedMemory(Session *pSession, uint32_t address, const void *pValues, size_t numberOfValues, size_t valueSize)
+{
+    size_t size = numberOfValues * valueSize;
+    void *pSwappedValues = malloc(size);
+    if (pSwappedValues == NULL)
+    {
+        LogError("Could not allocate memory for the values to write.");
+        return E_FAIL;
+    }
+
+    memcpy(pSwappedValues, pValues, size);
+
+    if (valueSize == sizeof(uint16_t))
+        ByteSwapArray16(pSwappedValues, numberOfValues);
+    else if (valueSize == sizeof(uint32_t))
+        ByteSwapArray32(pSwappedValues, numberOfValues);
+    else
+        ByteSwapArray64(pSwappedValues, numberOfValues);
+
+    HRESULT hr = WriteMemory(pSession, address, pSwappedValues, size);
+
+    free(pSwappedValues);
+
+    return hr;
+}
+
+HRESULT WriteMemory16(Session *pSession, uint32_t address, const uint16_t *pValues, size_t numberOfValues)
+{
+    return WriteSwappedMemory(pSession, address, pValues, numberOfValues, sizeof(uint16_t));
+}
+
+HRESULT WriteMemory32(Session *pSession, uint32_t address, const uint32_t *pValues, size_t numberOfValues)
+{
+    return WriteSwappedMemory(pSession, address, pValues, numberOfValues, sizeof(uint32_t));
+}
+
+HRESULT WriteMemory64(Session *pSession, uint32_t address, const uint64_t *pValues, size_t numberOfValues)
+{
+    return WriteSwappedMemory(pSession, address, pValues, numberOfValues, sizeof(uint64_t));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <Windows.h>
+
+#include "Session.h"
+
+typedef enum _MemoryRequestType
+{
+    MemoryRequestType_Read,
+    MemoryRequestType_Write,
+} MemoryRequestType;
+
+typedef struct _MemoryRequest
+{
+    MemoryRequestType Type;
+    uint32_t Address;
+
+    // Where the read bytes are written to or where the bytes to write are read from
+    void *pData;
+    size_t Size;
+} MemoryRequest;
+
+// Runs all the requests in as few transfers as possible, the requests next to or overlapping each other are merged.
+// The writes are done first, in the order they're given (the last one wins where they overlap), then the reads.
+// Can only be called from the thread that owns the session.
+HRESULT TransferMemory(Session *pSession, const MemoryRequest *requests, size_t numberOfRequests);
+
+HRESULT ReadMemory(Session *pSession, uint32_t address, void *pData, size_t size);
+
+HRESULT WriteMemory(Session *pSession, uint32_t address, const void *pData, size_t size);
+
+// Read or write arrays of big-endian values, the values are in the byte order of the PC on this side
+HRESULT ReadMemory16(Session *pSession, uint32_t address, uint16_t *pValues, size_t numberOfValues);
+
+HRESULT ReadMemory32(Session *pSession, uint32_t address, uint32_t *pValues, size_t numberOfValues);
+
+HRESULT ReadMemory64(Session *pSession, uint32_t address, uint64_t *pValues, size_t numberOfValues);
+
+HRESULT WriteMemory16(Session *pSession, uint32_t address, const uint16_t *pValues, size_t numberOfValues);
+
+HRESULT WriteMemory32(Session *pSession, uint32_t address, const uint32_t *pValues, size_t numberOfValues);
+
+HRESULT WriteMemory64(Session *pSession, uint32_t address, const uint64_t *pValues, size_t numberOfValues);
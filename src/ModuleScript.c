@@ -0,0 +1,194 @@
+#include "ModuleScript.h"
+
+#include <string.h>
+
+#include "Log.h"
+#include "Trace.h"
+#include "XDRPC.h"
+
+// Everything is big-endian, like the console. The script starts with a header:
+//
+// u32 magic ("MLSC") | u16 version | u16 number of operations
+//
+// followed by the operations, each made of a header and its data padded to 4 bytes:
+//
+// u8 type | u8 index of the GetHandle operation whose handle is used (0xFF if none) | u16 size of the data
+//
+// - GetHandle: the path of the module, null-terminated
+// - SetLoadCount: u16 load count | u16 padding
+// - Unload: no data
+// - Load: u32 flags | the path of the module, null-terminated
+//
+// The results are one u32 status | u32 value per operation that was run.
+#define MODULE_SCRIPT_MAGIC 0x4D4C5343 // "MLSC"
+#define MODULE_SCRIPT_VERSION 1
+#define MODULE_SCRIPT_HEADER_SIZE 8
+#define MODULE_OPERATION_HEADER_SIZE 4
+#define MODULE_OPERATION_NO_HANDLE 0xFF
+#define MODULE_OPERATION_RESULT_SIZE 8
+
+static void WriteUInt16(uint8_t *pLocation, uint16_t value)
+{
+    pLocation[0] = (uint8_t)(value >> 8);
+    pLocation[1] = (uint8_t)value;
+}
+
+static void WriteUInt32(uint8_t *pLocation, uint32_t value)
+{
+    pLocation[0] = (uint8_t)(value >> 24);
+    pLocation[1] = (uint8_t)(value >> 16);
+    pLocation[2] = (uint8_t)(value >> 8);
+    pLocation[3] = (uint8_t)value;
+}
+
+static uint32_t ReadUInt32(const uint8_t *pLocation)
+{
+    return ((uint32_t)pLocation[0] << 24) | ((uint32_t)pLocation[1] << 16) | ((uint32_t)pLocation[2] << 8) | pLocation[3];
+}
+
+void InitModuleScript(ModuleScript *pScript)
+{
+    ZeroMemory(pScript, sizeof(*pScript));
+
+    WriteUInt32(pScript->Data, MODULE_SCRIPT_MAGIC);
+    WriteUInt16(pScript->Data + 4, MODULE_SCRIPT_VERSION);
+    pScript->Size = MODULE_SCRIPT_HEADER_SIZE;
+    pScript->Result = S_OK;
+}
+
+static HRESULT AddOperation(ModuleScript *pScript, ModuleOperationType type, size_t handleOperationIndex, const void *pData, size_t dataSize, const char *modulePath)
+{
+    // The path is appended after the fixed data of the operation, with its null terminator
+    size_t pathSize = modulePath != NULL ? strlen(modulePath) + 1 : 0;
+    size_t operationDataSize = dataSize + pathSize;
+    size_t alignedSize = MODULE_OPERATION_HEADER_SIZE + ((operationDataSize + 3) & ~(size_t)3);
+
+    // Not logged, the caller can still do the operations one by one
+    if (pScript->NumberOfOperations == MODULE_SCRIPT_MAX_OPERATIONS || alignedSize > MODULE_SCRIPT_MAX_SIZE - pScript->Size)
+    {
+        pScript->Result = E_FAIL;
+        return E_FAIL;
+    }
+
+    // Only the handles of earlier GetHandle operations can be used
+    if (handleOperationIndex != MODULE_OPERATION_NO_HANDLE && handleOperationIndex >= pScript->NumberOfOperations)
+    {
+        LogError("Operation %zu of the module script does not exist yet.", handleOperationIndex);
+        pScript->Result = E_FAIL;
+
+        return E_FAIL;
+    }
+
+    uint8_t *pOperation = pScript->Data + pScript->Size;
+    ZeroMemory(pOperation, alignedSize);
+    pOperation[0] = (uint8_t)type;
+    pOperation[1] = (uint8_t)handleOperationIndex;
+    WriteUInt16(pOperation + 2, (uint16_t)operationDataSize);
+
+    if (dataSize > 0)
+        memcpy(pOperation + MODULE_OPERATION_HEADER_SIZE, pData, dataSize);
+
+    if (pathSize > 0)
+        memcpy(pOperation + MODULE_OPERATION_HEADER_SIZE + dataSize, modulePath, pathSize);
+
+    pScript->Size += alignedSize;
+    pScript->NumberOfOperations++;
+    WriteUInt16(pScript->Data + 6, (uint16_t)pScript->NumberOfOperations);
+
+    return S_OK;
+}
+
+HRESULT AddGetHandleOperation(ModuleScript *pScript, const char *modulePath, size_t *pOperationIndex)
+{
+    *pOperationIndex = pScript->NumberOfOperations;
+
+    return AddOperation(pScript, ModuleOperationType_GetHandle, MODULE_OPERATION_NO_HANDLE, NULL, 0, modulePath);
+}
+
+HRESULT AddSetLoadCountOperation(ModuleScript *pScript, size_t handleOperationIndex, uint16_t loadCount)
+{
+    uint8_t data[4] = { 0 };
+    WriteUInt16(data, loadCount);
+
+    return AddOperation(pScript, ModuleOperationType_SetLoadCount, handleOperationIndex, data, sizeof(data), NULL);
+}
+
+HRESULT AddUnloadOperation(ModuleScript *pScript, size_t handleOperationIndex)
+{
+    return AddOperation(pScript, ModuleOperationType_Unload, handleOperationIndex, NULL, 0, NULL);
+}
+
+HRESULT AddLoadOperation(ModuleScript *pScript, const char *modulePath, uint32_t flags)
+{
+    uint8_t data[4] = { 0 };
+    WriteUInt32(data, flags);
+
+    return AddOperation(pScript, ModuleOperationType_Load, MODULE_OPERATION_NO_HANDLE, data, sizeof(data), modulePath);
+}
+
+HRESULT DecodeModuleScriptResults(const uint8_t *pData, size_t dataSize, uint64_t numberOfOperationsRun, size_t numberOfOperations, ModuleOperationResult *pResults)
+{
+    // A helper that doesn't follow the contract could return anything
+    if (numberOfOperationsRun > numberOfOperations || numberOfOperationsRun * MODULE_OPERATION_RESULT_SIZE > dataSize)
+    {
+        LogError("The module helper reported %llu operations run out of %zu.", numberOfOperationsRun, numberOfOperations);
+        return E_FAIL;
+    }
+
+    for (size_t i = 0; i < (size_t)numberOfOperationsRun; i++)
+    {
+        pResults[i].Status = ReadUInt32(pData + i * MODULE_OPERATION_RESULT_SIZE);
+        pResults[i].Value = ReadUInt32(pData + i * MODULE_OPERATION_RESULT_SIZE + 4);
+    }
+
+    return S_OK;
+}
+
+HRESULT IsModuleHelperLoaded(Session *pSession)
+{
+    // The loaded modules are cached by the session so this usually doesn't cost a round trip
+    const ModuleTable *pLoadedModules = NULL;
+    HRESULT hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    return FindLoadedModule(pLoadedModules, MODULE_HELPER_NAME) != NULL ? S_OK : S_FALSE;
+}
+
+HRESULT RunModuleScript(Session *pSession, const ModuleScript *pScript, ModuleOperationResult *pResults, size_t *pNumberOfOperationsRun)
+{
+    if (FAILED(pScript->Result))
+        return E_FAIL;
+
+    uint8_t results[MODULE_SCRIPT_MAX_OPERATIONS * MODULE_OPERATION_RESULT_SIZE] = { 0 };
+    uint64_t scriptSize = pScript->Size;
+    uint64_t resultsSize = pScript->NumberOfOperations * MODULE_OPERATION_RESULT_SIZE;
+    uint64_t numberOfOperationsRun = 0;
+
+    XdrpcArgInfo args[4] = { { 0 }, { 0 }, { 0 }, { 0 } };
+    args[0].pData = pScript->Data;
+    args[0].Type = XdrpcArgType_Buffer;
+    args[0].Size = pScript->Size;
+    args[1].pData = &scriptSize;
+    args[1].Type = XdrpcArgType_Integer;
+    args[2].Type = XdrpcArgType_Buffer;
+    args[2].Size = (size_t)resultsSize;
+    args[2].pOutData = results;
+    args[3].pData = &resultsSize;
+    args[3].Type = XdrpcArgType_Integer;
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "RunModuleScript", NULL);
+    HRESULT hr = XdrpcCall(pSession, MODULE_HELPER_NAME, MODULE_HELPER_ORDINAL, args, 4, &numberOfOperationsRun);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    hr = DecodeModuleScriptResults(results, sizeof(results), numberOfOperationsRun, pScript->NumberOfOperations, pResults);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    *pNumberOfOperationsRun = (size_t)numberOfOperationsRun;
+
+    return S_OK;
+}
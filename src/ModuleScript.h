@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <Windows.h>
+
+#include "Session.h"
+
+// A helper module loaded on the console can run several module operations in a single RPC instead of one round trip
+// per step. It exports RunModuleScript as ordinal 1:
+//
+// DWORD RunModuleScript(const BYTE *pScript, DWORD scriptSize, BYTE *pResults, DWORD resultsSize)
+//
+// which runs the operations of the script in order, stops after the first one that fails, writes a result for each
+// operation it ran and returns how many it ran. The encoding is described in ModuleScript.c.
+#define MODULE_HELPER_NAME "ModuleLoaderHelper.xex"
+#define MODULE_HELPER_ORDINAL 1
+
+// The script and the results both need to fit in the RPC buffer along with the header and the module name
+#define MODULE_SCRIPT_MAX_SIZE 0xD00
+#define MODULE_SCRIPT_MAX_OPERATIONS 32
+
+typedef enum _ModuleOperationType
+{
+    // Looks up the handle of a loaded module from its path
+    ModuleOperationType_GetHandle = 1,
+
+    // Writes the load count of the module whose handle was looked up by a previous operation
+    ModuleOperationType_SetLoadCount = 2,
+
+    // Calls XexUnloadImage with the handle looked up by a previous operation
+    ModuleOperationType_Unload = 3,
+
+    // Calls XexLoadImage with a path and flags
+    ModuleOperationType_Load = 4,
+} ModuleOperationType;
+
+typedef struct _ModuleScript
+{
+    uint8_t Data[MODULE_SCRIPT_MAX_SIZE];
+    size_t Size;
+    size_t NumberOfOperations;
+
+    // Set when adding an operation failed (most likely because the script is full), so that the caller only has to
+    // check it once all the operations are added
+    HRESULT Result;
+} ModuleScript;
+
+typedef struct _ModuleOperationResult
+{
+    // NTSTATUS returned by the operation
+    uint32_t Status;
+
+    // The handle for GetHandle, 0 for the other operations
+    uint32_t Value;
+} ModuleOperationResult;
+
+void InitModuleScript(ModuleScript *pScript);
+
+// The index of the operation is written to pOperationIndex, to pass it to the operations that use the handle
+HRESULT AddGetHandleOperation(ModuleScript *pScript, const char *modulePath, size_t *pOperationIndex);
+
+HRESULT AddSetLoadCountOperation(ModuleScript *pScript, size_t handleOperationIndex, uint16_t loadCount);
+
+HRESULT AddUnloadOperation(ModuleScript *pScript, size_t handleOperationIndex);
+
+HRESULT AddLoadOperation(ModuleScript *pScript, const char *modulePath, uint32_t flags);
+
+// Turns the results written by the helper into results on this side, pResults needs to hold
+// numberOfOperationsRun results
+HRESULT DecodeModuleScriptResults(const uint8_t *pData, size_t dataSize, uint64_t numberOfOperationsRun, size_t numberOfOperations, ModuleOperationResult *pResults);
+
+// Returns S_FALSE without sending anything when the helper is not loaded on the console
+HRESULT IsModuleHelperLoaded(Session *pSession);
+
+// Sends the script to the helper, pResults needs to hold the NumberOfOperations of the script and the number of
+// operations the helper ran is written to pNumberOfOperationsRun
+HRESULT RunModuleScript(Session *pSession, const ModuleScript *pScript, ModuleOperationResult *pResults, size_t *pNumberOfOperationsRun);
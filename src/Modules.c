@@ -5,21 +5,25 @@
 #include <stdlib.h>
 #include <string.h>
 
-// XBDM uses bit field types other than int which triggers a warning at warning level 4
-// so we just disable it for XBDM
-#pragma warning(push)
-#pragma warning(disable : 4214)
-#include <xbdm.h>
-#pragma warning(pop)
-
 #include "Log.h"
+#include "MemoryIO.h"
+#include "ModuleScript.h"
+#include "Trace.h"
 #include "Utils.h"
 #include "XDRPC.h"
+#include "Xex.h"
+
+// The optional headers are at the beginning of the file, this is enough to hold them in almost all cases
+#define XEX_HEADER_READ_SIZE 0x1000
 
-static HRESULT FileExists(const char *filePath, BOOL *pFileExists)
+static HRESULT FileExists(Session *pSession, const char *filePath, BOOL *pFileExists)
 {
     DM_FILE_ATTRIBUTES fileAttributes = { 0 };
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmGetFileAttributes", filePath);
     HRESULT hr = DmGetFileAttributes(filePath, &fileAttributes);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
     if (hr == XBDM_NOERR)
     {
         *pFileExists = TRUE;
@@ -51,13 +55,10 @@ static HRESULT GetFileNameFromPath(const char *filePath, char *fileName, size_t
     return S_OK;
 }
 
-static HRESULT IsModuleLoaded(const char *modulePath, BOOL *pIsLoaded)
+HRESULT IsModuleLoaded(Session *pSession, const char *modulePath, BOOL *pIsLoaded)
 {
     HRESULT hr = S_OK;
 
-    PDM_WALK_MODULES pModuleWalker = NULL;
-    DMN_MODLOAD loadedModule = { 0 };
-
     char fileName[MAX_PATH] = { 0 };
 
     // Get the file name from modulePath (base name + extension)
@@ -65,80 +66,171 @@ static HRESULT IsModuleLoaded(const char *modulePath, BOOL *pIsLoaded)
     if (FAILED(hr))
         return E_FAIL;
 
-    // Go through the loaded modules and check if fileName is in them
-    while ((hr = DmWalkLoadedModules(&pModuleWalker, &loadedModule)) == XBDM_NOERR)
-        if (!strncmp(fileName, loadedModule.Name, sizeof(fileName)))
-            *pIsLoaded = TRUE;
+    // Look for fileName in the loaded modules, the console is only queried if they could have changed
+    const ModuleTable *pLoadedModules = NULL;
+    hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
+        return hr;
+
+    *pIsLoaded = FindLoadedModule(pLoadedModules, fileName) != NULL;
+
+    return S_OK;
+}
 
-    // Error handling
-    if (hr != XBDM_ENDOFLIST)
+static void PrintModule(const DMN_MODLOAD *pModule, BOOL verbose)
+{
+    // Create a date string from the timestamp
+    char date[50] = { 0 };
+    TimestampToDateString(pModule->TimeStamp, date, sizeof(date));
+
+    printf("%s\n", pModule->Name);
+
+    if (verbose)
     {
-        LogXbdmError(hr);
-        DmCloseLoadedModules(pModuleWalker);
+        printf("    BaseAddress: 0x%p\n", pModule->BaseAddress);
+        printf("    Size:        0x%X\n", pModule->Size);
+        printf("    Timestamp:   %s\n", date);
+        printf("    Checksum:    0x%X\n", pModule->CheckSum);
+        printf("    DataAddress: 0x%p\n", pModule->PDataAddress);
+        printf("    DataSize:    0x%X\n", pModule->PDataSize);
+        printf("\n");
+    }
+}
 
+HRESULT ShowLoadedModules(Session *pSession, BOOL verbose)
+{
+    const ModuleTable *pLoadedModules = NULL;
+    HRESULT hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
         return hr;
-    }
 
-    // Free the memory allocated by DmWalkLoadedModules
-    DmCloseLoadedModules(pModuleWalker);
+    // Go through the loaded modules and print their names
+    for (size_t i = 0; i < pLoadedModules->NumberOfModules; i++)
+        PrintModule(&pLoadedModules->pModules[i], verbose);
 
     return S_OK;
 }
 
-HRESULT ShowLoadedModules(BOOL verbose)
+// The notification handlers don't take a context parameter so the state of the watch needs to be global
+static Session *s_pWatchedSession = NULL;
+static CRITICAL_SECTION s_WatchLock;
+
+static DWORD __stdcall OnModuleNotification(ULONG notification, ULONG_PTR param)
+{
+    const DMN_MODLOAD *pModule = (const DMN_MODLOAD *)param;
+    ULONG notificationType = notification & DM_NOTIFICATIONMASK;
+
+    // Get the current time to know when the event happened
+    SYSTEMTIME time = { 0 };
+    GetLocalTime(&time);
+
+    EnterCriticalSection(&s_WatchLock);
+
+    // Keep the module table in sync with the console without walking the loaded modules again
+    if (notificationType == DM_MODLOAD)
+        AddLoadedModule(s_pWatchedSession, pModule);
+    else if (notificationType == DM_MODUNLOAD)
+        RemoveLoadedModule(s_pWatchedSession, pModule->Name);
+
+    printf(
+        "[%02d:%02d:%02d.%03d] %s: ",
+        time.wHour,
+        time.wMinute,
+        time.wSecond,
+        time.wMilliseconds,
+        notificationType == DM_MODLOAD ? "Loaded" : "Unloaded"
+    );
+    PrintModule(pModule, TRUE);
+
+    // The output is likely to be read by another program so it shouldn't be buffered
+    fflush(stdout);
+
+    LeaveCriticalSection(&s_WatchLock);
+
+    return 0;
+}
+
+HRESULT WatchLoadedModules(Session *pSession)
 {
     HRESULT hr = S_OK;
 
-    PDM_WALK_MODULES pModuleWalker = NULL;
-    DMN_MODLOAD loadedModule = { 0 };
+    s_pWatchedSession = pSession;
+    InitializeCriticalSection(&s_WatchLock);
 
-    // Go through the loaded modules and print their names
-    while ((hr = DmWalkLoadedModules(&pModuleWalker, &loadedModule)) == XBDM_NOERR)
+    HANDLE stopEvent = CreateStopEvent();
+    if (stopEvent == NULL)
     {
-        // Create a date string from the timestamp
-        char date[50] = { 0 };
-        TimestampToDateString(loadedModule.TimeStamp, date, sizeof(date));
+        DeleteCriticalSection(&s_WatchLock);
+        return E_FAIL;
+    }
 
-        printf("%s\n", loadedModule.Name);
+    // Open the notification session and subscribe to module loads and unloads before getting the loaded
+    // modules so that no event is missed in between
+    PDMN_SESSION pNotificationSession = NULL;
+    hr = DmOpenNotificationSession(DM_PERSISTENT, &pNotificationSession);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        CloseStopEvent(stopEvent);
+        DeleteCriticalSection(&s_WatchLock);
 
-        if (verbose)
-        {
-            printf("    BaseAddress: 0x%p\n", loadedModule.BaseAddress);
-            printf("    Size:        0x%X\n", loadedModule.Size);
-            printf("    Timestamp:   %s\n", date);
-            printf("    Checksum:    0x%X\n", loadedModule.CheckSum);
-            printf("    DataAddress: 0x%p\n", loadedModule.PDataAddress);
-            printf("    DataSize:    0x%X\n", loadedModule.PDataSize);
-            printf("\n");
-        }
+        return E_FAIL;
     }
 
-    // Error handling
-    if (hr != XBDM_ENDOFLIST)
+    hr = DmNotify(pNotificationSession, DM_MODLOAD, OnModuleNotification);
+    if (SUCCEEDED(hr))
+        hr = DmNotify(pNotificationSession, DM_MODUNLOAD, OnModuleNotification);
+
+    if (FAILED(hr))
     {
         LogXbdmError(hr);
-        DmCloseLoadedModules(pModuleWalker);
+        DmCloseNotificationSession(pNotificationSession);
+        CloseStopEvent(stopEvent);
+        DeleteCriticalSection(&s_WatchLock);
 
-        return hr;
+        return E_FAIL;
     }
 
-    // Free the memory allocated by DmWalkLoadedModules
-    DmCloseLoadedModules(pModuleWalker);
+    // Get the modules loaded at the time the watch starts, they are then kept up to date by the notifications
+    EnterCriticalSection(&s_WatchLock);
+    const ModuleTable *pLoadedModules = NULL;
+    hr = GetLoadedModules(pSession, &pLoadedModules);
+    size_t numberOfModules = SUCCEEDED(hr) ? pLoadedModules->NumberOfModules : 0;
+    LeaveCriticalSection(&s_WatchLock);
 
-    return S_OK;
+    if (SUCCEEDED(hr))
+    {
+        LogInfo("Watching module events (%zu modules currently loaded), press Ctrl+C to stop.", numberOfModules);
+        fflush(stdout);
+
+        WaitForSingleObject(stopEvent, INFINITE);
+    }
+
+    // Cleanup, the notification session needs to be closed first so that no handler runs after that
+    DmCloseNotificationSession(pNotificationSession);
+    CloseStopEvent(stopEvent);
+    DeleteCriticalSection(&s_WatchLock);
+    s_pWatchedSession = NULL;
+
+    return SUCCEEDED(hr) ? S_OK : hr;
 }
 
-static HRESULT XGetModuleHandleA(const char *modulePath, uint64_t *pHandle)
+static HRESULT XGetModuleHandleA(Session *pSession, const char *modulePath, uint64_t *pHandle)
 {
     XdrpcArgInfo args[1] = { { 0 } };
 
     args[0].pData = modulePath;
     args[0].Type = XdrpcArgType_String;
 
-    return XdrpcCall("xam.xex", 1102, args, 1, pHandle);
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "XGetModuleHandleA", modulePath);
+    HRESULT hr = XdrpcCall(pSession, "xam.xex", 1102, args, 1, pHandle);
+    EndTraceSpan(&span, 0, 0);
+
+    return hr;
 }
 
-static HRESULT XexLoadImage(const char *modulePath)
+static HRESULT XexLoadImage(Session *pSession, const char *modulePath)
 {
     XdrpcArgInfo args[4] = { { 0 }, { 0 }, { 0 }, { 0 } };
     uint64_t eight = 8;
@@ -154,7 +246,11 @@ static HRESULT XexLoadImage(const char *modulePath)
     args[3].pData = &zero;
     args[3].Type = XdrpcArgType_Integer;
 
-    HRESULT hr = XdrpcCall("xboxkrnl.exe", 409, args, 4, &status);
+    // Most of the time of a reload is usually spent here, on the console
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "XexLoadImage", modulePath);
+    HRESULT hr = XdrpcCall(pSession, "xboxkrnl.exe", 409, args, 4, &status);
+    EndTraceSpan(&span, 0, 0);
     if (FAILED(hr))
         return hr;
 
@@ -167,7 +263,7 @@ static HRESULT XexLoadImage(const char *modulePath)
     return S_OK;
 }
 
-static HRESULT XexUnloadImage(uint64_t moduleHandle)
+static HRESULT XexUnloadImage(Session *pSession, uint64_t moduleHandle)
 {
     XdrpcArgInfo args[1] = { { 0 } };
     uint64_t status = 0;
@@ -175,7 +271,10 @@ static HRESULT XexUnloadImage(uint64_t moduleHandle)
     args[0].pData = &moduleHandle;
     args[0].Type = XdrpcArgType_Integer;
 
-    HRESULT hr = XdrpcCall("xboxkrnl.exe", 417, args, 1, &status);
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "XexUnloadImage", NULL);
+    HRESULT hr = XdrpcCall(pSession, "xboxkrnl.exe", 417, args, 1, &status);
+    EndTraceSpan(&span, 0, 0);
     if (FAILED(hr))
         return hr;
 
@@ -188,12 +287,12 @@ static HRESULT XexUnloadImage(uint64_t moduleHandle)
     return S_OK;
 }
 
-HRESULT Load(const char *modulePath)
+HRESULT Load(Session *pSession, const char *modulePath)
 {
     HRESULT hr = S_OK;
 
     BOOL moduleExists = FALSE;
-    hr = FileExists(modulePath, &moduleExists);
+    hr = FileExists(pSession, modulePath, &moduleExists);
     if (FAILED(hr))
     {
         LogXbdmError(hr);
@@ -207,7 +306,7 @@ HRESULT Load(const char *modulePath)
     }
 
     BOOL isModuleLoaded = FALSE;
-    hr = IsModuleLoaded(modulePath, &isModuleLoaded);
+    hr = IsModuleLoaded(pSession, modulePath, &isModuleLoaded);
     if (FAILED(hr))
         return E_FAIL;
 
@@ -217,7 +316,15 @@ HRESULT Load(const char *modulePath)
         return E_FAIL;
     }
 
-    hr = XexLoadImage(modulePath);
+    hr = XexLoadImage(pSession, modulePath);
+
+    // Whether the loading succeeded or not, the loaded modules could have changed
+    InvalidateLoadedModules(pSession);
+
+    char fileName[MAX_PATH] = { 0 };
+    if (SUCCEEDED(GetFileNameFromPath(modulePath, fileName, sizeof(fileName))))
+        ForgetVerifiedModule(&pSession->Exports, fileName);
+
     if (FAILED(hr))
         return E_FAIL;
 
@@ -226,12 +333,154 @@ HRESULT Load(const char *modulePath)
     return S_OK;
 }
 
-HRESULT Unload(const char *modulePath)
+static HRESULT UnloadWithHandle(Session *pSession, const char *modulePath, uint64_t moduleHandle)
+{
+    HRESULT hr = S_OK;
+
+    if (moduleHandle == 0)
+    {
+        LogError("Handle of %s is invalid.", modulePath);
+        return E_FAIL;
+    }
+
+    uint32_t moduleLoadCountAddress = (uint32_t)moduleHandle + 0x40;
+    uint16_t moduleLoadCountValue = 1;
+
+    // Before unloading a module, the load count needs to be set to 1, otherwise the module isn't unmapped from memory
+    hr = WriteMemory16(pSession, moduleLoadCountAddress, &moduleLoadCountValue, 1);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    hr = XexUnloadImage(pSession, moduleHandle);
+    if (FAILED(hr))
+    {
+        InvalidateLoadedModules(pSession);
+        return E_FAIL;
+    }
+
+    // The module is known to be gone so there is no need to query the loaded modules again
+    char fileName[MAX_PATH] = { 0 };
+    hr = GetFileNameFromPath(modulePath, fileName, sizeof(fileName));
+    if (FAILED(hr))
+        InvalidateLoadedModules(pSession);
+    else
+        RemoveLoadedModule(pSession, fileName);
+
+    LogSuccess("%s has been unloaded.", modulePath);
+
+    return S_OK;
+}
+
+static void LogHelperFailure(const ModuleOperationResult *pResult, size_t operationIndex, const char **unloadPaths, size_t numberOfUnloads)
+{
+    // Each unload takes three operations (GetHandle, SetLoadCount and Unload) and the load comes last
+    if (operationIndex >= numberOfUnloads * 3)
+    {
+        LogError("Loading failed with error %X.", pResult->Status);
+        return;
+    }
+
+    const char *modulePath = unloadPaths[operationIndex / 3];
+    switch (operationIndex % 3)
+    {
+    case 0:
+        LogError("Handle of %s is invalid.", modulePath);
+        break;
+    case 1:
+        LogError("Could not reset the load count of %s (error %X).", modulePath, pResult->Status);
+        break;
+    default:
+        LogError("Unloading failed with error %X.", pResult->Status);
+        break;
+    }
+}
+
+// Unloads the modules in order then loads loadPath (if not NULL) with a single RPC to the helper. Returns S_FALSE
+// without doing anything when the helper is not loaded or the operations don't fit in a script, for the caller to
+// do them one by one.
+static HRESULT RunWithModuleHelper(Session *pSession, const char **unloadPaths, size_t numberOfUnloads, const char *loadPath)
+{
+    HRESULT hr = IsModuleHelperLoaded(pSession);
+    if (hr != S_OK)
+        return S_FALSE;
+
+    ModuleScript script;
+    InitModuleScript(&script);
+
+    char fileName[MAX_PATH] = { 0 };
+    for (size_t i = 0; i < numberOfUnloads; i++)
+    {
+        // The helper can't unload itself while it's running the script
+        if (FAILED(GetFileNameFromPath(unloadPaths[i], fileName, sizeof(fileName))) || !_stricmp(fileName, MODULE_HELPER_NAME))
+            return S_FALSE;
+
+        // Before unloading a module, the load count needs to be set to 1, otherwise the module isn't unmapped from memory
+        size_t handleOperationIndex = 0;
+        AddGetHandleOperation(&script, unloadPaths[i], &handleOperationIndex);
+        AddSetLoadCountOperation(&script, handleOperationIndex, 1);
+        AddUnloadOperation(&script, handleOperationIndex);
+    }
+
+    if (loadPath != NULL)
+        AddLoadOperation(&script, loadPath, 8);
+
+    if (FAILED(script.Result))
+        return S_FALSE;
+
+    ModuleOperationResult results[MODULE_SCRIPT_MAX_OPERATIONS] = { { 0 } };
+    size_t numberOfOperationsRun = 0;
+    hr = RunModuleScript(pSession, &script, results, &numberOfOperationsRun);
+    if (FAILED(hr))
+    {
+        InvalidateLoadedModules(pSession);
+        return E_FAIL;
+    }
+
+    // The helper stops after the first operation that fails, so only the last result can be a failure
+    size_t numberOfSucceeded = numberOfOperationsRun;
+    if (numberOfSucceeded > 0 && FAILED((HRESULT)results[numberOfSucceeded - 1].Status))
+        numberOfSucceeded--;
+
+    for (size_t i = 0; i < numberOfUnloads && (i + 1) * 3 <= numberOfSucceeded; i++)
+    {
+        // The module is known to be gone so there is no need to query the loaded modules again
+        if (SUCCEEDED(GetFileNameFromPath(unloadPaths[i], fileName, sizeof(fileName))))
+            RemoveLoadedModule(pSession, fileName);
+
+        LogSuccess("%s has been unloaded.", unloadPaths[i]);
+    }
+
+    if (loadPath != NULL)
+    {
+        // Whether the loading succeeded or not, the loaded modules could have changed
+        InvalidateLoadedModules(pSession);
+
+        if (SUCCEEDED(GetFileNameFromPath(loadPath, fileName, sizeof(fileName))))
+            ForgetVerifiedModule(&pSession->Exports, fileName);
+
+        if (numberOfSucceeded == script.NumberOfOperations)
+            LogSuccess("%s has been loaded.", loadPath);
+    }
+
+    if (numberOfSucceeded == script.NumberOfOperations)
+        return S_OK;
+
+    InvalidateLoadedModules(pSession);
+
+    if (numberOfSucceeded == numberOfOperationsRun)
+        LogError("The module helper stopped after %zu of %zu operations.", numberOfOperationsRun, script.NumberOfOperations);
+    else
+        LogHelperFailure(&results[numberOfSucceeded], numberOfSucceeded, unloadPaths, numberOfUnloads);
+
+    return E_FAIL;
+}
+
+HRESULT Unload(Session *pSession, const char *modulePath)
 {
     HRESULT hr = S_OK;
 
     BOOL isModuleLoaded = FALSE;
-    hr = IsModuleLoaded(modulePath, &isModuleLoaded);
+    hr = IsModuleLoaded(pSession, modulePath, &isModuleLoaded);
     if (FAILED(hr))
         return E_FAIL;
 
@@ -241,63 +490,368 @@ HRESULT Unload(const char *modulePath)
         return E_FAIL;
     }
 
+    hr = RunWithModuleHelper(pSession, &modulePath, 1, NULL);
+    if (hr != S_FALSE)
+        return hr;
+
     uint64_t moduleHandle = 0;
-    hr = XGetModuleHandleA(modulePath, &moduleHandle);
+    hr = XGetModuleHandleA(pSession, modulePath, &moduleHandle);
     if (FAILED(hr))
         return E_FAIL;
 
-    if (moduleHandle == 0)
+    return UnloadWithHandle(pSession, modulePath, moduleHandle);
+}
+
+HRESULT UnloadModules(Session *pSession, const char **modulePaths, size_t numberOfModules)
+{
+    HRESULT hr = S_OK;
+
+    if (numberOfModules == 0)
+        return S_OK;
+
+    hr = RunWithModuleHelper(pSession, modulePaths, numberOfModules, NULL);
+    if (hr != S_FALSE)
+        return hr;
+
+    uint64_t *moduleHandles = calloc(numberOfModules, sizeof(uint64_t));
+    if (moduleHandles == NULL)
     {
-        LogError("Handle of %s is invalid.", modulePath);
+        LogError("Could not allocate memory for the module handles.");
         return E_FAIL;
     }
 
-    void *moduleLoadCountAddress = (void *)((uintptr_t)moduleHandle + 0x40);
+    // The handles don't depend on each other so they're all looked up at the same time, each lookup
+    // is a full RPC so this saves a round trip per module
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "LookUpModuleHandles", NULL);
+    XdrpcBatch *pBatch = NULL;
+    hr = XdrpcCreateBatch(pSession, &pBatch);
+    if (SUCCEEDED(hr))
+    {
+        for (size_t i = 0; i < numberOfModules; i++)
+        {
+            XdrpcArgInfo args[1] = { { 0 } };
+            args[0].pData = modulePaths[i];
+            args[0].Type = XdrpcArgType_String;
 
-    // The Xbox 360 is in big-endian so we need to swap the bytes of the load count before sending it
-    uint16_t moduleLoadCountValue = _byteswap_ushort(1);
+            // XGetModuleHandleA
+            if (FAILED(XdrpcBatchCall(pBatch, NULL, "xam.xex", 1102, args, 1, &moduleHandles[i])))
+                break;
+        }
 
-    // Before unloading a module, the load count needs to be set to 1, otherwise the module isn't unmapped from memory
-    size_t bytesWritten = 0;
-    hr = DmSetMemory(moduleLoadCountAddress, sizeof(moduleLoadCountValue), &moduleLoadCountValue, (DWORD *)&bytesWritten);
+        hr = XdrpcRunBatch(pBatch);
+    }
+
+    EndTraceSpan(&span, 0, 0);
+
+    // The modules are still unloaded one after the other and in the order they were given, in case they depend on each other.
+    // Their load counts aren't written in the batch for the same reason, unloading a module can release the ones it imports.
+    for (size_t i = 0; i < numberOfModules && SUCCEEDED(hr); i++)
+        hr = UnloadWithHandle(pSession, modulePaths[i], moduleHandles[i]);
+
+    free(moduleHandles);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
+
+static HRESULT ReadFilePartial(Session *pSession, const char *filePath, uint32_t offset, uint8_t *buffer, uint32_t size, uint32_t *pBytesRead)
+{
+    *pBytesRead = 0;
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReadFilePartial", filePath);
+    HRESULT hr = DmReadFilePartial(filePath, offset, buffer, size, (DWORD *)pBytesRead);
+    RecordRoundTrip(pSession, 0, *pBytesRead);
+    EndTraceSpan(&span, 0, *pBytesRead);
     if (FAILED(hr))
     {
         LogXbdmError(hr);
         return E_FAIL;
     }
 
-    if (bytesWritten != sizeof(moduleLoadCountValue))
+    return S_OK;
+}
+
+HRESULT IsModuleUpToDate(Session *pSession, const char *modulePath, BOOL *pIsUpToDate)
+{
+    HRESULT hr = S_OK;
+
+    *pIsUpToDate = FALSE;
+
+    char fileName[MAX_PATH] = { 0 };
+    hr = GetFileNameFromPath(modulePath, fileName, sizeof(fileName));
+    if (FAILED(hr))
+        return E_FAIL;
+
+    const ModuleTable *pLoadedModules = NULL;
+    hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
+        return hr;
+
+    const DMN_MODLOAD *pLoadedModule = FindLoadedModule(pLoadedModules, fileName);
+    if (pLoadedModule == NULL)
+        return S_OK;
+
+    // Read the beginning of the file on the console to get its checksum and timestamp
+    uint8_t header[XEX_HEADER_READ_SIZE] = { 0 };
+    uint32_t bytesRead = 0;
+    hr = ReadFilePartial(pSession, modulePath, 0, header, sizeof(header), &bytesRead);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    uint32_t checksumTimestampOffset = 0;
+    hr = XexFindOptionalHeader(header, bytesRead, XEX_HEADER_CHECKSUM_TIMESTAMP, &checksumTimestampOffset);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // Without a checksum and a timestamp, there is no way to tell if the module changed
+    if (hr == S_FALSE)
+        return S_OK;
+
+    // The checksum and the timestamp are most likely in what was already read but they don't have to be
+    uint32_t checksumTimestamp[2] = { 0 };
+    if ((size_t)checksumTimestampOffset + sizeof(checksumTimestamp) <= bytesRead)
     {
-        LogError("Expected to write %d bytes at %p but only wrote %d.", sizeof(moduleLoadCountValue), moduleLoadCountAddress, bytesWritten);
+        memcpy(checksumTimestamp, header + checksumTimestampOffset, sizeof(checksumTimestamp));
+    }
+    else
+    {
+        hr = ReadFilePartial(pSession, modulePath, checksumTimestampOffset, (uint8_t *)checksumTimestamp, sizeof(checksumTimestamp), &bytesRead);
+        if (FAILED(hr) || bytesRead != sizeof(checksumTimestamp))
+            return E_FAIL;
+    }
+
+    // The XEX file is in big-endian
+    uint32_t checksum = _byteswap_ulong(checksumTimestamp[0]);
+    uint32_t timestamp = _byteswap_ulong(checksumTimestamp[1]);
+
+    *pIsUpToDate = checksum == pLoadedModule->CheckSum && timestamp == pLoadedModule->TimeStamp;
+
+    return S_OK;
+}
+
+HRESULT ReadModuleHeader(Session *pSession, const char *modulePath, uint8_t **ppHeader, size_t *pHeaderSize)
+{
+    HRESULT hr = S_OK;
+
+    uint8_t *pHeader = malloc(XEX_HEADER_READ_SIZE);
+    if (pHeader == NULL)
+    {
+        LogError("Could not allocate memory for the header of %s.", modulePath);
         return E_FAIL;
     }
 
-    hr = XexUnloadImage(moduleHandle);
+    // Read the beginning of the file first to know the size of the whole header
+    uint32_t bytesRead = 0;
+    hr = ReadFilePartial(pSession, modulePath, 0, pHeader, XEX_HEADER_READ_SIZE, &bytesRead);
     if (FAILED(hr))
+    {
+        free(pHeader);
         return E_FAIL;
+    }
 
-    LogSuccess("%s has been unloaded.", modulePath);
+    uint32_t headerSize = 0;
+    hr = XexGetHeaderSize(pHeader, bytesRead, &headerSize);
+    if (FAILED(hr))
+    {
+        free(pHeader);
+        return E_FAIL;
+    }
+
+    // Read the rest of the header if it didn't fit in what was already read
+    if (headerSize > bytesRead)
+    {
+        uint8_t *pFullHeader = realloc(pHeader, headerSize);
+        if (pFullHeader == NULL)
+        {
+            LogError("Could not allocate memory for the header of %s.", modulePath);
+            free(pHeader);
+
+            return E_FAIL;
+        }
+
+        pHeader = pFullHeader;
+
+        uint32_t remainingBytesRead = 0;
+        hr = ReadFilePartial(pSession, modulePath, bytesRead, pHeader + bytesRead, headerSize - bytesRead, &remainingBytesRead);
+        if (FAILED(hr) || remainingBytesRead != headerSize - bytesRead)
+        {
+            LogError("Could not read the header of %s.", modulePath);
+            free(pHeader);
+
+            return E_FAIL;
+        }
+    }
+
+    *ppHeader = pHeader;
+    *pHeaderSize = headerSize;
+
+    return S_OK;
+}
+
+static const char *GetCompressionTypeName(uint16_t compressionType)
+{
+    switch (compressionType)
+    {
+    case 0:
+        return "None";
+    case 1:
+        return "Basic";
+    case 2:
+        return "Normal";
+    case 3:
+        return "Delta";
+    default:
+        return "Unknown";
+    }
+}
+
+HRESULT InspectModule(const char *localPath)
+{
+    MappedFile file = { 0 };
+    HRESULT hr = MapLocalFile(localPath, &file);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // The header is parsed straight from the mapped file
+    XexImageInfo info = { 0 };
+    double startTime = GetTimeInMilliseconds();
+    hr = XexParseHeader(file.pData, file.Size, &info);
+    double parseTime = GetTimeInMilliseconds() - startTime;
+    if (FAILED(hr))
+    {
+        UnmapLocalFile(&file);
+        return E_FAIL;
+    }
+
+    char date[50] = { 0 };
+    TimestampToDateString(info.Timestamp, date, sizeof(date));
+
+    printf("%s\n", localPath);
+    printf("    BaseAddress: 0x%08X\n", info.BaseAddress);
+    printf("    ImageSize:   0x%X\n", info.ImageSize);
+    printf("    EntryPoint:  0x%08X\n", info.EntryPoint);
+    printf("    Timestamp:   %s\n", date);
+    printf("    Checksum:    0x%X\n", info.Checksum);
+    printf("    Flags:       0x%X\n", info.ModuleFlags);
+    printf("    HeaderSize:  0x%X\n", info.HeaderSize);
+    printf("    Encrypted:   %s\n", info.EncryptionType != 0 ? "Yes" : "No");
+    printf("    Compression: %s\n", GetCompressionTypeName(info.CompressionType));
+    printf("    Imports:\n");
+    for (size_t i = 0; i < info.NumberOfImportLibraries; i++)
+        printf("        %s\n", info.ImportLibraryNames[i]);
+
+    LogInfo("Header parsed in %.0fus.", parseTime * 1000.0);
+
+    UnmapLocalFile(&file);
+
+    return S_OK;
+}
+
+HRESULT CheckLocalModule(Session *pSession, const char *localPath, const char *modulePath)
+{
+    HRESULT hr = S_OK;
+
+    MappedFile file = { 0 };
+    hr = MapLocalFile(localPath, &file);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    XexImageInfo info = { 0 };
+    hr = XexParseHeader(file.pData, file.Size, &info);
+    UnmapLocalFile(&file);
+    if (FAILED(hr))
+    {
+        LogError("%s can't be loaded.", localPath);
+        return E_FAIL;
+    }
+
+    char fileName[MAX_PATH] = { 0 };
+    hr = GetFileNameFromPath(modulePath, fileName, sizeof(fileName));
+    if (FAILED(hr))
+        return E_FAIL;
+
+    const ModuleTable *pLoadedModules = NULL;
+    hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
+        return hr;
+
+    // The image needs to fit where it's supposed to be loaded, the module with the same name doesn't count
+    // since it gets unloaded first
+    uint64_t imageStart = info.BaseAddress;
+    uint64_t imageEnd = imageStart + info.ImageSize;
+    for (size_t i = 0; i < pLoadedModules->NumberOfModules; i++)
+    {
+        const DMN_MODLOAD *pModule = &pLoadedModules->pModules[i];
+        if (!_stricmp(pModule->Name, fileName))
+            continue;
+
+        uint64_t moduleStart = (uintptr_t)pModule->BaseAddress;
+        uint64_t moduleEnd = moduleStart + pModule->Size;
+        if (imageStart < moduleEnd && moduleStart < imageEnd)
+        {
+            LogError(
+                "%s (0x%08llX-0x%08llX) overlaps with %s (0x%08llX-0x%08llX) which is already loaded.",
+                localPath,
+                imageStart,
+                imageEnd,
+                pModule->Name,
+                moduleStart,
+                moduleEnd
+            );
+
+            return E_FAIL;
+        }
+    }
 
     return S_OK;
 }
 
-HRESULT UnloadThenLoad(const char *modulePath)
+HRESULT UnloadThenLoad(Session *pSession, const char *modulePath, BOOL force)
 {
     HRESULT hr = S_OK;
 
     BOOL isModuleLoaded = FALSE;
-    hr = IsModuleLoaded(modulePath, &isModuleLoaded);
+    hr = IsModuleLoaded(pSession, modulePath, &isModuleLoaded);
     if (FAILED(hr))
         return E_FAIL;
 
+    if (isModuleLoaded == TRUE && force == FALSE)
+    {
+        // Reloading the exact same module would be a waste of time
+        BOOL isModuleUpToDate = FALSE;
+        TraceSpan span;
+        BeginTraceSpan(&span, TRACE_STEP, "IsModuleUpToDate", modulePath);
+        hr = IsModuleUpToDate(pSession, modulePath, &isModuleUpToDate);
+        EndTraceSpan(&span, 0, 0);
+        if (FAILED(hr))
+            return E_FAIL;
+
+        if (isModuleUpToDate == TRUE)
+        {
+            LogInfo("%s is already up to date, use --force to reload it anyway.", modulePath);
+            return S_OK;
+        }
+    }
+
+    TraceSpan span;
     if (isModuleLoaded == TRUE)
     {
-        hr = Unload(modulePath);
+        // The helper does the whole reload in a single RPC when it's loaded
+        hr = RunWithModuleHelper(pSession, &modulePath, 1, modulePath);
+        if (hr != S_FALSE)
+            return hr;
+
+        BeginTraceSpan(&span, TRACE_STEP, "Unload", modulePath);
+        hr = Unload(pSession, modulePath);
+        EndTraceSpan(&span, 0, 0);
         if (FAILED(hr))
             return E_FAIL;
     }
 
-    hr = Load(modulePath);
+    BeginTraceSpan(&span, TRACE_STEP, "Load", modulePath);
+    hr = Load(pSession, modulePath);
+    EndTraceSpan(&span, 0, 0);
     if (FAILED(hr))
         return E_FAIL;
 
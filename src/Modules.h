@@ -1,11 +1,29 @@
 #pragma once
 
+#include <stdint.h>
 #include <Windows.h>
 
-HRESULT ShowLoadedModules(BOOL verbose);
+#include "Session.h"
 
-HRESULT Load(const char *modulePath);
+HRESULT ShowLoadedModules(Session *pSession, BOOL verbose);
 
-HRESULT Unload(const char *modulePath);
+HRESULT WatchLoadedModules(Session *pSession);
 
-HRESULT UnloadThenLoad(const char *modulePath);
+HRESULT Load(Session *pSession, const char *modulePath);
+
+HRESULT Unload(Session *pSession, const char *modulePath);
+
+// Unloads loaded modules in the order they're given, looking up all of their handles at once first
+HRESULT UnloadModules(Session *pSession, const char **modulePaths, size_t numberOfModules);
+
+HRESULT UnloadThenLoad(Session *pSession, const char *modulePath, BOOL force);
+
+HRESULT IsModuleLoaded(Session *pSession, const char *modulePath, BOOL *pIsLoaded);
+
+HRESULT IsModuleUpToDate(Session *pSession, const char *modulePath, BOOL *pIsUpToDate);
+
+HRESULT ReadModuleHeader(Session *pSession, const char *modulePath, uint8_t **ppHeader, size_t *pHeaderSize);
+
+HRESULT InspectModule(const char *localPath);
+
+HRESULT CheckLocalModule(Session *pSession, const char *localPath, const char *modulePath);
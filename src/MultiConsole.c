@@ -0,0 +1,283 @@
+#include "MultiConsole.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "Stats.h"
+#include "Utils.h"
+
+#define OUTPUT_BUFFER_SIZE 0x1000
+
+typedef struct _ConsoleRun
+{
+    char ConsoleName[MAX_PATH];
+    double ElapsedMilliseconds;
+    DWORD ExitCode;
+    BOOL HasRun;
+} ConsoleRun;
+
+typedef struct _ConsoleQueue
+{
+    ConsoleRun Runs[MAX_CONSOLES];
+    size_t NumberOfRuns;
+    const char *CommandLine;
+    const char *StatsFilePath;
+    volatile LONG NextRun;
+
+    // Pipes need to be inheritable for the child processes to write to them, so only one child process can be
+    // created at a time, otherwise it could inherit the pipe of another one and keep it open
+    CRITICAL_SECTION CreateProcessLock;
+} ConsoleQueue;
+
+static HRESULT ParseConsoleList(const char *consoleList, ConsoleQueue *pQueue)
+{
+    const char *start = consoleList;
+    while (*start != '\0')
+    {
+        const char *end = strchr(start, ',');
+        size_t length = end != NULL ? (size_t)(end - start) : strlen(start);
+
+        // Ignore empty names (trailing comma, two commas in a row...)
+        if (length > 0)
+        {
+            if (pQueue->NumberOfRuns == MAX_CONSOLES)
+            {
+                LogError("Too many consoles, the maximum is %d.", MAX_CONSOLES);
+                return E_FAIL;
+            }
+
+            ConsoleRun *pRun = &pQueue->Runs[pQueue->NumberOfRuns++];
+            strncpy_s(pRun->ConsoleName, sizeof(pRun->ConsoleName), start, length < sizeof(pRun->ConsoleName) ? length : _TRUNCATE);
+        }
+
+        if (end == NULL)
+            break;
+
+        start = end + 1;
+    }
+
+    if (pQueue->NumberOfRuns == 0)
+    {
+        LogError("No console to run the command on.");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static void ForwardOutput(HANDLE readPipe, const char *consoleName)
+{
+    char buffer[OUTPUT_BUFFER_SIZE] = { 0 };
+    char line[OUTPUT_BUFFER_SIZE] = { 0 };
+    size_t lineLength = 0;
+
+    // Print the output of the child process line by line, prefixed with the name of the console, as it comes
+    DWORD bytesRead = 0;
+    while (ReadFile(readPipe, buffer, sizeof(buffer), &bytesRead, NULL) && bytesRead > 0)
+    {
+        for (DWORD i = 0; i < bytesRead; i++)
+        {
+            if (buffer[i] == '\r')
+                continue;
+
+            if (buffer[i] != '\n' && lineLength < sizeof(line) - 1)
+            {
+                line[lineLength++] = buffer[i];
+                continue;
+            }
+
+            printf("(%s) %.*s\n", consoleName, (int)lineLength, line);
+            fflush(stdout);
+            lineLength = 0;
+
+            // The character that didn't fit starts the next line
+            if (buffer[i] != '\n')
+                line[lineLength++] = buffer[i];
+        }
+    }
+
+    if (lineLength > 0)
+        printf("(%s) %.*s\n", consoleName, (int)lineLength, line);
+}
+
+static HRESULT RunOnConsole(ConsoleQueue *pQueue, ConsoleRun *pRun)
+{
+    // The command is run by a child ModuleLoader process because XBDM only lets a process target one console
+    char commandLine[0x2000] = { 0 };
+    strncpy_s(commandLine, sizeof(commandLine), pQueue->CommandLine, _TRUNCATE);
+    HRESULT hr = AppendQuotedArgument(commandLine, sizeof(commandLine), "--console");
+    if (SUCCEEDED(hr))
+        hr = AppendQuotedArgument(commandLine, sizeof(commandLine), pRun->ConsoleName);
+
+    // Each console appends its stats to its own file, named after the console, so that the lines of the processes
+    // can't interleave
+    if (SUCCEEDED(hr) && pQueue->StatsFilePath != NULL)
+    {
+        char statsFilePath[MAX_PATH] = { 0 };
+        int statsFilePathLength = _snprintf_s(statsFilePath, sizeof(statsFilePath), _TRUNCATE, "%s.%s", pQueue->StatsFilePath, pRun->ConsoleName);
+
+        hr = statsFilePathLength >= 0 ? AppendQuotedArgument(commandLine, sizeof(commandLine), "--stats") : E_FAIL;
+        if (SUCCEEDED(hr))
+            hr = AppendQuotedArgument(commandLine, sizeof(commandLine), statsFilePath);
+    }
+
+    if (FAILED(hr))
+    {
+        LogError("The command line to run on %s is too long.", pRun->ConsoleName);
+        return E_FAIL;
+    }
+
+    HANDLE readPipe = NULL;
+    HANDLE writePipe = NULL;
+    SECURITY_ATTRIBUTES securityAttributes = { 0 };
+    securityAttributes.nLength = sizeof(securityAttributes);
+    securityAttributes.bInheritHandle = TRUE;
+
+    STARTUPINFOA startupInfo = { 0 };
+    startupInfo.cb = sizeof(startupInfo);
+    startupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+
+    PROCESS_INFORMATION processInfo = { 0 };
+    BOOL processCreated = FALSE;
+
+    EnterCriticalSection(&pQueue->CreateProcessLock);
+
+    if (CreatePipe(&readPipe, &writePipe, &securityAttributes, 0))
+    {
+        // Only the write end is for the child process
+        SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, 0);
+
+        startupInfo.hStdOutput = writePipe;
+        startupInfo.hStdError = writePipe;
+        processCreated = CreateProcessA(NULL, commandLine, NULL, NULL, TRUE, 0, NULL, NULL, &startupInfo, &processInfo);
+
+        // The child process has its own copy, the pipe needs to be closed when the child process exits
+        CloseHandle(writePipe);
+    }
+
+    LeaveCriticalSection(&pQueue->CreateProcessLock);
+
+    if (!processCreated)
+    {
+        LogError("Could not run the command on %s.", pRun->ConsoleName);
+        if (readPipe != NULL)
+            CloseHandle(readPipe);
+
+        return E_FAIL;
+    }
+
+    double startTime = GetTimeInMilliseconds();
+
+    ForwardOutput(readPipe, pRun->ConsoleName);
+
+    WaitForSingleObject(processInfo.hProcess, INFINITE);
+    GetExitCodeProcess(processInfo.hProcess, &pRun->ExitCode);
+
+    pRun->ElapsedMilliseconds = GetTimeInMilliseconds() - startTime;
+    pRun->HasRun = TRUE;
+
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+    CloseHandle(readPipe);
+
+    return S_OK;
+}
+
+static DWORD WINAPI RunWorker(void *pParameter)
+{
+    ConsoleQueue *pQueue = pParameter;
+
+    // Take the next console in the queue until it's empty
+    for (;;)
+    {
+        size_t runIndex = (size_t)InterlockedIncrement(&pQueue->NextRun) - 1;
+        if (runIndex >= pQueue->NumberOfRuns)
+            break;
+
+        RunOnConsole(pQueue, &pQueue->Runs[runIndex]);
+    }
+
+    return 0;
+}
+
+int RunOnConsoles(const char *commandLine, const char *consoleList, const char *statsFilePath)
+{
+    ConsoleQueue *pQueue = calloc(1, sizeof(ConsoleQueue));
+    if (pQueue == NULL)
+    {
+        LogError("Could not allocate memory for the consoles.");
+        return EXIT_FAILURE;
+    }
+
+    HRESULT hr = ParseConsoleList(consoleList, pQueue);
+    if (FAILED(hr))
+    {
+        free(pQueue);
+        return EXIT_FAILURE;
+    }
+
+    pQueue->CommandLine = commandLine;
+    pQueue->StatsFilePath = statsFilePath;
+    InitializeCriticalSection(&pQueue->CreateProcessLock);
+
+    size_t numberOfWorkers = pQueue->NumberOfRuns < MAX_CONSOLE_THREADS ? pQueue->NumberOfRuns : MAX_CONSOLE_THREADS;
+    HANDLE threads[MAX_CONSOLE_THREADS] = { 0 };
+    size_t numberOfThreads = 0;
+
+    double startTime = GetTimeInMilliseconds();
+
+    for (size_t i = 0; i < numberOfWorkers; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, RunWorker, pQueue, 0, NULL);
+        if (thread == NULL)
+        {
+            LogError("Could not create a thread to run the command.");
+            continue;
+        }
+
+        threads[numberOfThreads++] = thread;
+    }
+
+    // Run the command from this thread if no thread could be created
+    if (numberOfThreads == 0)
+        RunWorker(pQueue);
+
+    WaitForMultipleObjects((DWORD)numberOfThreads, threads, TRUE, INFINITE);
+
+    double elapsedMilliseconds = GetTimeInMilliseconds() - startTime;
+
+    for (size_t i = 0; i < numberOfThreads; i++)
+        CloseHandle(threads[i]);
+
+    DeleteCriticalSection(&pQueue->CreateProcessLock);
+
+    // Report every console then all of them
+    size_t numberOfSuccesses = 0;
+    for (size_t i = 0; i < pQueue->NumberOfRuns; i++)
+    {
+        const ConsoleRun *pRun = &pQueue->Runs[i];
+        if (!pRun->HasRun)
+            continue;
+
+        if (pRun->ExitCode == EXIT_SUCCESS)
+        {
+            LogSuccess("%s: done in %.0fms.", pRun->ConsoleName, pRun->ElapsedMilliseconds);
+            numberOfSuccesses++;
+        }
+        else
+        {
+            LogError("%s: failed with exit code 0x%X in %.0fms.", pRun->ConsoleName, pRun->ExitCode, pRun->ElapsedMilliseconds);
+        }
+    }
+
+    LogInfo("%zu of %zu consoles succeeded in %.0fms.", numberOfSuccesses, pQueue->NumberOfRuns, elapsedMilliseconds);
+
+    int exitCode = numberOfSuccesses == pQueue->NumberOfRuns ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    free(pQueue);
+
+    return exitCode;
+}
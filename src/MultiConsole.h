@@ -0,0 +1,13 @@
+#pragma once
+
+#include <Windows.h>
+
+// Comma-separated list of the consoles --all runs the command on
+#define CONSOLES_ENVIRONMENT_VARIABLE "MODULELOADER_CONSOLES"
+
+#define MAX_CONSOLES 64
+#define MAX_CONSOLE_THREADS 16
+
+// Runs commandLine on every console of consoleList, if statsFilePath isn't NULL the stats of each console are appended
+// to statsFilePath.<console name>
+int RunOnConsoles(const char *commandLine, const char *consoleList, const char *statsFilePath);
@@ -0,0 +1,386 @@
+#include "ParallelUpload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "Modules.h"
+#include "Trace.h"
+#include "Utils.h"
+
+// Local files are read and sent by chunks of this size so they never need to be entirely in memory
+#define SEND_CHUNK_SIZE 0x10000
+
+#define RESPONSE_SIZE 512
+
+typedef struct _FileTransfer
+{
+    const char *LocalPath;
+    char RemotePath[MAX_PATH];
+    uint64_t Size;
+    double StartTime;
+    double EndTime;
+
+    // E_PENDING until a worker picks the transfer up
+    HRESULT Result;
+} FileTransfer;
+
+typedef struct _TransferQueue
+{
+    FileTransfer *pTransfers;
+    size_t NumberOfTransfers;
+    volatile LONG NextTransfer;
+} TransferQueue;
+
+typedef struct _Worker
+{
+    TransferQueue *pQueue;
+    HANDLE Thread;
+
+    // Each worker has its own stats so that they don't need to be synchronized, they're added to the
+    // stats of the session once all the workers are done
+    Stats Stats;
+} Worker;
+
+static HRESULT SendFileContent(PDM_CONNECTION connection, FILE *pFile, FileTransfer *pTransfer, uint8_t *buffer)
+{
+    uint64_t bytesLeft = pTransfer->Size;
+    while (bytesLeft > 0)
+    {
+        size_t chunkSize = bytesLeft < SEND_CHUNK_SIZE ? (size_t)bytesLeft : SEND_CHUNK_SIZE;
+        if (fread(buffer, 1, chunkSize, pFile) != chunkSize)
+        {
+            LogError("Could not read %s.", pTransfer->LocalPath);
+            return E_FAIL;
+        }
+
+        TraceSpan span;
+        BeginTraceSpan(&span, TRACE_XBDM, "DmSendBinary", pTransfer->RemotePath);
+        HRESULT hr = DmSendBinary(connection, buffer, (uint32_t)chunkSize);
+        EndTraceSpan(&span, chunkSize, 0);
+        if (FAILED(hr))
+        {
+            LogXbdmError(hr);
+            return E_FAIL;
+        }
+
+        bytesLeft -= chunkSize;
+    }
+
+    return S_OK;
+}
+
+static HRESULT SendFile(Worker *pWorker, PDM_CONNECTION connection, FileTransfer *pTransfer, uint8_t *buffer)
+{
+    HRESULT hr = S_OK;
+
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, pTransfer->LocalPath, "rb");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", pTransfer->LocalPath);
+        return E_FAIL;
+    }
+
+    // Get the size of the file
+    _fseeki64(pFile, 0, SEEK_END);
+    pTransfer->Size = (uint64_t)_ftelli64(pFile);
+    _fseeki64(pFile, 0, SEEK_SET);
+
+    if (pTransfer->Size > UINT32_MAX)
+    {
+        LogError("%s is too big to be uploaded.", pTransfer->LocalPath);
+        fclose(pFile);
+
+        return E_FAIL;
+    }
+
+    // DmSendFile can't be used because it always goes through the shared connection, so the file is sent with
+    // the same command DmSendFile sends but on the connection of the worker
+    char command[MAX_PATH + 40] = { 0 };
+    _snprintf_s(command, sizeof(command), _TRUNCATE, "sendfile name=\"%s\" length=0x%x", pTransfer->RemotePath, (uint32_t)pTransfer->Size);
+
+    char response[RESPONSE_SIZE] = { 0 };
+    size_t responseSize = RESPONSE_SIZE;
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmSendCommand", command);
+    hr = DmSendCommand(connection, command, response, (DWORD *)&responseSize);
+    AddRoundTrip(&pWorker->Stats, strnlen_s(command, sizeof(command)), strnlen_s(response, RESPONSE_SIZE));
+    EndTraceSpan(&span, strnlen_s(command, sizeof(command)), strnlen_s(response, RESPONSE_SIZE));
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        fclose(pFile);
+
+        return E_FAIL;
+    }
+
+    // The console is ready to receive the content of the file
+    if (strncmp(response, "204", 3))
+    {
+        LogError("Unexpected response received: %s", response);
+        fclose(pFile);
+
+        return E_FAIL;
+    }
+
+    hr = SendFileContent(connection, pFile, pTransfer, buffer);
+    fclose(pFile);
+
+    // The connection can't be used anymore if the console is still waiting for the rest of the file
+    if (FAILED(hr))
+        return E_ABORT;
+
+    ZeroMemory(response, RESPONSE_SIZE);
+    responseSize = RESPONSE_SIZE;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReceiveStatusResponse", pTransfer->RemotePath);
+    hr = DmReceiveStatusResponse(connection, response, (DWORD *)&responseSize);
+    AddRoundTrip(&pWorker->Stats, (size_t)pTransfer->Size, strnlen_s(response, RESPONSE_SIZE));
+    EndTraceSpan(&span, 0, strnlen_s(response, RESPONSE_SIZE));
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    // Check if an error code was returned
+    if (response[0] != '2')
+    {
+        LogError("Could not upload %s to %s: %s", pTransfer->LocalPath, pTransfer->RemotePath, response);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static DWORD WINAPI RunWorker(void *pParameter)
+{
+    Worker *pWorker = pParameter;
+    TransferQueue *pQueue = pWorker->pQueue;
+
+    // Each worker has its own connection to the console so that the transfers actually overlap
+    PDM_CONNECTION connection = NULL;
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmOpenConnection", "Upload connection");
+    HRESULT hr = DmOpenConnection(&connection);
+    AddRoundTrip(&pWorker->Stats, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return 1;
+    }
+
+    uint8_t *buffer = malloc(SEND_CHUNK_SIZE);
+    if (buffer == NULL)
+    {
+        LogError("Could not allocate memory to upload the files.");
+        DmCloseConnection(connection);
+
+        return 1;
+    }
+
+    // Take the next file in the queue until it's empty
+    for (;;)
+    {
+        size_t transferIndex = (size_t)InterlockedIncrement(&pQueue->NextTransfer) - 1;
+        if (transferIndex >= pQueue->NumberOfTransfers)
+            break;
+
+        FileTransfer *pTransfer = &pQueue->pTransfers[transferIndex];
+        pTransfer->StartTime = GetTimeInMilliseconds();
+        hr = SendFile(pWorker, connection, pTransfer, buffer);
+        pTransfer->EndTime = GetTimeInMilliseconds();
+        pTransfer->Result = SUCCEEDED(hr) ? S_OK : E_FAIL;
+
+        // The console is in an unknown state on this connection, let the other workers finish the queue
+        if (hr == E_ABORT)
+            break;
+    }
+
+    free(buffer);
+    DmCloseConnection(connection);
+
+    return 0;
+}
+
+static double GetThroughput(uint64_t size, double elapsedMilliseconds)
+{
+    // In megabytes per second
+    return elapsedMilliseconds > 0.0 ? (double)size / (1024.0 * 1024.0) / (elapsedMilliseconds / 1000.0) : 0.0;
+}
+
+static HRESULT UploadFiles(Session *pSession, TransferQueue *pQueue, size_t numberOfConnections)
+{
+    size_t numberOfWorkers = numberOfConnections < pQueue->NumberOfTransfers ? numberOfConnections : pQueue->NumberOfTransfers;
+
+    Worker workers[MAX_NUMBER_OF_CONNECTIONS] = { 0 };
+    HANDLE threads[MAX_NUMBER_OF_CONNECTIONS] = { 0 };
+    size_t numberOfThreads = 0;
+
+    double startTime = GetTimeInMilliseconds();
+
+    for (size_t i = 0; i < numberOfWorkers; i++)
+    {
+        workers[i].pQueue = pQueue;
+        workers[i].Thread = CreateThread(NULL, 0, RunWorker, &workers[i], 0, NULL);
+        if (workers[i].Thread == NULL)
+        {
+            LogError("Could not create an upload thread.");
+            continue;
+        }
+
+        threads[numberOfThreads++] = workers[i].Thread;
+    }
+
+    if (numberOfThreads == 0)
+        return E_FAIL;
+
+    WaitForMultipleObjects((DWORD)numberOfThreads, threads, TRUE, INFINITE);
+
+    double elapsedMilliseconds = GetTimeInMilliseconds() - startTime;
+
+    for (size_t i = 0; i < numberOfWorkers; i++)
+    {
+        if (workers[i].Thread == NULL)
+            continue;
+
+        CloseHandle(workers[i].Thread);
+
+        AddStats(&pSession->Stats, &workers[i].Stats);
+    }
+
+    // Report every file then the whole upload
+    HRESULT hr = S_OK;
+    uint64_t totalSize = 0;
+    for (size_t i = 0; i < pQueue->NumberOfTransfers; i++)
+    {
+        const FileTransfer *pTransfer = &pQueue->pTransfers[i];
+        if (pTransfer->Result == E_PENDING)
+        {
+            LogError("%s was not uploaded.", pTransfer->LocalPath);
+            hr = E_FAIL;
+            continue;
+        }
+
+        if (FAILED(pTransfer->Result))
+        {
+            hr = E_FAIL;
+            continue;
+        }
+
+        double transferTime = pTransfer->EndTime - pTransfer->StartTime;
+        LogInfo(
+            "Uploaded %s to %s (%llu bytes in %.0fms, %.2fMB/s).",
+            pTransfer->LocalPath,
+            pTransfer->RemotePath,
+            pTransfer->Size,
+            transferTime,
+            GetThroughput(pTransfer->Size, transferTime)
+        );
+
+        totalSize += pTransfer->Size;
+    }
+
+    LogInfo(
+        "Uploaded %llu bytes in %.0fms over %zu connections (%.2fMB/s).",
+        totalSize,
+        elapsedMilliseconds,
+        numberOfThreads,
+        GetThroughput(totalSize, elapsedMilliseconds)
+    );
+
+    return hr;
+}
+
+static BOOL IsModule(const char *filePath)
+{
+    const char *extension = strrchr(filePath, '.');
+
+    return extension != NULL && (!_stricmp(extension, ".xex") || !_stricmp(extension, ".dll"));
+}
+
+HRESULT DeployFiles(Session *pSession, const char *remoteDirectory, char **localPaths, size_t numberOfFiles, size_t numberOfConnections, BOOL force)
+{
+    HRESULT hr = S_OK;
+
+    FileTransfer *pTransfers = calloc(numberOfFiles, sizeof(FileTransfer));
+    if (pTransfers == NULL)
+    {
+        LogError("Could not allocate memory for the uploads.");
+        return E_FAIL;
+    }
+
+    // Every file keeps its name in remoteDirectory
+    for (size_t i = 0; i < numberOfFiles; i++)
+    {
+        char baseName[MAX_PATH] = { 0 };
+        char extension[MAX_PATH] = { 0 };
+        errno_t err = _splitpath_s(localPaths[i], NULL, 0, NULL, 0, baseName, sizeof(baseName), extension, sizeof(extension));
+        if (err != 0)
+        {
+            LogError("Could not split path: %s.", localPaths[i]);
+            free(pTransfers);
+
+            return E_FAIL;
+        }
+
+        pTransfers[i].LocalPath = localPaths[i];
+        pTransfers[i].Result = E_PENDING;
+        _snprintf_s(pTransfers[i].RemotePath, sizeof(pTransfers[i].RemotePath), _TRUNCATE, "%s\\%s%s", remoteDirectory, baseName, extension);
+    }
+
+    // Make sure the modules can be loaded before spending time uploading anything
+    for (size_t i = 0; i < numberOfFiles; i++)
+    {
+        if (!IsModule(pTransfers[i].RemotePath))
+            continue;
+
+        hr = CheckLocalModule(pSession, pTransfers[i].LocalPath, pTransfers[i].RemotePath);
+        if (FAILED(hr))
+        {
+            free(pTransfers);
+            return E_FAIL;
+        }
+    }
+
+    // Create the remote directory if it doesn't exist yet
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmMkdir", remoteDirectory);
+    hr = DmMkdir(remoteDirectory);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr) && hr != XBDM_ALREADYEXISTS)
+    {
+        LogXbdmError(hr);
+        free(pTransfers);
+
+        return E_FAIL;
+    }
+
+    TransferQueue queue = { 0 };
+    queue.pTransfers = pTransfers;
+    queue.NumberOfTransfers = numberOfFiles;
+    hr = UploadFiles(pSession, &queue, numberOfConnections);
+    if (FAILED(hr))
+    {
+        free(pTransfers);
+        return E_FAIL;
+    }
+
+    // Load the uploaded modules one after the other in the order they were given, in case they depend on each other
+    for (size_t i = 0; i < numberOfFiles; i++)
+    {
+        if (!IsModule(pTransfers[i].RemotePath))
+            continue;
+
+        hr = UnloadThenLoad(pSession, pTransfers[i].RemotePath, force);
+        if (FAILED(hr))
+            break;
+    }
+
+    free(pTransfers);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+#define DEFAULT_NUMBER_OF_CONNECTIONS 4
+#define MAX_NUMBER_OF_CONNECTIONS 16
+
+HRESULT DeployFiles(Session *pSession, const char *remoteDirectory, char **localPaths, size_t numberOfFiles, size_t numberOfConnections, BOOL force);
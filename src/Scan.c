@@ -0,0 +1,317 @@
+#include "Scan.h"
+
+#include <emmintrin.h>
+#include <intrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "MemoryIO.h"
+#include "Stats.h"
+
+// The image is read by chunks of this size, the next chunk is read while the previous one is searched
+#define SCAN_CHUNK_SIZE 0x100000
+
+typedef struct _Pattern
+{
+    uint8_t Bytes[MAX_PATTERN_SIZE];
+    BOOL IsWildcard[MAX_PATTERN_SIZE];
+    size_t Size;
+
+    // Index of the byte used to find the candidate positions, never a wildcard
+    size_t AnchorIndex;
+} Pattern;
+
+typedef struct _MatchList
+{
+    uint32_t *pAddresses;
+    size_t NumberOfMatches;
+    size_t Capacity;
+} MatchList;
+
+typedef struct _ScanJob
+{
+    const Pattern *pPattern;
+    uint8_t *pData;
+
+    // The data goes Pattern.Size - 1 bytes past the chunk so that matches crossing into the next chunk are found,
+    // only the first ScanSize positions are searched though since the others belong to the next chunk
+    size_t DataSize;
+    size_t ScanSize;
+    uint32_t Address;
+
+    MatchList Matches;
+    HRESULT Result;
+    HANDLE Thread;
+} ScanJob;
+
+static HRESULT ParsePattern(const char *patternString, Pattern *pPattern)
+{
+    ZeroMemory(pPattern, sizeof(*pPattern));
+
+    const char *delimiters = " \t";
+    char patternCopy[MAX_PATTERN_SIZE * 3 + 1] = { 0 };
+    if (strlen(patternString) >= sizeof(patternCopy))
+    {
+        LogError("The pattern can't be longer than %d bytes.", MAX_PATTERN_SIZE);
+        return E_FAIL;
+    }
+
+    strncpy_s(patternCopy, sizeof(patternCopy), patternString, _TRUNCATE);
+
+    char *context = NULL;
+    for (char *token = strtok_s(patternCopy, delimiters, &context); token != NULL; token = strtok_s(NULL, delimiters, &context))
+    {
+        if (pPattern->Size == MAX_PATTERN_SIZE)
+        {
+            LogError("The pattern can't be longer than %d bytes.", MAX_PATTERN_SIZE);
+            return E_FAIL;
+        }
+
+        if (!strcmp(token, "?") || !strcmp(token, "??"))
+        {
+            pPattern->IsWildcard[pPattern->Size++] = TRUE;
+            continue;
+        }
+
+        char *end = NULL;
+        unsigned long byte = strtoul(token, &end, 16);
+        if (strlen(token) != 2 || *end != '\0' || byte > 0xFF)
+        {
+            LogError("%s is not a valid byte, the pattern needs to be made of hexadecimal bytes or ? separated by spaces.", token);
+            return E_FAIL;
+        }
+
+        pPattern->Bytes[pPattern->Size++] = (uint8_t)byte;
+    }
+
+    // Anchor on the first byte that's not a wildcard, 00 and FF are everywhere in code and data so any other
+    // byte is preferred as it gives less candidates
+    BOOL hasAnchor = FALSE;
+    for (size_t i = 0; i < pPattern->Size; i++)
+    {
+        if (pPattern->IsWildcard[i])
+            continue;
+
+        if (!hasAnchor || (pPattern->Bytes[pPattern->AnchorIndex] == 0x00 || pPattern->Bytes[pPattern->AnchorIndex] == 0xFF))
+            pPattern->AnchorIndex = i;
+
+        hasAnchor = TRUE;
+    }
+
+    if (!hasAnchor)
+    {
+        LogError("The pattern needs at least one byte that's not a wildcard.");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT AddMatch(MatchList *pMatches, uint32_t address)
+{
+    if (pMatches->NumberOfMatches == pMatches->Capacity)
+    {
+        size_t newCapacity = pMatches->Capacity == 0 ? 64 : pMatches->Capacity * 2;
+        uint32_t *pAddresses = realloc(pMatches->pAddresses, newCapacity * sizeof(uint32_t));
+        if (pAddresses == NULL)
+        {
+            LogError("Could not allocate memory for the matches.");
+            return E_FAIL;
+        }
+
+        pMatches->pAddresses = pAddresses;
+        pMatches->Capacity = newCapacity;
+    }
+
+    pMatches->pAddresses[pMatches->NumberOfMatches++] = address;
+
+    return S_OK;
+}
+
+static BOOL MatchesAt(const Pattern *pPattern, const uint8_t *pData)
+{
+    for (size_t i = 0; i < pPattern->Size; i++)
+        if (!pPattern->IsWildcard[i] && pData[i] != pPattern->Bytes[i])
+            return FALSE;
+
+    return TRUE;
+}
+
+static DWORD WINAPI SearchChunk(void *pParameter)
+{
+    ScanJob *pJob = pParameter;
+    const Pattern *pPattern = pJob->pPattern;
+    const uint8_t *pData = pJob->pData;
+    size_t anchorIndex = pPattern->AnchorIndex;
+
+    pJob->Result = S_OK;
+
+    // Compare the anchor byte with 16 positions at once and only check the whole pattern where it matched. The
+    // anchor of the last position searched is at most at ScanSize - 1 + Pattern.Size - 1, which is still in the data.
+    __m128i anchor = _mm_set1_epi8((char)pPattern->Bytes[anchorIndex]);
+    size_t position = 0;
+    for (; position + sizeof(__m128i) <= pJob->ScanSize; position += sizeof(__m128i))
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(pData + position + anchorIndex));
+        unsigned long candidates = (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(block, anchor));
+
+        unsigned long bitIndex = 0;
+        while (_BitScanForward(&bitIndex, candidates))
+        {
+            if (MatchesAt(pPattern, pData + position + bitIndex) && FAILED(AddMatch(&pJob->Matches, pJob->Address + (uint32_t)(position + bitIndex))))
+            {
+                pJob->Result = E_FAIL;
+                return 1;
+            }
+
+            candidates &= candidates - 1;
+        }
+    }
+
+    // The last positions that don't fill a whole block
+    for (; position < pJob->ScanSize; position++)
+    {
+        if (MatchesAt(pPattern, pData + position) && FAILED(AddMatch(&pJob->Matches, pJob->Address + (uint32_t)position)))
+        {
+            pJob->Result = E_FAIL;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static HRESULT FinishJob(ScanJob *pJob, MatchList *pAllMatches)
+{
+    HRESULT hr = S_OK;
+
+    if (pJob->Thread != NULL)
+    {
+        WaitForSingleObject(pJob->Thread, INFINITE);
+        CloseHandle(pJob->Thread);
+        pJob->Thread = NULL;
+    }
+
+    // The chunks are finished in order so the matches stay sorted by address
+    hr = pJob->Result;
+    for (size_t i = 0; i < pJob->Matches.NumberOfMatches && SUCCEEDED(hr); i++)
+        hr = AddMatch(pAllMatches, pJob->Matches.pAddresses[i]);
+
+    free(pJob->Matches.pAddresses);
+    ZeroMemory(&pJob->Matches, sizeof(pJob->Matches));
+    pJob->Result = S_OK;
+
+    return hr;
+}
+
+static HRESULT ScanImage(Session *pSession, uint32_t baseAddress, size_t imageSize, const Pattern *pPattern, MatchList *pAllMatches)
+{
+    HRESULT hr = S_OK;
+
+    // Two chunks at a time, one being searched while the other one is being read
+    ScanJob jobs[2] = { 0 };
+    for (size_t i = 0; i < 2; i++)
+    {
+        jobs[i].pPattern = pPattern;
+        jobs[i].pData = malloc(SCAN_CHUNK_SIZE + MAX_PATTERN_SIZE);
+        if (jobs[i].pData == NULL)
+        {
+            LogError("Could not allocate memory to scan the module.");
+            free(jobs[0].pData);
+
+            return E_FAIL;
+        }
+    }
+
+    size_t chunkIndex = 0;
+    for (size_t offset = 0; offset < imageSize && SUCCEEDED(hr); offset += SCAN_CHUNK_SIZE, chunkIndex++)
+    {
+        // The job was used two chunks ago, its matches need to be collected before the buffer can be reused
+        ScanJob *pJob = &jobs[chunkIndex % 2];
+        hr = FinishJob(pJob, pAllMatches);
+        if (FAILED(hr))
+            break;
+
+        size_t remainingSize = imageSize - offset;
+        pJob->Address = baseAddress + (uint32_t)offset;
+        pJob->DataSize = remainingSize < SCAN_CHUNK_SIZE + pPattern->Size - 1 ? remainingSize : SCAN_CHUNK_SIZE + pPattern->Size - 1;
+        pJob->ScanSize = 0;
+        if (pJob->DataSize >= pPattern->Size)
+            pJob->ScanSize = pJob->DataSize - pPattern->Size + 1 < SCAN_CHUNK_SIZE ? pJob->DataSize - pPattern->Size + 1 : SCAN_CHUNK_SIZE;
+
+        hr = ReadMemory(pSession, pJob->Address, pJob->pData, pJob->DataSize);
+        if (FAILED(hr))
+            break;
+
+        // Search the chunk from this thread if no thread could be created
+        pJob->Thread = CreateThread(NULL, 0, SearchChunk, pJob, 0, NULL);
+        if (pJob->Thread == NULL)
+            SearchChunk(pJob);
+    }
+
+    // Collect the matches of the last two chunks, in order. Both threads need to be done before any buffer is freed.
+    for (size_t i = 0; i < 2; i++)
+    {
+        HRESULT jobResult = FinishJob(&jobs[(chunkIndex + i) % 2], pAllMatches);
+        if (FAILED(jobResult))
+            hr = E_FAIL;
+    }
+
+    for (size_t i = 0; i < 2; i++)
+        free(jobs[i].pData);
+
+    return hr;
+}
+
+HRESULT ScanModule(Session *pSession, const char *moduleName, const char *pattern)
+{
+    HRESULT hr = S_OK;
+
+    Pattern parsedPattern = { 0 };
+    hr = ParsePattern(pattern, &parsedPattern);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // Accept a full path too, only the file name is known by the loaded module list
+    const char *fileName = strrchr(moduleName, '\\');
+    fileName = fileName != NULL ? fileName + 1 : moduleName;
+
+    const ModuleTable *pLoadedModules = NULL;
+    hr = GetLoadedModules(pSession, &pLoadedModules);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    const DMN_MODLOAD *pModule = FindLoadedModule(pLoadedModules, fileName);
+    if (pModule == NULL)
+    {
+        LogError("%s is not loaded.", fileName);
+        return E_FAIL;
+    }
+
+    // The module could be unloaded while it's being scanned so its info is copied
+    uint32_t baseAddress = (uint32_t)(uintptr_t)pModule->BaseAddress;
+    size_t imageSize = pModule->Size;
+
+    MatchList matches = { 0 };
+    double startTime = GetTimeInMilliseconds();
+
+    hr = ScanImage(pSession, baseAddress, imageSize, &parsedPattern, &matches);
+
+    double elapsedMilliseconds = GetTimeInMilliseconds() - startTime;
+
+    if (SUCCEEDED(hr))
+    {
+        for (size_t i = 0; i < matches.NumberOfMatches; i++)
+            printf("0x%08X (%s+0x%X)\n", matches.pAddresses[i], fileName, matches.pAddresses[i] - baseAddress);
+
+        double throughput = elapsedMilliseconds > 0.0 ? (double)imageSize / (1024.0 * 1024.0) / (elapsedMilliseconds / 1000.0) : 0.0;
+        LogInfo("Found %zu matches in %s (%zu bytes in %.0fms, %.2fMB/s).", matches.NumberOfMatches, fileName, imageSize, elapsedMilliseconds, throughput);
+    }
+
+    free(matches.pAddresses);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
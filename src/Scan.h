@@ -0,0 +1,12 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+// Longest pattern -f accepts, in bytes
+#define MAX_PATTERN_SIZE 256
+
+// Prints the address of every occurrence of pattern (hexadecimal bytes separated by spaces, ? or ?? for any byte)
+// in the image of the loaded module named moduleName
+HRESULT ScanModule(Session *pSession, const char *moduleName, const char *pattern);
@@ -0,0 +1,461 @@
+#include "Session.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "Trace.h"
+#include "Utils.h"
+
+HRESULT OpenSession(Session *pSession, const char *consoleName)
+{
+    HRESULT hr = S_OK;
+
+    ZeroMemory(pSession, sizeof(*pSession));
+
+    // Target a specific console instead of the default one set up in Neighborhood, for this process only
+    if (consoleName != NULL)
+    {
+        hr = DmSetXboxNameNoRegister(consoleName);
+        if (FAILED(hr))
+        {
+            LogXbdmError(hr);
+            return E_FAIL;
+        }
+    }
+
+    // Make the XBDM functions that don't take a connection (DmWalkLoadedModules, DmSetMemory...)
+    // reuse a single connection instead of opening a new one on every call, opening it counts as a round trip
+    // like every other connection since the console has to send its greeting
+    hr = DmUseSharedConnection(TRUE);
+    RecordRoundTrip(pSession, 0, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    // Open the connection used to send the RPC commands
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmOpenConnection", NULL);
+    hr = DmOpenConnection(&pSession->Connection);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        DmUseSharedConnection(FALSE);
+
+        return E_FAIL;
+    }
+
+    pSession->DefaultRpcTarget.Processor = RPC_DEFAULT_PROCESSOR;
+    pSession->DefaultRpcTarget.ThreadId = 0;
+
+    // The connections used by the asynchronous RPCs are only opened when needed
+    InitializeCriticalSection(&pSession->RpcConnections.Lock);
+    pSession->RpcConnections.Semaphore = CreateSemaphoreA(NULL, MAX_RPC_CONNECTIONS, MAX_RPC_CONNECTIONS, NULL);
+    if (pSession->RpcConnections.Semaphore == NULL)
+    {
+        LogError("Could not create the semaphore of the RPC connections.");
+        CloseSession(pSession);
+
+        return E_FAIL;
+    }
+
+    // Get the console type once, XdrpcCall needs it to know how to read every response
+    BeginTraceSpan(&span, TRACE_XBDM, "DmGetConsoleType", NULL);
+    hr = DmGetConsoleType(&pSession->ConsoleType);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        CloseSession(pSession);
+
+        return E_FAIL;
+    }
+
+    // Get the name of the console, it identifies the console in the data kept on the PC
+    DWORD consoleNameSize = sizeof(pSession->ConsoleName);
+    BeginTraceSpan(&span, TRACE_XBDM, "DmGetXboxName", NULL);
+    hr = DmGetXboxName(pSession->ConsoleName, &consoleNameSize);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        CloseSession(pSession);
+
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+void CloseSession(Session *pSession)
+{
+    if (pSession->Connection != NULL)
+    {
+        DmCloseConnection(pSession->Connection);
+        pSession->Connection = NULL;
+    }
+
+    if (pSession->RpcConnections.Semaphore != NULL)
+    {
+        for (size_t i = 0; i < MAX_RPC_CONNECTIONS; i++)
+            if (pSession->RpcConnections.Connections[i] != NULL)
+                DmCloseConnection(pSession->RpcConnections.Connections[i]);
+
+        CloseHandle(pSession->RpcConnections.Semaphore);
+        DeleteCriticalSection(&pSession->RpcConnections.Lock);
+        ZeroMemory(&pSession->RpcConnections, sizeof(pSession->RpcConnections));
+    }
+
+    // Close the shared connection
+    DmUseSharedConnection(FALSE);
+
+    // Keep the addresses resolved during the session for the next ones
+    if (pSession->Exports.IsDirty)
+        SaveExportCache(&pSession->Exports, pSession->ConsoleName);
+
+    FreeExportCache(&pSession->Exports);
+
+    free(pSession->LoadedModules.pModules);
+    free(pSession->LoadedModules.ppSortedModules);
+    ZeroMemory(&pSession->LoadedModules, sizeof(pSession->LoadedModules));
+}
+
+void RecordRoundTrip(Session *pSession, size_t bytesSent, size_t bytesReceived)
+{
+    AddRoundTrip(&pSession->Stats, bytesSent, bytesReceived);
+}
+
+HRESULT GetSessionConnection(Session *pSession, PDM_CONNECTION *pConnection)
+{
+    if (pSession->Connection == NULL)
+    {
+        TraceSpan span;
+        BeginTraceSpan(&span, TRACE_XBDM, "DmOpenConnection", "after a failed RPC");
+        HRESULT hr = DmOpenConnection(&pSession->Connection);
+        RecordRoundTrip(pSession, 0, 0);
+        EndTraceSpan(&span, 0, 0);
+        if (FAILED(hr))
+        {
+            LogXbdmError(hr);
+            pSession->Connection = NULL;
+
+            return E_FAIL;
+        }
+    }
+
+    *pConnection = pSession->Connection;
+
+    return S_OK;
+}
+
+void ResetSessionConnection(Session *pSession)
+{
+    // Opened again the next time it's needed, like the connections of the pool
+    if (pSession->Connection != NULL)
+    {
+        DmCloseConnection(pSession->Connection);
+        pSession->Connection = NULL;
+    }
+}
+
+HRESULT AcquireRpcConnection(Session *pSession, PDM_CONNECTION *pConnection, Stats *pStats)
+{
+    RpcConnectionPool *pPool = &pSession->RpcConnections;
+
+    // Wait for a connection to be available
+    WaitForSingleObject(pPool->Semaphore, INFINITE);
+
+    EnterCriticalSection(&pPool->Lock);
+
+    size_t connectionIndex = 0;
+    while (pPool->IsInUse[connectionIndex])
+        connectionIndex++;
+
+    HRESULT hr = S_OK;
+    if (pPool->Connections[connectionIndex] == NULL)
+    {
+        TraceSpan span;
+        BeginTraceSpan(&span, TRACE_XBDM, "DmOpenConnection", "RPC connection");
+        hr = DmOpenConnection(&pPool->Connections[connectionIndex]);
+        AddRoundTrip(pStats, 0, 0);
+        EndTraceSpan(&span, 0, 0);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        pPool->IsInUse[connectionIndex] = TRUE;
+        *pConnection = pPool->Connections[connectionIndex];
+    }
+    else
+    {
+        pPool->Connections[connectionIndex] = NULL;
+    }
+
+    LeaveCriticalSection(&pPool->Lock);
+
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        ReleaseSemaphore(pPool->Semaphore, 1, NULL);
+
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+void ReleaseRpcConnection(Session *pSession, PDM_CONNECTION connection, BOOL isBroken)
+{
+    RpcConnectionPool *pPool = &pSession->RpcConnections;
+
+    EnterCriticalSection(&pPool->Lock);
+
+    for (size_t i = 0; i < MAX_RPC_CONNECTIONS; i++)
+    {
+        if (pPool->Connections[i] != connection)
+            continue;
+
+        // The connection is closed if the console could still be sending data on it, it's opened again
+        // the next time it's needed
+        if (isBroken)
+        {
+            DmCloseConnection(connection);
+            pPool->Connections[i] = NULL;
+        }
+
+        pPool->IsInUse[i] = FALSE;
+        break;
+    }
+
+    LeaveCriticalSection(&pPool->Lock);
+
+    ReleaseSemaphore(pPool->Semaphore, 1, NULL);
+}
+
+DWORD AcquireRpcProcessor(Session *pSession, const RpcTarget *pTarget)
+{
+    RpcConnectionPool *pPool = &pSession->RpcConnections;
+
+    if (pTarget == NULL)
+        pTarget = &pSession->DefaultRpcTarget;
+
+    EnterCriticalSection(&pPool->Lock);
+
+    DWORD processor = pTarget->Processor;
+    if (processor == RPC_ANY_PROCESSOR)
+    {
+        // Take the processor with the least RPCs in flight, the title is more likely to keep the other
+        // processors busy so spreading the RPCs keeps them from piling up behind each other
+        processor = pPool->NextProcessor;
+        for (DWORD i = 1; i < RPC_NUMBER_OF_PROCESSORS; i++)
+        {
+            DWORD candidate = (pPool->NextProcessor + i) % RPC_NUMBER_OF_PROCESSORS;
+            if (pPool->CallsPerProcessor[candidate] < pPool->CallsPerProcessor[processor])
+                processor = candidate;
+        }
+
+        pPool->NextProcessor = (processor + 1) % RPC_NUMBER_OF_PROCESSORS;
+    }
+
+    pPool->CallsPerProcessor[processor]++;
+
+    LeaveCriticalSection(&pPool->Lock);
+
+    return processor;
+}
+
+void ReleaseRpcProcessor(Session *pSession, DWORD processor)
+{
+    RpcConnectionPool *pPool = &pSession->RpcConnections;
+
+    EnterCriticalSection(&pPool->Lock);
+    pPool->CallsPerProcessor[processor]--;
+    LeaveCriticalSection(&pPool->Lock);
+}
+
+static int CompareModules(const void *pFirst, const void *pSecond)
+{
+    const DMN_MODLOAD *pFirstModule = *(const DMN_MODLOAD **)pFirst;
+    const DMN_MODLOAD *pSecondModule = *(const DMN_MODLOAD **)pSecond;
+
+    return _stricmp(pFirstModule->Name, pSecondModule->Name);
+}
+
+static int CompareModuleName(const void *pName, const void *pModule)
+{
+    return _stricmp((const char *)pName, (*(const DMN_MODLOAD **)pModule)->Name);
+}
+
+static void SortLoadedModules(ModuleTable *pLoadedModules)
+{
+    for (size_t i = 0; i < pLoadedModules->NumberOfModules; i++)
+        pLoadedModules->ppSortedModules[i] = &pLoadedModules->pModules[i];
+
+    qsort(pLoadedModules->ppSortedModules, pLoadedModules->NumberOfModules, sizeof(DMN_MODLOAD *), CompareModules);
+}
+
+static HRESULT GrowLoadedModules(ModuleTable *pLoadedModules)
+{
+    size_t newCapacity = pLoadedModules->Capacity == 0 ? 64 : pLoadedModules->Capacity * 2;
+
+    DMN_MODLOAD *pModules = realloc(pLoadedModules->pModules, newCapacity * sizeof(DMN_MODLOAD));
+    if (pModules == NULL)
+    {
+        LogError("Could not allocate memory for the loaded modules.");
+        return E_FAIL;
+    }
+
+    pLoadedModules->pModules = pModules;
+
+    DMN_MODLOAD **ppSortedModules = realloc(pLoadedModules->ppSortedModules, newCapacity * sizeof(DMN_MODLOAD *));
+    if (ppSortedModules == NULL)
+    {
+        LogError("Could not allocate memory for the loaded modules.");
+        return E_FAIL;
+    }
+
+    pLoadedModules->ppSortedModules = ppSortedModules;
+    pLoadedModules->Capacity = newCapacity;
+
+    return S_OK;
+}
+
+static HRESULT RefreshLoadedModules(Session *pSession)
+{
+    HRESULT hr = S_OK;
+
+    ModuleTable *pLoadedModules = &pSession->LoadedModules;
+    PDM_WALK_MODULES pModuleWalker = NULL;
+    DMN_MODLOAD loadedModule = { 0 };
+
+    pLoadedModules->NumberOfModules = 0;
+    pLoadedModules->IsUpToDate = FALSE;
+
+    // Go through the loaded modules and copy them into the table
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmWalkLoadedModules", NULL);
+    while ((hr = DmWalkLoadedModules(&pModuleWalker, &loadedModule)) == XBDM_NOERR)
+    {
+        if (pLoadedModules->NumberOfModules == pLoadedModules->Capacity && FAILED(GrowLoadedModules(pLoadedModules)))
+        {
+            DmCloseLoadedModules(pModuleWalker);
+            return E_FAIL;
+        }
+
+        pLoadedModules->pModules[pLoadedModules->NumberOfModules++] = loadedModule;
+    }
+
+    // The whole module list is fetched by the first call to DmWalkLoadedModules
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, pLoadedModules->NumberOfModules * sizeof(DMN_MODLOAD));
+
+    // Error handling
+    if (hr != XBDM_ENDOFLIST)
+    {
+        LogXbdmError(hr);
+        DmCloseLoadedModules(pModuleWalker);
+
+        return hr;
+    }
+
+    // Free the memory allocated by DmWalkLoadedModules
+    DmCloseLoadedModules(pModuleWalker);
+
+    SortLoadedModules(pLoadedModules);
+    pLoadedModules->IsUpToDate = TRUE;
+
+    return S_OK;
+}
+
+HRESULT GetLoadedModules(Session *pSession, const ModuleTable **ppLoadedModules)
+{
+    // Only walk the loaded modules if the table was never filled or if it could have changed since then
+    if (pSession->LoadedModules.IsUpToDate == FALSE)
+    {
+        HRESULT hr = RefreshLoadedModules(pSession);
+        if (FAILED(hr))
+            return hr;
+    }
+
+    *ppLoadedModules = &pSession->LoadedModules;
+
+    return S_OK;
+}
+
+const DMN_MODLOAD *FindLoadedModule(const ModuleTable *pLoadedModules, const char *moduleName)
+{
+    DMN_MODLOAD **ppModule = bsearch(
+        moduleName,
+        pLoadedModules->ppSortedModules,
+        pLoadedModules->NumberOfModules,
+        sizeof(DMN_MODLOAD *),
+        CompareModuleName
+    );
+
+    return ppModule != NULL ? *ppModule : NULL;
+}
+
+HRESULT AddLoadedModule(Session *pSession, const DMN_MODLOAD *pModule)
+{
+    ForgetVerifiedModule(&pSession->Exports, pModule->Name);
+
+    ModuleTable *pLoadedModules = &pSession->LoadedModules;
+    if (pLoadedModules->IsUpToDate == FALSE)
+        return S_OK;
+
+    // Update the module in place if it's already in the table
+    DMN_MODLOAD *pExistingModule = (DMN_MODLOAD *)FindLoadedModule(pLoadedModules, pModule->Name);
+    if (pExistingModule != NULL)
+    {
+        *pExistingModule = *pModule;
+        return S_OK;
+    }
+
+    if (pLoadedModules->NumberOfModules == pLoadedModules->Capacity && FAILED(GrowLoadedModules(pLoadedModules)))
+    {
+        InvalidateLoadedModules(pSession);
+        return E_FAIL;
+    }
+
+    // The console appends newly loaded modules to its list so the same is done here
+    pLoadedModules->pModules[pLoadedModules->NumberOfModules++] = *pModule;
+
+    SortLoadedModules(pLoadedModules);
+
+    return S_OK;
+}
+
+void RemoveLoadedModule(Session *pSession, const char *moduleName)
+{
+    ForgetVerifiedModule(&pSession->Exports, moduleName);
+
+    ModuleTable *pLoadedModules = &pSession->LoadedModules;
+    if (pLoadedModules->IsUpToDate == FALSE)
+        return;
+
+    const DMN_MODLOAD *pModule = FindLoadedModule(pLoadedModules, moduleName);
+    if (pModule == NULL)
+        return;
+
+    // Remove the module while keeping the order of the console, then rebuild the index because
+    // the modules after it have moved
+    size_t index = (size_t)(pModule - pLoadedModules->pModules);
+    memmove(
+        &pLoadedModules->pModules[index],
+        &pLoadedModules->pModules[index + 1],
+        (pLoadedModules->NumberOfModules - index - 1) * sizeof(DMN_MODLOAD)
+    );
+    pLoadedModules->NumberOfModules--;
+
+    SortLoadedModules(pLoadedModules);
+}
+
+void InvalidateLoadedModules(Session *pSession)
+{
+    pSession->LoadedModules.IsUpToDate = FALSE;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <Windows.h>
+
+// XBDM uses bit field types other than int which triggers a warning at warning level 4
+// so we just disable it for XBDM
+#pragma warning(push)
+#pragma warning(disable : 4214)
+#include <xbdm.h>
+#pragma warning(pop)
+
+#include "ExportCache.h"
+#include "Stats.h"
+
+typedef struct _ModuleTable
+{
+    // The modules in the order they were returned by the console
+    DMN_MODLOAD *pModules;
+
+    // Pointers to the modules sorted by name (case-insensitive) for lookups
+    DMN_MODLOAD **ppSortedModules;
+
+    size_t NumberOfModules;
+    size_t Capacity;
+    BOOL IsUpToDate;
+} ModuleTable;
+
+// The CPU has 3 cores with 2 hardware threads each, the processor of an RPC is the index of the hardware thread
+#define RPC_NUMBER_OF_PROCESSORS 6
+
+// The processor every RPC ran on before it could be chosen
+#define RPC_DEFAULT_PROCESSOR 5
+
+// Lets the session pick the least busy processor for every RPC
+#define RPC_ANY_PROCESSOR ((DWORD)-1)
+
+typedef struct _RpcTarget
+{
+    // Hardware thread the RPC runs on (0 to 5) or RPC_ANY_PROCESSOR
+    DWORD Processor;
+
+    // Id of the title thread the RPC runs on, 0 to run it on a system thread
+    DWORD ThreadId;
+} RpcTarget;
+
+// Maximum number of RPCs that can be in flight at the same time, each of them needs its own connection
+#define MAX_RPC_CONNECTIONS 4
+
+typedef struct _RpcConnectionPool
+{
+    // Opened the first time they're needed
+    PDM_CONNECTION Connections[MAX_RPC_CONNECTIONS];
+    BOOL IsInUse[MAX_RPC_CONNECTIONS];
+
+    CRITICAL_SECTION Lock;
+
+    // Counts the connections that are not in use
+    HANDLE Semaphore;
+
+    // Number of RPCs in flight on each processor, and where to start looking for the least busy one so that
+    // RPCs sent one after the other don't all end up on the same processor
+    LONG CallsPerProcessor[RPC_NUMBER_OF_PROCESSORS];
+    DWORD NextProcessor;
+} RpcConnectionPool;
+
+typedef struct _Session
+{
+    PDM_CONNECTION Connection;
+    DWORD ConsoleType;
+    char ConsoleName[MAX_PATH];
+    Stats Stats;
+    ModuleTable LoadedModules;
+    RpcConnectionPool RpcConnections;
+
+    // Where the RPCs run when no target is given for a specific call
+    RpcTarget DefaultRpcTarget;
+
+    // Addresses of the functions called with XDRPC, only read from the disk when the first RPC is sent
+    ExportCache Exports;
+
+    // Whether the RPCs can be sent with the address of the function instead of its module name and ordinal. Off by
+    // default because the layout of such a buffer is not documented, a console that still reads the module name
+    // and ordinal from it would call a null export.
+    BOOL UseAddressCalls;
+} Session;
+
+HRESULT OpenSession(Session *pSession, const char *consoleName);
+
+void CloseSession(Session *pSession);
+
+void RecordRoundTrip(Session *pSession, size_t bytesSent, size_t bytesReceived);
+
+// Returns the connection the synchronous RPCs are sent on, opened again if it was reset
+HRESULT GetSessionConnection(Session *pSession, PDM_CONNECTION *pConnection);
+
+// Closes the connection of the synchronous RPCs after a failed command, the console could still be sending data on it
+void ResetSessionConnection(Session *pSession);
+
+HRESULT GetLoadedModules(Session *pSession, const ModuleTable **ppLoadedModules);
+
+const DMN_MODLOAD *FindLoadedModule(const ModuleTable *pLoadedModules, const char *moduleName);
+
+HRESULT AddLoadedModule(Session *pSession, const DMN_MODLOAD *pModule);
+
+void RemoveLoadedModule(Session *pSession, const char *moduleName);
+
+void InvalidateLoadedModules(Session *pSession);
+
+// Opening a connection is counted as a round trip in pStats, which belongs to the calling thread
+HRESULT AcquireRpcConnection(Session *pSession, PDM_CONNECTION *pConnection, Stats *pStats);
+
+void ReleaseRpcConnection(Session *pSession, PDM_CONNECTION connection, BOOL isBroken);
+
+// Returns the processor an RPC sent to pTarget (or the default target of the session if NULL) should run on,
+// ReleaseRpcProcessor needs to be called with it once the RPC is done
+DWORD AcquireRpcProcessor(Session *pSession, const RpcTarget *pTarget);
+
+void ReleaseRpcProcessor(Session *pSession, DWORD processor);
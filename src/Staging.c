@@ -0,0 +1,361 @@
+#include "Staging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Hash.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Modules.h"
+#include "Upload.h"
+#include "Utils.h"
+
+// Each build is staged in <STAGING_DIR>\<hash of the content>\<file name> so that the module keeps its name when
+// it's loaded, and the index lists the staged builds with their size and the last time they were used
+#define STAGING_DIR "hdd:\\ModuleLoader\\Staging"
+#define STAGING_INDEX_PATH STAGING_DIR "\\index.txt"
+
+#define MAX_STAGED_BUILDS 256
+#define MAX_INDEX_SIZE 0x10000
+
+typedef struct _StagedBuild
+{
+    uint64_t Hash;
+    uint64_t Size;
+    int64_t LastUsedTime;
+    char FileName[MAX_PATH];
+
+    // Set when the build couldn't be deleted (most likely because it's loaded), not saved in the index
+    BOOL IsPinned;
+} StagedBuild;
+
+typedef struct _StagingIndex
+{
+    StagedBuild Builds[MAX_STAGED_BUILDS];
+    size_t NumberOfBuilds;
+} StagingIndex;
+
+static void GetStagedBuildPaths(const StagedBuild *pBuild, char *directoryPath, size_t directoryPathSize, char *filePath, size_t filePathSize)
+{
+    _snprintf_s(directoryPath, directoryPathSize, _TRUNCATE, "%s\\%016llx", STAGING_DIR, pBuild->Hash);
+    _snprintf_s(filePath, filePathSize, _TRUNCATE, "%s\\%s", directoryPath, pBuild->FileName);
+}
+
+static HRESULT CreateRemoteDirectory(Session *pSession, const char *directoryPath)
+{
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmMkdir", directoryPath);
+    HRESULT hr = DmMkdir(directoryPath);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr) && hr != XBDM_ALREADYEXISTS)
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT ReadStagingIndex(Session *pSession, StagingIndex *pIndex)
+{
+    HRESULT hr = S_OK;
+
+    ZeroMemory(pIndex, sizeof(*pIndex));
+
+    // Nothing was ever staged on this console
+    DM_FILE_ATTRIBUTES fileAttributes = { 0 };
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmGetFileAttributes", STAGING_INDEX_PATH);
+    hr = DmGetFileAttributes(STAGING_INDEX_PATH, &fileAttributes);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (hr == XBDM_NOSUCHFILE)
+        return S_OK;
+
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    if (fileAttributes.SizeHigh != 0 || fileAttributes.SizeLow >= MAX_INDEX_SIZE)
+    {
+        LogError("%s is too big.", STAGING_INDEX_PATH);
+        return E_FAIL;
+    }
+
+    char *content = calloc(MAX_INDEX_SIZE, 1);
+    if (content == NULL)
+    {
+        LogError("Could not allocate memory for the staging index.");
+        return E_FAIL;
+    }
+
+    uint32_t bytesRead = 0;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReadFilePartial", STAGING_INDEX_PATH);
+    hr = DmReadFilePartial(STAGING_INDEX_PATH, 0, (uint8_t *)content, fileAttributes.SizeLow, (DWORD *)&bytesRead);
+    RecordRoundTrip(pSession, 0, bytesRead);
+    EndTraceSpan(&span, 0, bytesRead);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        free(content);
+
+        return E_FAIL;
+    }
+
+    // Each line is: <hash> <size> <last used time> <file name>
+    char *context = NULL;
+    for (char *line = strtok_s(content, "\r\n", &context); line != NULL; line = strtok_s(NULL, "\r\n", &context))
+    {
+        if (pIndex->NumberOfBuilds == MAX_STAGED_BUILDS)
+            break;
+
+        StagedBuild *pBuild = &pIndex->Builds[pIndex->NumberOfBuilds];
+        int numberOfFields = sscanf_s(
+            line,
+            "%llx %llu %lld %259[^\r\n]",
+            &pBuild->Hash,
+            &pBuild->Size,
+            &pBuild->LastUsedTime,
+            pBuild->FileName,
+            (unsigned int)sizeof(pBuild->FileName)
+        );
+
+        if (numberOfFields == 4)
+            pIndex->NumberOfBuilds++;
+    }
+
+    free(content);
+
+    return S_OK;
+}
+
+static HRESULT WriteStagingIndex(Session *pSession, const StagingIndex *pIndex)
+{
+    HRESULT hr = S_OK;
+
+    // The index is written to a temporary file on the PC first because XBDM can only send whole files
+    // or overwrite parts of existing ones, and the index can get smaller
+    char tempDirectory[MAX_PATH] = { 0 };
+    char tempFilePath[MAX_PATH] = { 0 };
+    if (GetTempPathA(sizeof(tempDirectory), tempDirectory) == 0 || GetTempFileNameA(tempDirectory, "ML", 0, tempFilePath) == 0)
+    {
+        LogError("Could not create a temporary file for the staging index.");
+        return E_FAIL;
+    }
+
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, tempFilePath, "wb");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", tempFilePath);
+        DeleteFileA(tempFilePath);
+
+        return E_FAIL;
+    }
+
+    for (size_t i = 0; i < pIndex->NumberOfBuilds; i++)
+    {
+        const StagedBuild *pBuild = &pIndex->Builds[i];
+        fprintf(pFile, "%016llx %llu %lld %s\r\n", pBuild->Hash, pBuild->Size, pBuild->LastUsedTime, pBuild->FileName);
+    }
+
+    fclose(pFile);
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmSendFile", STAGING_INDEX_PATH);
+    hr = DmSendFile(tempFilePath, STAGING_INDEX_PATH);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    DeleteFileA(tempFilePath);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT DeleteStagedBuild(Session *pSession, const StagedBuild *pBuild)
+{
+    char directoryPath[MAX_PATH] = { 0 };
+    char filePath[MAX_PATH] = { 0 };
+    GetStagedBuildPaths(pBuild, directoryPath, sizeof(directoryPath), filePath, sizeof(filePath));
+
+    // Deleting the file fails if the build is currently loaded, it's kept in the index in that case
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmDeleteFile", filePath);
+    HRESULT hr = DmDeleteFile(filePath, FALSE);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr) && hr != XBDM_NOSUCHFILE)
+        return hr;
+
+    BeginTraceSpan(&span, TRACE_XBDM, "DmDeleteFile", directoryPath);
+    hr = DmDeleteFile(directoryPath, TRUE);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+
+    return S_OK;
+}
+
+static void EvictStagedBuilds(Session *pSession, StagingIndex *pIndex, uint64_t stagingSize, uint64_t keptHash)
+{
+    uint64_t totalSize = 0;
+    for (size_t i = 0; i < pIndex->NumberOfBuilds; i++)
+        totalSize += pIndex->Builds[i].Size;
+
+    // Delete the least recently used builds until the staged builds fit in stagingSize
+    while (totalSize > stagingSize)
+    {
+        size_t oldestIndex = SIZE_MAX;
+        for (size_t i = 0; i < pIndex->NumberOfBuilds; i++)
+        {
+            const StagedBuild *pBuild = &pIndex->Builds[i];
+            if (pBuild->Hash == keptHash || pBuild->IsPinned)
+                continue;
+
+            if (oldestIndex == SIZE_MAX || pBuild->LastUsedTime < pIndex->Builds[oldestIndex].LastUsedTime)
+                oldestIndex = i;
+        }
+
+        // Nothing left to evict
+        if (oldestIndex == SIZE_MAX)
+            break;
+
+        StagedBuild *pOldestBuild = &pIndex->Builds[oldestIndex];
+        if (FAILED(DeleteStagedBuild(pSession, pOldestBuild)))
+        {
+            // Don't try to evict it again during this run
+            pOldestBuild->IsPinned = TRUE;
+            continue;
+        }
+
+        LogInfo("Evicted %016llx\\%s from the staging area.", pOldestBuild->Hash, pOldestBuild->FileName);
+
+        totalSize -= pOldestBuild->Size;
+        *pOldestBuild = pIndex->Builds[--pIndex->NumberOfBuilds];
+    }
+}
+
+HRESULT LoadFromStaging(Session *pSession, const char *localPath, uint64_t stagingSize, BOOL force)
+{
+    HRESULT hr = S_OK;
+
+    // Make sure the module can be loaded before staging it
+    hr = CheckLocalModule(pSession, localPath, localPath);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // Identify the build by the hash of its content
+    uint8_t *pData = NULL;
+    size_t fileSize = 0;
+    hr = ReadLocalFile(localPath, &pData, &fileSize);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    StagedBuild build = { 0 };
+    build.Hash = HashData(pData, fileSize);
+    build.Size = fileSize;
+    build.LastUsedTime = (int64_t)time(NULL);
+
+    free(pData);
+
+    char baseName[MAX_PATH] = { 0 };
+    char extension[MAX_PATH] = { 0 };
+    errno_t err = _splitpath_s(localPath, NULL, 0, NULL, 0, baseName, sizeof(baseName), extension, sizeof(extension));
+    if (err != 0)
+    {
+        LogError("Could not split path: %s.", localPath);
+        return E_FAIL;
+    }
+
+    _snprintf_s(build.FileName, sizeof(build.FileName), _TRUNCATE, "%s%s", baseName, extension);
+
+    char directoryPath[MAX_PATH] = { 0 };
+    char stagedPath[MAX_PATH] = { 0 };
+    GetStagedBuildPaths(&build, directoryPath, sizeof(directoryPath), stagedPath, sizeof(stagedPath));
+
+    StagingIndex *pIndex = malloc(sizeof(StagingIndex));
+    if (pIndex == NULL)
+    {
+        LogError("Could not allocate memory for the staging index.");
+        return E_FAIL;
+    }
+
+    hr = ReadStagingIndex(pSession, pIndex);
+    if (FAILED(hr))
+    {
+        free(pIndex);
+        return E_FAIL;
+    }
+
+    // Look for the build in the index
+    StagedBuild *pStagedBuild = NULL;
+    for (size_t i = 0; i < pIndex->NumberOfBuilds; i++)
+        if (pIndex->Builds[i].Hash == build.Hash && !_stricmp(pIndex->Builds[i].FileName, build.FileName))
+            pStagedBuild = &pIndex->Builds[i];
+
+    // Make sure the staged file wasn't deleted behind our back
+    DM_FILE_ATTRIBUTES fileAttributes = { 0 };
+    if (pStagedBuild != NULL)
+    {
+        TraceSpan span;
+        BeginTraceSpan(&span, TRACE_XBDM, "DmGetFileAttributes", stagedPath);
+        hr = DmGetFileAttributes(stagedPath, &fileAttributes);
+        RecordRoundTrip(pSession, 0, 0);
+        EndTraceSpan(&span, 0, 0);
+        if (hr != XBDM_NOERR || (((uint64_t)fileAttributes.SizeHigh << 32) | fileAttributes.SizeLow) != build.Size)
+        {
+            *pStagedBuild = pIndex->Builds[--pIndex->NumberOfBuilds];
+            pStagedBuild = NULL;
+        }
+    }
+
+    if (pStagedBuild != NULL)
+    {
+        LogInfo("%s is already staged at %s.", localPath, stagedPath);
+        pStagedBuild->LastUsedTime = build.LastUsedTime;
+    }
+    else
+    {
+        if (pIndex->NumberOfBuilds == MAX_STAGED_BUILDS)
+        {
+            LogError("Too many builds are staged, clean up %s.", STAGING_DIR);
+            free(pIndex);
+
+            return E_FAIL;
+        }
+
+        hr = CreateRemoteDirectory(pSession, "hdd:\\ModuleLoader");
+        if (SUCCEEDED(hr))
+            hr = CreateRemoteDirectory(pSession, STAGING_DIR);
+        if (SUCCEEDED(hr))
+            hr = CreateRemoteDirectory(pSession, directoryPath);
+        if (SUCCEEDED(hr))
+            hr = UploadFile(pSession, localPath, stagedPath);
+
+        if (FAILED(hr))
+        {
+            free(pIndex);
+            return E_FAIL;
+        }
+
+        pIndex->Builds[pIndex->NumberOfBuilds++] = build;
+    }
+
+    EvictStagedBuilds(pSession, pIndex, stagingSize, build.Hash);
+
+    hr = WriteStagingIndex(pSession, pIndex);
+    free(pIndex);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // The staged file has the same name as the local one so it replaces any other build of the same module
+    return UnloadThenLoad(pSession, stagedPath, force);
+}
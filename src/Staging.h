@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <Windows.h>
+
+#include "Session.h"
+
+// Default maximum size of the staged builds on the console
+#define DEFAULT_STAGING_SIZE (512ULL * 1024 * 1024)
+
+HRESULT LoadFromStaging(Session *pSession, const char *localPath, uint64_t stagingSize, BOOL force);
@@ -0,0 +1,80 @@
+#include "Stats.h"
+
+#include <stdio.h>
+
+#include "Log.h"
+
+double GetTimeInMilliseconds(void)
+{
+    LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER counter = { 0 };
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+}
+
+void AddRoundTrip(Stats *pStats, size_t bytesSent, size_t bytesReceived)
+{
+    pStats->RoundTrips++;
+    pStats->BytesSent += bytesSent;
+    pStats->BytesReceived += bytesReceived;
+}
+
+void AddStats(Stats *pStats, const Stats *pOtherStats)
+{
+    pStats->RoundTrips += pOtherStats->RoundTrips;
+    pStats->BytesSent += pOtherStats->BytesSent;
+    pStats->BytesReceived += pOtherStats->BytesReceived;
+}
+
+void WriteJsonString(FILE *pFile, const char *string)
+{
+    fputc('"', pFile);
+
+    // Module paths contain backslashes so they need to be escaped
+    for (const char *pChar = string; *pChar != '\0'; pChar++)
+    {
+        if ((unsigned char)*pChar < 0x20)
+        {
+            fprintf(pFile, "\\u%04x", (unsigned char)*pChar);
+            continue;
+        }
+
+        if (*pChar == '"' || *pChar == '\\')
+            fputc('\\', pFile);
+
+        fputc(*pChar, pFile);
+    }
+
+    fputc('"', pFile);
+}
+
+HRESULT AppendStats(const char *filePath, const char *command, const Stats *pStats, double elapsedMilliseconds, int exitCode)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, filePath, "a");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", filePath);
+        return E_FAIL;
+    }
+
+    // Write the stats as a single JSON object per line so that multiple runs can be aggregated
+    fputs("{\"command\":", pFile);
+    WriteJsonString(pFile, command);
+    fprintf(
+        pFile,
+        ",\"exit_code\":%d,\"elapsed_ms\":%.3f,\"round_trips\":%llu,\"bytes_sent\":%llu,\"bytes_received\":%llu}\n",
+        exitCode,
+        elapsedMilliseconds,
+        pStats->RoundTrips,
+        pStats->BytesSent,
+        pStats->BytesReceived
+    );
+
+    fclose(pFile);
+
+    return S_OK;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <Windows.h>
+
+typedef struct _Stats
+{
+    uint64_t RoundTrips;
+    uint64_t BytesSent;
+    uint64_t BytesReceived;
+} Stats;
+
+double GetTimeInMilliseconds(void);
+
+void AddRoundTrip(Stats *pStats, size_t bytesSent, size_t bytesReceived);
+
+void AddStats(Stats *pStats, const Stats *pOtherStats);
+
+// Writes string between quotes, escaping what needs to be
+void WriteJsonString(FILE *pFile, const char *string);
+
+HRESULT AppendStats(const char *filePath, const char *command, const Stats *pStats, double elapsedMilliseconds, int exitCode);
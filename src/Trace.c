@@ -0,0 +1,160 @@
+#include "Trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.h"
+#include "Stats.h"
+
+typedef struct _TraceEvent
+{
+    const char *Category;
+    const char *Name;
+    char Detail[TRACE_DETAIL_SIZE];
+    double StartTime;
+    double Duration;
+    DWORD ThreadId;
+    uint64_t BytesSent;
+    uint64_t BytesReceived;
+} TraceEvent;
+
+// The spans come from the worker threads too so the events are shared by the whole process, the flag is only
+// changed while no command is running
+static BOOL s_IsTracing = FALSE;
+static CRITICAL_SECTION s_TraceLock;
+static TraceEvent *s_pEvents = NULL;
+static size_t s_NumberOfEvents = 0;
+static size_t s_Capacity = 0;
+static double s_TraceStartTime = 0.0;
+
+HRESULT StartTrace(void)
+{
+    if (s_IsTracing)
+        return S_OK;
+
+    InitializeCriticalSection(&s_TraceLock);
+    s_pEvents = NULL;
+    s_NumberOfEvents = 0;
+    s_Capacity = 0;
+    s_TraceStartTime = GetTimeInMilliseconds();
+    s_IsTracing = TRUE;
+
+    return S_OK;
+}
+
+BOOL IsTracing(void)
+{
+    return s_IsTracing;
+}
+
+void BeginTraceSpan(TraceSpan *pSpan, const char *category, const char *name, const char *detail)
+{
+    // A span started while not tracing is ignored when it ends, even if a trace was started in between
+    if (!s_IsTracing)
+    {
+        pSpan->Name = NULL;
+        return;
+    }
+
+    pSpan->Category = category;
+    pSpan->Name = name;
+    pSpan->Detail[0] = '\0';
+    if (detail != NULL)
+        strncpy_s(pSpan->Detail, sizeof(pSpan->Detail), detail, _TRUNCATE);
+
+    pSpan->StartTime = GetTimeInMilliseconds();
+}
+
+void EndTraceSpan(const TraceSpan *pSpan, size_t bytesSent, size_t bytesReceived)
+{
+    if (!s_IsTracing || pSpan->Name == NULL)
+        return;
+
+    double endTime = GetTimeInMilliseconds();
+
+    EnterCriticalSection(&s_TraceLock);
+
+    if (s_NumberOfEvents == s_Capacity)
+    {
+        size_t newCapacity = s_Capacity == 0 ? 256 : s_Capacity * 2;
+        TraceEvent *pEvents = realloc(s_pEvents, newCapacity * sizeof(TraceEvent));
+        if (pEvents == NULL)
+        {
+            // Losing a span is better than failing the command being traced
+            LeaveCriticalSection(&s_TraceLock);
+            return;
+        }
+
+        s_pEvents = pEvents;
+        s_Capacity = newCapacity;
+    }
+
+    TraceEvent *pEvent = &s_pEvents[s_NumberOfEvents++];
+    pEvent->Category = pSpan->Category;
+    pEvent->Name = pSpan->Name;
+    strncpy_s(pEvent->Detail, sizeof(pEvent->Detail), pSpan->Detail, _TRUNCATE);
+    pEvent->StartTime = pSpan->StartTime;
+    pEvent->Duration = endTime - pSpan->StartTime;
+    pEvent->ThreadId = GetCurrentThreadId();
+    pEvent->BytesSent = bytesSent;
+    pEvent->BytesReceived = bytesReceived;
+
+    LeaveCriticalSection(&s_TraceLock);
+}
+
+HRESULT WriteTrace(const char *filePath)
+{
+    if (!s_IsTracing)
+        return S_OK;
+
+    s_IsTracing = FALSE;
+
+    HRESULT hr = S_OK;
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, filePath, "w");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", filePath);
+        hr = E_FAIL;
+    }
+    else
+    {
+        // Complete events ("ph":"X") with timestamps in microseconds from the start of the trace
+        DWORD processId = GetCurrentProcessId();
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", pFile);
+
+        for (size_t i = 0; i < s_NumberOfEvents; i++)
+        {
+            const TraceEvent *pEvent = &s_pEvents[i];
+
+            fputs("{\"name\":", pFile);
+            WriteJsonString(pFile, pEvent->Name);
+            fputs(",\"cat\":", pFile);
+            WriteJsonString(pFile, pEvent->Category);
+            fprintf(
+                pFile,
+                ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu,\"args\":{\"detail\":",
+                (pEvent->StartTime - s_TraceStartTime) * 1000.0,
+                pEvent->Duration * 1000.0,
+                processId,
+                pEvent->ThreadId
+            );
+            WriteJsonString(pFile, pEvent->Detail);
+            fprintf(pFile, ",\"bytes_sent\":%llu,\"bytes_received\":%llu}}%s\n", pEvent->BytesSent, pEvent->BytesReceived, i + 1 < s_NumberOfEvents ? "," : "");
+        }
+
+        fputs("]}\n", pFile);
+        fclose(pFile);
+
+        LogInfo("Wrote %zu spans to %s.", s_NumberOfEvents, filePath);
+    }
+
+    free(s_pEvents);
+    s_pEvents = NULL;
+    s_NumberOfEvents = 0;
+    s_Capacity = 0;
+    DeleteCriticalSection(&s_TraceLock);
+
+    return hr;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <Windows.h>
+
+// Categories of the spans, to filter them in the trace viewer
+#define TRACE_XBDM "xbdm"
+#define TRACE_STEP "step"
+
+#define TRACE_DETAIL_SIZE 128
+
+// A span being measured, it lives on the stack of the code it measures
+typedef struct _TraceSpan
+{
+    const char *Category;
+    const char *Name;
+    double StartTime;
+    char Detail[TRACE_DETAIL_SIZE];
+} TraceSpan;
+
+// Starts recording the spans of every thread of the process
+HRESULT StartTrace(void);
+
+// Stops recording and writes the spans recorded since StartTrace to filePath in the Chrome trace event format
+// (chrome://tracing, https://ui.perfetto.dev)
+HRESULT WriteTrace(const char *filePath);
+
+BOOL IsTracing(void);
+
+// When no trace is being recorded, these only check a flag so they can be left around every XBDM call. name needs
+// to stay valid until the trace is written (a string literal), detail (optional) is copied.
+void BeginTraceSpan(TraceSpan *pSpan, const char *category, const char *name, const char *detail);
+
+void EndTraceSpan(const TraceSpan *pSpan, size_t bytesSent, size_t bytesReceived);
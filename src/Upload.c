@@ -0,0 +1,349 @@
+#include "Upload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Hash.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Utils.h"
+
+// Files are compared and sent by chunks of this size
+#define CHUNK_SIZE 0x10000
+
+#define UPLOAD_RECORD_MAGIC 0x524C4D55 // "UMLR"
+#define UPLOAD_RECORD_VERSION 1
+
+// What was last uploaded to a file on the console, kept on the PC to know which chunks the file on the console
+// is made of without having to read it back
+typedef struct _UploadRecord
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t FileSize;
+    FILETIME ChangeTime;
+    uint32_t ChunkSize;
+    uint32_t NumberOfChunks;
+} UploadRecord;
+
+static uint32_t GetNumberOfChunks(size_t fileSize)
+{
+    return (uint32_t)((fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE);
+}
+
+static size_t GetChunkSize(size_t fileSize, uint32_t chunkIndex)
+{
+    size_t chunkOffset = (size_t)chunkIndex * CHUNK_SIZE;
+
+    return fileSize - chunkOffset < CHUNK_SIZE ? fileSize - chunkOffset : CHUNK_SIZE;
+}
+
+static HRESULT GetUploadRecordPath(Session *pSession, const char *remotePath, char *recordPath, size_t recordPathSize)
+{
+    // Name the record after the console and the path on the console, case-insensitive like the console file system
+    char key[MAX_PATH * 2] = { 0 };
+    _snprintf_s(key, sizeof(key), _TRUNCATE, "%s|%s", pSession->ConsoleName, remotePath);
+    _strlwr_s(key, sizeof(key));
+
+    char recordName[20] = { 0 };
+    _snprintf_s(recordName, sizeof(recordName), _TRUNCATE, "%016llx", HashData(key, strlen(key)));
+
+    return GetLocalDataPath("Uploads", recordName, recordPath, recordPathSize);
+}
+
+static HRESULT ReadUploadRecord(const char *recordPath, UploadRecord *pRecord, uint64_t **ppChunkHashes)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, recordPath, "rb");
+    if (err != 0)
+        return S_FALSE;
+
+    if (fread(pRecord, sizeof(*pRecord), 1, pFile) != 1 ||
+        pRecord->Magic != UPLOAD_RECORD_MAGIC ||
+        pRecord->Version != UPLOAD_RECORD_VERSION ||
+        pRecord->ChunkSize != CHUNK_SIZE ||
+        pRecord->NumberOfChunks != GetNumberOfChunks((size_t)pRecord->FileSize))
+    {
+        fclose(pFile);
+        return S_FALSE;
+    }
+
+    uint64_t *pChunkHashes = malloc(((size_t)pRecord->NumberOfChunks + 1) * sizeof(uint64_t));
+    if (pChunkHashes == NULL || fread(pChunkHashes, sizeof(uint64_t), pRecord->NumberOfChunks, pFile) != pRecord->NumberOfChunks)
+    {
+        free(pChunkHashes);
+        fclose(pFile);
+
+        return S_FALSE;
+    }
+
+    fclose(pFile);
+
+    *ppChunkHashes = pChunkHashes;
+
+    return S_OK;
+}
+
+static void WriteUploadRecord(const char *recordPath, const UploadRecord *pRecord, const uint64_t *pChunkHashes)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, recordPath, "wb");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", recordPath);
+        return;
+    }
+
+    fwrite(pRecord, sizeof(*pRecord), 1, pFile);
+    fwrite(pChunkHashes, sizeof(uint64_t), pRecord->NumberOfChunks, pFile);
+
+    fclose(pFile);
+}
+
+static HRESULT GetRemoteFileAttributes(Session *pSession, const char *remotePath, DM_FILE_ATTRIBUTES *pFileAttributes)
+{
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmGetFileAttributes", remotePath);
+    HRESULT hr = DmGetFileAttributes(remotePath, pFileAttributes);
+    RecordRoundTrip(pSession, 0, 0);
+    EndTraceSpan(&span, 0, 0);
+
+    return hr == XBDM_NOERR ? S_OK : hr;
+}
+
+static HRESULT SendWholeFile(Session *pSession, const char *localPath, const char *remotePath, size_t fileSize)
+{
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmSendFile", remotePath);
+    HRESULT hr = DmSendFile(localPath, remotePath);
+    RecordRoundTrip(pSession, fileSize, 0);
+    EndTraceSpan(&span, fileSize, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT SendChunk(Session *pSession, const char *remotePath, const uint8_t *pData, size_t fileSize, uint32_t chunkIndex)
+{
+    uint32_t chunkOffset = chunkIndex * CHUNK_SIZE;
+    uint32_t chunkSize = (uint32_t)GetChunkSize(fileSize, chunkIndex);
+
+    uint32_t bytesWritten = 0;
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmWriteFilePartial", remotePath);
+    HRESULT hr = DmWriteFilePartial(remotePath, chunkOffset, (uint8_t *)pData + chunkOffset, chunkSize, (DWORD *)&bytesWritten);
+    RecordRoundTrip(pSession, chunkSize, 0);
+    EndTraceSpan(&span, chunkSize, 0);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    if (bytesWritten != chunkSize)
+    {
+        LogError("Expected to write %d bytes at offset 0x%X of %s but only wrote %d.", chunkSize, chunkOffset, remotePath, bytesWritten);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT VerifyChunk(Session *pSession, const char *remotePath, size_t fileSize, uint32_t chunkIndex, uint64_t expectedHash, uint8_t *buffer)
+{
+    uint32_t chunkOffset = chunkIndex * CHUNK_SIZE;
+    uint32_t chunkSize = (uint32_t)GetChunkSize(fileSize, chunkIndex);
+
+    uint32_t bytesRead = 0;
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReadFilePartial", remotePath);
+    HRESULT hr = DmReadFilePartial(remotePath, chunkOffset, buffer, chunkSize, (DWORD *)&bytesRead);
+    RecordRoundTrip(pSession, 0, bytesRead);
+    EndTraceSpan(&span, 0, bytesRead);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    if (bytesRead != chunkSize || HashData(buffer, chunkSize) != expectedHash)
+    {
+        LogError("The chunk at offset 0x%X of %s doesn't match the local file after being uploaded.", chunkOffset, remotePath);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT SendChangedChunks(Session *pSession, const char *remotePath, const uint8_t *pData, size_t fileSize, const uint64_t *pChunkHashes, const uint64_t *pRemoteChunkHashes, uint32_t numberOfRemoteChunks, uint32_t *pNumberOfChangedChunks)
+{
+    HRESULT hr = S_OK;
+
+    uint32_t numberOfChunks = GetNumberOfChunks(fileSize);
+
+    *pNumberOfChangedChunks = 0;
+
+    // Only send the chunks that are new or different from the ones on the console
+    for (uint32_t i = 0; i < numberOfChunks; i++)
+    {
+        if (i < numberOfRemoteChunks && pChunkHashes[i] == pRemoteChunkHashes[i])
+            continue;
+
+        hr = SendChunk(pSession, remotePath, pData, fileSize, i);
+        if (FAILED(hr))
+            return E_FAIL;
+
+        (*pNumberOfChangedChunks)++;
+    }
+
+    return S_OK;
+}
+
+static HRESULT VerifyUploadedChunks(Session *pSession, const char *remotePath, size_t fileSize, const uint64_t *pChunkHashes, const uint64_t *pRemoteChunkHashes, uint32_t numberOfRemoteChunks)
+{
+    HRESULT hr = S_OK;
+
+    uint32_t numberOfChunks = GetNumberOfChunks(fileSize);
+
+    // Read the chunks that were sent back to make sure the file on the console is now identical to the local one, the
+    // ones matching pRemoteChunkHashes weren't sent (there are none when the whole file was sent)
+    uint8_t *buffer = malloc(CHUNK_SIZE);
+    if (buffer == NULL)
+    {
+        LogError("Could not allocate memory to verify the upload.");
+        return E_FAIL;
+    }
+
+    for (uint32_t i = 0; i < numberOfChunks; i++)
+    {
+        if (i < numberOfRemoteChunks && pChunkHashes[i] == pRemoteChunkHashes[i])
+            continue;
+
+        hr = VerifyChunk(pSession, remotePath, fileSize, i, pChunkHashes[i], buffer);
+        if (FAILED(hr))
+            break;
+    }
+
+    free(buffer);
+
+    return hr;
+}
+
+HRESULT UploadFile(Session *pSession, const char *localPath, const char *remotePath)
+{
+    HRESULT hr = S_OK;
+
+    uint8_t *pData = NULL;
+    size_t fileSize = 0;
+    hr = ReadLocalFile(localPath, &pData, &fileSize);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    if (fileSize > UINT32_MAX)
+    {
+        LogError("%s is too big to be uploaded.", localPath);
+        free(pData);
+
+        return E_FAIL;
+    }
+
+    // Hash the local file by chunks
+    uint32_t numberOfChunks = GetNumberOfChunks(fileSize);
+    uint64_t *pChunkHashes = malloc(((size_t)numberOfChunks + 1) * sizeof(uint64_t));
+    if (pChunkHashes == NULL)
+    {
+        LogError("Could not allocate memory for the hashes of %s.", localPath);
+        free(pData);
+
+        return E_FAIL;
+    }
+
+    for (uint32_t i = 0; i < numberOfChunks; i++)
+        pChunkHashes[i] = HashData(pData + (size_t)i * CHUNK_SIZE, GetChunkSize(fileSize, i));
+
+    char recordPath[MAX_PATH] = { 0 };
+    hr = GetUploadRecordPath(pSession, remotePath, recordPath, sizeof(recordPath));
+    if (FAILED(hr))
+    {
+        free(pChunkHashes);
+        free(pData);
+
+        return E_FAIL;
+    }
+
+    // The chunks of the file on the console are only known if it's still the file that was last uploaded, which is
+    // the case if its size and last change time are the same as right after the upload. There is no way to truncate
+    // a file on the console so it needs to be sent entirely if it got smaller.
+    UploadRecord record = { 0 };
+    uint64_t *pRemoteChunkHashes = NULL;
+    DM_FILE_ATTRIBUTES remoteFileAttributes = { 0 };
+    BOOL canSendChangedChunksOnly =
+        ReadUploadRecord(recordPath, &record, &pRemoteChunkHashes) == S_OK &&
+        GetRemoteFileAttributes(pSession, remotePath, &remoteFileAttributes) == S_OK &&
+        (((uint64_t)remoteFileAttributes.SizeHigh << 32) | remoteFileAttributes.SizeLow) == record.FileSize &&
+        CompareFileTime(&remoteFileAttributes.ChangeTime, &record.ChangeTime) == 0 &&
+        record.FileSize <= fileSize;
+
+    uint32_t numberOfChangedChunks = numberOfChunks;
+    if (canSendChangedChunksOnly)
+        hr = SendChangedChunks(pSession, remotePath, pData, fileSize, pChunkHashes, pRemoteChunkHashes, record.NumberOfChunks, &numberOfChangedChunks);
+    else
+        hr = SendWholeFile(pSession, localPath, remotePath, fileSize);
+
+    // Every chunk that was sent is read back, all of them when the whole file was sent
+    if (SUCCEEDED(hr))
+    {
+        if (canSendChangedChunksOnly)
+            hr = VerifyUploadedChunks(pSession, remotePath, fileSize, pChunkHashes, pRemoteChunkHashes, record.NumberOfChunks);
+        else
+            hr = VerifyUploadedChunks(pSession, remotePath, fileSize, pChunkHashes, NULL, 0);
+    }
+
+    // Make sure the file on the console has the right size and remember what it's made of for the next upload
+    if (SUCCEEDED(hr))
+    {
+        hr = GetRemoteFileAttributes(pSession, remotePath, &remoteFileAttributes);
+        if (FAILED(hr))
+            LogXbdmError(hr);
+        else if ((((uint64_t)remoteFileAttributes.SizeHigh << 32) | remoteFileAttributes.SizeLow) != fileSize)
+        {
+            LogError("%s doesn't have the same size as %s after being uploaded.", remotePath, localPath);
+            hr = E_FAIL;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        record.Magic = UPLOAD_RECORD_MAGIC;
+        record.Version = UPLOAD_RECORD_VERSION;
+        record.FileSize = fileSize;
+        record.ChangeTime = remoteFileAttributes.ChangeTime;
+        record.ChunkSize = CHUNK_SIZE;
+        record.NumberOfChunks = numberOfChunks;
+        WriteUploadRecord(recordPath, &record, pChunkHashes);
+
+        LogInfo(
+            "Uploaded %s to %s (%d of %d chunks sent).",
+            localPath,
+            remotePath,
+            numberOfChangedChunks,
+            numberOfChunks
+        );
+    }
+    else
+    {
+        // Whatever is on the console now is unknown
+        DeleteFileA(recordPath);
+    }
+
+    free(pRemoteChunkHashes);
+    free(pChunkHashes);
+    free(pData);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
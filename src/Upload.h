@@ -0,0 +1,7 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "Session.h"
+
+HRESULT UploadFile(Session *pSession, const char *localPath, const char *remotePath);
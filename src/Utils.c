@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 // XBDM uses bit field types other than int which triggers a warning at warning level 4
@@ -23,12 +24,95 @@ void ShowUsage(void)
         "\n"
         "    -S:               Show loaded modules and their metadata (verbose).\n"
         "\n"
+        "    -w:               Watch modules being loaded and unloaded, and print them with their metadata\n"
+        "                      as soon as it happens. Press Ctrl+C to stop.\n"
+        "\n"
+        "    -i <local_path>:  Show the metadata of the XEX file at <local_path> on the PC (base address, image size,\n"
+        "                      entry point, checksum, timestamp, imports...). Doesn't need a console.\n"
+        "\n"
         "    <module_path>:    If <module_path> is already loaded, it will be unloaded then\n"
-        "                      loaded back, otherwise it will just be loaded.\n"
+        "                      loaded back, otherwise it will just be loaded. Nothing is done if the loaded\n"
+        "                      module has the same checksum and timestamp as the file.\n"
         "\n"
         "    -l <module_path>: Load the module located at <module_path> (absolute path).\n"
         "\n"
-        "    -u <module_name>: Unload the module named <module_name>. <module_name> can also be an absolute path.";
+        "    -u <module_name>: Unload the module named <module_name>. <module_name> can also be an absolute path.\n"
+        "\n"
+        "    -m <manifest_path>:\n"
+        "                      Reload all the modules listed in the file at <manifest_path> on the PC (one absolute\n"
+        "                      module path per line). The modules are unloaded before the modules they import and\n"
+        "                      loaded after them. Only the modules that changed, and the ones that import them,\n"
+        "                      are reloaded.\n"
+        "\n"
+        "    -p <local_path> <module_path>:\n"
+        "                      Upload the file at <local_path> on the PC to <module_path> (absolute path) then\n"
+        "                      unload and load it back. Only the parts of the file that changed since the last\n"
+        "                      upload are sent.\n"
+        "\n"
+        "    -c <local_path>:  Upload the file at <local_path> on the PC to the staging area of the console\n"
+        "                      (hdd:\\ModuleLoader\\Staging) unless the same build is already there, then load it\n"
+        "                      from there (unloading the module with the same name first if needed).\n"
+        "\n"
+        "    -d <directory_path> <local_path>...:\n"
+        "                      Upload all the files at <local_path>... on the PC to <directory_path> (absolute path)\n"
+        "                      over several connections at once, then unload and load back the uploaded modules\n"
+        "                      (.xex and .dll files) in the order they were given.\n"
+        "\n"
+        "    -r <local_path> <module_path>:\n"
+        "                      Watch the file at <local_path> on the PC and, every time it's rebuilt, upload it\n"
+        "                      to <module_path> (absolute path) then unload and load it back. Press Ctrl+C to stop.\n"
+        "\n"
+        "    -f <module_name> <pattern>:\n"
+        "                      Print the address of every occurrence of <pattern> in the image of the loaded module\n"
+        "                      named <module_name>. <pattern> is made of hexadecimal bytes separated by spaces, ? or\n"
+        "                      ?? matching any byte (e.g. \"7D 88 02 A6 ?? ?? ?? ?? 48\").\n"
+        "\n"
+        "    -x <module_name> <local_path>:\n"
+        "                      Print the ranges of the image of the loaded module named <module_name> that differ\n"
+        "                      from the image in the XEX file at <local_path> on the PC (patches, hooks...).\n"
+        "\n"
+        "    --daemon:         Keep a session with the console open and run the commands of the other ModuleLoader\n"
+        "                      processes, which send them to the daemon instead of connecting to the console\n"
+        "                      themselves (except -w, -r and commands using --console, --consoles or --all).\n"
+        "                      Press Ctrl+C to stop.\n"
+        "\n"
+        "Options:\n"
+        "    --connections <count>:\n"
+        "                      Number of connections to the console -d uploads the files over (4 by default, 16 max).\n"
+        "\n"
+        "    --console <name>: Run the command on the console named <name> (or with the IP address <name>) instead of\n"
+        "                      the default console.\n"
+        "\n"
+        "    --consoles <name>,<name>...:\n"
+        "                      Run the command on all the consoles at once and print the result of each of them.\n"
+        "\n"
+        "    --all:            Run the command on all the consoles listed in %MODULELOADER_CONSOLES% (comma-separated)\n"
+        "                      at once and print the result of each of them.\n"
+        "\n"
+        "    --force:          Reload <module_path> (or all the modules of the manifest) even if the module loaded on\n"
+        "                      the console has the same checksum and timestamp as the file.\n"
+        "\n"
+        "    --address-calls:  Send the RPCs with the address of the function (resolved once and cached on the PC)\n"
+        "                      instead of its module name and ordinal. Experimental, off by default.\n"
+        "\n"
+        "    --processor <0-5|any>:\n"
+        "                      Hardware thread of the console the RPCs (loading, unloading...) run on (5 by default).\n"
+        "                      any spreads them over the hardware threads with the fewest RPCs running.\n"
+        "\n"
+        "    --thread <thread_id>:\n"
+        "                      Run the RPCs on the title thread with the id <thread_id> (hexadecimal) instead of a\n"
+        "                      system thread.\n"
+        "\n"
+        "    --staging-size <megabytes>:\n"
+        "                      Maximum size of the builds kept in the staging area, the least recently used\n"
+        "                      builds are deleted when it's exceeded (512 by default).\n"
+        "\n"
+        "    --stats <file>:   Print how long the command took, the number of round trips to the console and the\n"
+        "                      amount of bytes exchanged, and append them to <file> as a JSON line (to\n"
+        "                      <file>.<console name> with --consoles and --all).\n"
+        "\n"
+        "    --trace <file>:   Write a span for every exchange with the console and every step of the command\n"
+        "                      (with the bytes sent and received) to <file>, in the Chrome trace event format.";
 
     puts(usage);
 }
@@ -101,3 +185,234 @@ void TimestampToDateString(time_t timestamp, char *date, size_t dateSize)
     localtime_s(&dateTime, &timestamp);
     strftime(date, dateSize, "%B %d, %Y (%H:%M:%S)", &dateTime);
 }
+
+HRESULT ReadLocalFile(const char *filePath, uint8_t **ppData, size_t *pSize)
+{
+    FILE *pFile = NULL;
+    errno_t err = fopen_s(&pFile, filePath, "rb");
+    if (err != 0)
+    {
+        LogError("Could not open %s.", filePath);
+        return E_FAIL;
+    }
+
+    // Get the size of the file
+    _fseeki64(pFile, 0, SEEK_END);
+    size_t fileSize = (size_t)_ftelli64(pFile);
+    _fseeki64(pFile, 0, SEEK_SET);
+
+    // Allocate at least 1 byte so that empty files don't look like an allocation failure
+    uint8_t *pData = malloc(fileSize > 0 ? fileSize : 1);
+    if (pData == NULL)
+    {
+        LogError("Could not allocate memory for %s.", filePath);
+        fclose(pFile);
+
+        return E_FAIL;
+    }
+
+    if (fread(pData, 1, fileSize, pFile) != fileSize)
+    {
+        LogError("Could not read %s.", filePath);
+        free(pData);
+        fclose(pFile);
+
+        return E_FAIL;
+    }
+
+    fclose(pFile);
+
+    *ppData = pData;
+    *pSize = fileSize;
+
+    return S_OK;
+}
+
+HRESULT MapLocalFile(const char *filePath, MappedFile *pMappedFile)
+{
+    ZeroMemory(pMappedFile, sizeof(*pMappedFile));
+
+    pMappedFile->File = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pMappedFile->File == INVALID_HANDLE_VALUE)
+    {
+        LogError("Could not open %s.", filePath);
+        return E_FAIL;
+    }
+
+    LARGE_INTEGER fileSize = { 0 };
+    if (!GetFileSizeEx(pMappedFile->File, &fileSize) || fileSize.QuadPart == 0)
+    {
+        LogError("Could not get the size of %s or it's empty.", filePath);
+        CloseHandle(pMappedFile->File);
+
+        return E_FAIL;
+    }
+
+    // Only the pages that are actually read are loaded from the disk, which is what makes reading the header of
+    // a big file fast
+    pMappedFile->Mapping = CreateFileMappingA(pMappedFile->File, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (pMappedFile->Mapping == NULL)
+    {
+        LogError("Could not map %s.", filePath);
+        CloseHandle(pMappedFile->File);
+
+        return E_FAIL;
+    }
+
+    pMappedFile->pData = MapViewOfFile(pMappedFile->Mapping, FILE_MAP_READ, 0, 0, 0);
+    if (pMappedFile->pData == NULL)
+    {
+        LogError("Could not map %s.", filePath);
+        CloseHandle(pMappedFile->Mapping);
+        CloseHandle(pMappedFile->File);
+
+        return E_FAIL;
+    }
+
+    pMappedFile->Size = (size_t)fileSize.QuadPart;
+
+    return S_OK;
+}
+
+void UnmapLocalFile(MappedFile *pMappedFile)
+{
+    if (pMappedFile->pData != NULL)
+        UnmapViewOfFile(pMappedFile->pData);
+
+    if (pMappedFile->Mapping != NULL)
+        CloseHandle(pMappedFile->Mapping);
+
+    if (pMappedFile->File != NULL && pMappedFile->File != INVALID_HANDLE_VALUE)
+        CloseHandle(pMappedFile->File);
+
+    ZeroMemory(pMappedFile, sizeof(*pMappedFile));
+}
+
+HRESULT GetLocalDataPath(const char *directoryName, const char *fileName, char *path, size_t pathSize)
+{
+    // Get the value of %LOCALAPPDATA%
+    char *localAppDataDir = NULL;
+    size_t localAppDataDirSize = 0;
+    errno_t err = _dupenv_s(&localAppDataDir, &localAppDataDirSize, "LOCALAPPDATA");
+    if (err != 0 || localAppDataDir == NULL)
+    {
+        LogError("Could not get the value of the LOCALAPPDATA environment variable.");
+        return E_FAIL;
+    }
+
+    // Create %LOCALAPPDATA%\ModuleLoader and %LOCALAPPDATA%\ModuleLoader\<directoryName> if they don't exist yet
+    _snprintf_s(path, pathSize, _TRUNCATE, "%s\\ModuleLoader", localAppDataDir);
+    CreateDirectoryA(path, NULL);
+    _snprintf_s(path, pathSize, _TRUNCATE, "%s\\ModuleLoader\\%s", localAppDataDir, directoryName);
+    CreateDirectoryA(path, NULL);
+
+    free(localAppDataDir);
+
+    if (GetFileAttributesA(path) == INVALID_FILE_ATTRIBUTES)
+    {
+        LogError("Could not create %s.", path);
+        return E_FAIL;
+    }
+
+    strncat_s(path, pathSize, "\\", _TRUNCATE);
+    strncat_s(path, pathSize, fileName, _TRUNCATE);
+
+    return S_OK;
+}
+
+static BOOL AppendCharacters(char *commandLine, size_t commandLineSize, size_t *pLength, char character, size_t count)
+{
+    // Keep room for the null terminator
+    if (*pLength + count >= commandLineSize)
+        return FALSE;
+
+    memset(commandLine + *pLength, character, count);
+    *pLength += count;
+    commandLine[*pLength] = '\0';
+
+    return TRUE;
+}
+
+HRESULT AppendQuotedArgument(char *commandLine, size_t commandLineSize, const char *argument)
+{
+    size_t originalLength = strlen(commandLine);
+    size_t length = originalLength;
+    BOOL fits = TRUE;
+
+    if (length > 0)
+        fits = AppendCharacters(commandLine, commandLineSize, &length, ' ', 1);
+
+    fits = fits && AppendCharacters(commandLine, commandLineSize, &length, '"', 1);
+
+    // Follow the rules of CommandLineToArgvW, backslashes are only special before a quote, so the ones before an
+    // embedded quote or the closing quote are doubled and embedded quotes are escaped
+    for (const char *pCurrent = argument; fits; pCurrent++)
+    {
+        size_t numberOfBackslashes = 0;
+        while (*pCurrent == '\\')
+        {
+            numberOfBackslashes++;
+            pCurrent++;
+        }
+
+        if (*pCurrent == '\0')
+        {
+            fits = AppendCharacters(commandLine, commandLineSize, &length, '\\', numberOfBackslashes * 2);
+            break;
+        }
+
+        if (*pCurrent == '"')
+            fits = AppendCharacters(commandLine, commandLineSize, &length, '\\', numberOfBackslashes * 2 + 1);
+        else
+            fits = AppendCharacters(commandLine, commandLineSize, &length, '\\', numberOfBackslashes);
+
+        fits = fits && AppendCharacters(commandLine, commandLineSize, &length, *pCurrent, 1);
+    }
+
+    fits = fits && AppendCharacters(commandLine, commandLineSize, &length, '"', 1);
+
+    // Don't leave half an argument behind
+    if (!fits)
+    {
+        commandLine[originalLength] = '\0';
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+// The console control handler doesn't take a context parameter so the event needs to be global
+static HANDLE s_StopEvent = NULL;
+
+static BOOL WINAPI OnConsoleControl(DWORD controlType)
+{
+    // Signal the stop event on Ctrl+C, Ctrl+Break or when the console is closed
+    if (controlType == CTRL_C_EVENT || controlType == CTRL_BREAK_EVENT || controlType == CTRL_CLOSE_EVENT)
+    {
+        SetEvent(s_StopEvent);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+HANDLE CreateStopEvent(void)
+{
+    s_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (s_StopEvent == NULL)
+    {
+        LogError("Could not create the event to stop.");
+        return NULL;
+    }
+
+    SetConsoleCtrlHandler(OnConsoleControl, TRUE);
+
+    return s_StopEvent;
+}
+
+void CloseStopEvent(HANDLE stopEvent)
+{
+    SetConsoleCtrlHandler(OnConsoleControl, FALSE);
+    CloseHandle(stopEvent);
+    s_StopEvent = NULL;
+}
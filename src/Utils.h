@@ -1,7 +1,16 @@
 #pragma once
 
+#include <stdint.h>
 #include <Windows.h>
 
+typedef struct _MappedFile
+{
+    HANDLE File;
+    HANDLE Mapping;
+    const uint8_t *pData;
+    size_t Size;
+} MappedFile;
+
 void ShowUsage(void);
 
 HRESULT AddXdkBinDirToPath(void);
@@ -9,3 +18,19 @@ HRESULT AddXdkBinDirToPath(void);
 void LogXbdmError(HRESULT hr);
 
 void TimestampToDateString(time_t timestamp, char *date, size_t dateSize);
+
+HRESULT ReadLocalFile(const char *filePath, uint8_t **ppData, size_t *pSize);
+
+HRESULT MapLocalFile(const char *filePath, MappedFile *pMappedFile);
+
+void UnmapLocalFile(MappedFile *pMappedFile);
+
+HRESULT GetLocalDataPath(const char *directoryName, const char *fileName, char *path, size_t pathSize);
+
+// Appends argument to commandLine (separated by a space if commandLine isn't empty) quoted so that the child process
+// gets it back unchanged, fails if it doesn't fit
+HRESULT AppendQuotedArgument(char *commandLine, size_t commandLineSize, const char *argument);
+
+HANDLE CreateStopEvent(void);
+
+void CloseStopEvent(HANDLE stopEvent);
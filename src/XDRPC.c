@@ -4,101 +4,197 @@
 #include <stdlib.h>
 #include <string.h>
 
-// XBDM uses bit field types other than int which triggers a warning at warning level 4
-// so we just disable it for XBDM
-#pragma warning(push)
-#pragma warning(disable : 4214)
-#include <xbdm.h>
-#pragma warning(pop)
-
 #include "Log.h"
+#include "MemoryIO.h"
+#include "Trace.h"
 #include "Utils.h"
 
 #define RESPONSE_SIZE 512
 
-static size_t SizeOfString(const char *string)
-{
-    // Get the amount of characters in the string
-    size_t size = strnlen_s(string, MAX_PATH);
+// The buffer needs to start with 0x40 bytes of header, I don't know what all of them are for...
+#define HEADER_SIZE 0x40
 
+static size_t AlignSize(size_t size)
+{
     // Round up the size to the closest multiple of 8
-    while (size % sizeof(uint64_t) != 0)
-        size++;
+    return (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
 
-    return size;
+static void WriteUInt64(byte *pLocation, uint64_t data)
+{
+    // The bytes of data need to be swapped because they are in little-endian on the PC but need to
+    // be sent in big-endian to the console.
+    *(uint64_t *)pLocation = _byteswap_uint64(data);
 }
 
-static void WriteString(void **ppBuffer, const char *string)
+static uint64_t ReadUInt64(const byte *pLocation)
 {
-    size_t numberOfCharacters = strnlen_s(string, MAX_PATH);
-    size_t sizeOfStringInBuffer = SizeOfString(string);
+    // The bytes need to be swapped because they are in big-endian and the PC's CPU has (most likely)
+    // a little-endian architecture.
+    return _byteswap_uint64(*(const uint64_t *)pLocation);
+}
 
-    memcpy(*ppBuffer, string, numberOfCharacters);
+static HRESULT AppendData(byte *buffer, size_t *pBufferSize, const void *pData, size_t dataSize)
+{
+    size_t alignedSize = AlignSize(dataSize);
+    if (alignedSize > XDRPC_MAX_BUFFER_SIZE - *pBufferSize)
+    {
+        LogError("The arguments don't fit in the 0x%X bytes of the RPC buffer.", XDRPC_MAX_BUFFER_SIZE);
+        return E_FAIL;
+    }
 
-    *ppBuffer = (byte *)*ppBuffer + sizeOfStringInBuffer;
+    // pData is NULL when only space needs to be reserved (e.g. for an output buffer), the padding
+    // needs to be zeroed in both cases because the buffer is not cleared beforehand
+    if (pData != NULL)
+        memcpy(buffer + *pBufferSize, pData, dataSize);
+    else
+        ZeroMemory(buffer + *pBufferSize, dataSize);
+    ZeroMemory(buffer + *pBufferSize + dataSize, alignedSize - dataSize);
+
+    *pBufferSize += alignedSize;
+
+    return S_OK;
 }
 
-static void WriteUInt64(void **ppBuffer, uint64_t data)
+static HRESULT AppendString(byte *buffer, size_t *pBufferSize, const char *string)
 {
-    // The bytes of data need to be swapped because they are in little-endian on the PC but need to
-    // be sent in big-endian to the console.
-    *(uint64_t *)*ppBuffer = _byteswap_uint64(data);
+    // The null terminator needs to be sent too
+    size_t remainingSize = XDRPC_MAX_BUFFER_SIZE - *pBufferSize;
+    size_t stringSize = strnlen_s(string, remainingSize) + 1;
+    if (stringSize > remainingSize)
+    {
+        LogError("The arguments don't fit in the 0x%X bytes of the RPC buffer.", XDRPC_MAX_BUFFER_SIZE);
+        return E_FAIL;
+    }
 
-    *ppBuffer = (uint64_t *)*ppBuffer + 1;
+    return AppendData(buffer, pBufferSize, string, stringSize);
 }
 
-HRESULT XdrpcCall(const char *moduleName, uint32_t ordinal, XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue)
+static HRESULT EncodeBuffer(byte *buffer, size_t *pBufferSize, const char *moduleName, uint32_t ordinal, uint32_t functionAddress, const XdrpcArgInfo *args, size_t numberOfArgs)
 {
     HRESULT hr = S_OK;
 
-    // Check if any string arguments are passed
-    BOOL hasStringArgs = FALSE;
+    // Each argument takes 8 bytes right after the header, then comes the module name (unless the function
+    // is called by address) and the data of the string and buffer arguments
+    if (numberOfArgs > (XDRPC_MAX_BUFFER_SIZE - HEADER_SIZE) / sizeof(uint64_t))
+    {
+        LogError("Too many arguments passed to the RPC.");
+        return E_FAIL;
+    }
+
+    size_t moduleNameOffset = HEADER_SIZE + numberOfArgs * sizeof(uint64_t);
+    *pBufferSize = moduleNameOffset;
+
+    // The header needs to have 32 zeros at first
+    ZeroMemory(buffer, HEADER_SIZE);
+
+    // Write the number of arguments passed
+    WriteUInt64(buffer + 0x20, numberOfArgs);
+
+    if (moduleName == NULL)
+    {
+        // Without a module name the console calls the function at the address that follows the number of arguments
+        WriteUInt64(buffer + 0x28, functionAddress);
+    }
+    else
+    {
+        // Write the offset of the module name, it becomes an address once the buffer address is known
+        WriteUInt64(buffer + 0x30, moduleNameOffset);
+
+        // Write the ordinal
+        WriteUInt64(buffer + 0x38, ordinal);
+
+        // Copy the module name
+        hr = AppendString(buffer, pBufferSize, moduleName);
+        if (FAILED(hr))
+            return hr;
+    }
+
+    // Write the arguments in a single pass, integers are written directly in their slot while strings and buffers
+    // are appended after the module name and the offset to their data is written in their slot
     for (size_t i = 0; i < numberOfArgs; i++)
     {
-        if (args[i].Type == XdrpcArgType_String)
+        byte *pSlot = buffer + HEADER_SIZE + i * sizeof(uint64_t);
+
+        if (args[i].Type == XdrpcArgType_Integer)
         {
-            hasStringArgs = TRUE;
-            break;
+            WriteUInt64(pSlot, *(const uint64_t *)args[i].pData);
+            continue;
         }
+
+        WriteUInt64(pSlot, *pBufferSize);
+
+        if (args[i].Type == XdrpcArgType_String)
+            hr = AppendString(buffer, pBufferSize, args[i].pData);
+        else if (args[i].Type == XdrpcArgType_Buffer)
+            hr = AppendData(buffer, pBufferSize, args[i].pData, args[i].Size);
+
+        if (FAILED(hr))
+            return hr;
     }
 
-    // The buffer size needs to be 0x40, I don't know why...
-    size_t bufferSize = 0x40;
+    return S_OK;
+}
 
-    // It seems like a second buffer address needs to be in the buffer only when string arguments are passed,
-    // I'm not really sure about this assumption...
-    if (hasStringArgs == TRUE)
-        bufferSize += sizeof(uint64_t);
+static void RelocateBuffer(byte *buffer, uint64_t bufferAddress, const XdrpcArgInfo *args, size_t numberOfArgs)
+{
+    // Turn the offsets written by EncodeBuffer into addresses on the console, there is no module name to point to
+    // when the function is called by address
+    if (ReadUInt64(buffer + 0x30) != 0)
+        WriteUInt64(buffer + 0x30, bufferAddress + ReadUInt64(buffer + 0x30));
 
-    // Increase the size of the buffer to allow all arguments to fit
     for (size_t i = 0; i < numberOfArgs; i++)
-        if (args[i].Type == XdrpcArgType_String)
-            bufferSize += SizeOfString(args[i].pData);
-        else if (args[i].Type == XdrpcArgType_Integer)
-            bufferSize += sizeof(uint64_t);
+    {
+        if (args[i].Type == XdrpcArgType_Integer)
+            continue;
 
-    // Increase the size of the buffer to fit the module name
-    size_t moduleNameSize = SizeOfString(moduleName);
-    bufferSize += moduleNameSize;
+        byte *pSlot = buffer + HEADER_SIZE + i * sizeof(uint64_t);
+        WriteUInt64(pSlot, bufferAddress + ReadUInt64(pSlot));
+    }
+}
 
-    // Create the command from the format and the buffer size
-    char command[60] = { 0 };
-    const char commandFormat[] = "rpc system version=4 buf_size=%d processor=5 thread=";
-    _snprintf_s(command, sizeof(command), _TRUNCATE, commandFormat, bufferSize);
+static void CopyOutputBuffers(const byte *buffer, const char *moduleName, const XdrpcArgInfo *args, size_t numberOfArgs)
+{
+    // The data of each argument is at the same place as when the buffer was encoded, only the
+    // sizes are needed to find it again
+    size_t offset = HEADER_SIZE + numberOfArgs * sizeof(uint64_t);
+    if (moduleName != NULL)
+        offset += AlignSize(strlen(moduleName) + 1);
 
-    // Open the XBDM connection
-    PDM_CONNECTION connection = NULL;
-    hr = DmOpenConnection(&connection);
-    if (FAILED(hr))
+    for (size_t i = 0; i < numberOfArgs; i++)
     {
-        LogXbdmError(hr);
-        return E_FAIL;
+        if (args[i].Type == XdrpcArgType_String)
+            offset += AlignSize(strlen(args[i].pData) + 1);
+        else if (args[i].Type == XdrpcArgType_Buffer)
+        {
+            if (args[i].pOutData != NULL)
+                memcpy(args[i].pOutData, buffer + offset, args[i].Size);
+
+            offset += AlignSize(args[i].Size);
+        }
     }
+}
+
+static HRESULT SendRpc(PDM_CONNECTION connection, DWORD consoleType, DWORD processor, DWORD threadId, byte *buffer, size_t bufferSize, const char *moduleName, const XdrpcArgInfo *args, size_t numberOfArgs, Stats *pStats, uint64_t *pReturnValue)
+{
+    HRESULT hr = S_OK;
+
+    // Create the command from the format, the buffer size and where the RPC needs to run. System RPCs run on a
+    // thread XBDM creates on the processor, title RPCs are queued to an existing thread of the title
+    char command[100] = { 0 };
+    if (threadId == 0)
+        _snprintf_s(command, sizeof(command), _TRUNCATE, "rpc system version=4 buf_size=%zu processor=%lu thread=", bufferSize, processor);
+    else
+        _snprintf_s(command, sizeof(command), _TRUNCATE, "rpc title version=4 buf_size=%zu processor=%lu thread=0x%08lx", bufferSize, processor, threadId);
 
     // Send the command
     char response[RESPONSE_SIZE] = { 0 };
     size_t responseSize = RESPONSE_SIZE;
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_XBDM, "DmSendCommand", command);
     hr = DmSendCommand(connection, command, response, (DWORD *)&responseSize);
+    AddRoundTrip(pStats, strnlen_s(command, sizeof(command)), strnlen_s(response, RESPONSE_SIZE));
+    EndTraceSpan(&span, strnlen_s(command, sizeof(command)), strnlen_s(response, RESPONSE_SIZE));
     if (FAILED(hr))
     {
         LogXbdmError(hr);
@@ -117,152 +213,729 @@ HRESULT XdrpcCall(const char *moduleName, uint32_t ordinal, XdrpcArgInfo *args,
     ZeroMemory(response, RESPONSE_SIZE);
     responseSize = RESPONSE_SIZE;
 
-    // Allocate enough memory to hold the main RPC buffer
-    byte *buffer = malloc(bufferSize);
-    if (buffer == NULL)
+    // Now that the buffer address is known, the offsets in the buffer can be turned into addresses
+    RelocateBuffer(buffer, bufferAddress, args, numberOfArgs);
+
+    // Send the buffer
+    BeginTraceSpan(&span, TRACE_XBDM, "DmSendBinary", "RPC buffer");
+    hr = DmSendBinary(connection, buffer, (uint32_t)bufferSize);
+    EndTraceSpan(&span, bufferSize, 0);
+    if (FAILED(hr))
     {
-        LogError("Failed to allocate memory for the main RPC buffer.");
+        LogXbdmError(hr);
         return E_FAIL;
     }
 
-    ZeroMemory(buffer, bufferSize);
-    byte *pBuffer = buffer;
+    // Receive the response status, which comes once the function returned on the console
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReceiveStatusResponse", NULL);
+    hr = DmReceiveStatusResponse(connection, response, (DWORD *)&responseSize);
+    AddRoundTrip(pStats, bufferSize, strnlen_s(response, RESPONSE_SIZE));
+    EndTraceSpan(&span, 0, strnlen_s(response, RESPONSE_SIZE));
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
 
-    // Let at least 0x40 bytes between firstBufferAddress and the buffer address returned when the thread was created,
-    // I don't know why...
-    uint64_t firstBufferAddress = bufferAddress + 0x40;
+    // Check if an error code was returned
+    if (response[0] != '2')
+    {
+        LogError("Unexpected response received: %s", response);
+        return E_FAIL;
+    }
 
-    // For each argument, we need to shift firstBufferAddress by 8 bytes
-    for (size_t i = 0; i < numberOfArgs; i++)
-        firstBufferAddress += sizeof(uint64_t);
+    // The console sends the buffer back whether a return value is expected or not, it always needs to be received
+    // otherwise it would be mistaken for the response of the next command sent in the session
 
-    // The buffer needs to have 32 zeros at first, so we just move the pointer 32 bytes forwards because the entire buffer
-    // is already filled with zeros
-    pBuffer += sizeof(uint64_t) * 4;
+    // It looks like reviewer kits (which is what an RGH is seen as) send 16 bytes of
+    // unknown data instead of 8
+    size_t unknownPacketSize =
+        consoleType == DMCT_REVIEWER_KIT
+            ? sizeof(uint64_t) * 2
+            : sizeof(uint64_t);
 
-    // Write the number of arguments passed on the next 8 bytes
-    WriteUInt64(&pBuffer, numberOfArgs);
+    // An unknown packet is sent before the actual response buffer, I don't know what information
+    // it's supposed to hold...
+    BeginTraceSpan(&span, TRACE_XBDM, "DmReceiveBinary", "RPC buffer");
+    hr = DmReceiveBinary(connection, buffer, (uint32_t)unknownPacketSize, NULL);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
 
-    // Leave 8 zeros
-    pBuffer += sizeof(uint64_t);
+    // Receive the actual response buffer (which is the buffer that was sent but with the return value in the second uint64_t
+    // and the output buffers filled)
+    hr = DmReceiveBinary(connection, buffer, (uint32_t)bufferSize, NULL);
+    if (FAILED(hr))
+    {
+        LogXbdmError(hr);
+        return E_FAIL;
+    }
+
+    // Both packets are part of the response to the buffer that was sent so they don't count as a new round trip
+    pStats->BytesReceived += unknownPacketSize + bufferSize;
+    EndTraceSpan(&span, 0, unknownPacketSize + bufferSize);
+
+    // The return value is the second uint64_t in the buffer
+    if (pReturnValue != NULL)
+        *pReturnValue = ReadUInt64(buffer + sizeof(uint64_t));
+
+    CopyOutputBuffers(buffer, moduleName, args, numberOfArgs);
+
+    return S_OK;
+}
+
+// Calls the function exported by moduleName with ordinal or, if moduleName is NULL, the function at functionAddress
+static HRESULT CallFunction(Session *pSession, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, uint32_t functionAddress, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue)
+{
+    HRESULT hr = S_OK;
+
+    // The buffer is encoded on the stack so no allocation is needed
+    byte buffer[XDRPC_MAX_BUFFER_SIZE];
+    size_t bufferSize = 0;
+    hr = EncodeBuffer(buffer, &bufferSize, moduleName, ordinal, functionAddress, args, numberOfArgs);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    PDM_CONNECTION connection = NULL;
+    hr = GetSessionConnection(pSession, &connection);
+    if (FAILED(hr))
+        return E_FAIL;
 
-    // Write firstBufferAddress on the next 8 bytes
-    WriteUInt64(&pBuffer, firstBufferAddress);
+    const RpcTarget *pActualTarget = pTarget != NULL ? pTarget : &pSession->DefaultRpcTarget;
+    DWORD processor = AcquireRpcProcessor(pSession, pActualTarget);
+    hr = SendRpc(connection, pSession->ConsoleType, processor, pActualTarget->ThreadId, buffer, bufferSize, moduleName, args, numberOfArgs, &pSession->Stats, pReturnValue);
+    ReleaseRpcProcessor(pSession, processor);
 
-    // Write the ordinal on the next 8 bytes
-    WriteUInt64(&pBuffer, ordinal);
+    // A failed RPC could leave data to receive on the connection, which the next RPC would read as its response
+    if (FAILED(hr))
+        ResetSessionConnection(pSession);
+
+    return hr;
+}
+
+static HRESULT LookUpExport(Session *pSession, const char *moduleName, uint32_t ordinal, uint32_t *pAddress)
+{
+    HRESULT hr = S_OK;
 
-    // Calculate and write the second buffer address in the buffer only if needed
-    if (hasStringArgs == TRUE)
+    // Both functions return an NTSTATUS and write what they found to a pointer, which is a 4-byte output buffer
+    uint32_t moduleHandle = 0;
+    uint64_t status = 0;
+    XdrpcArgInfo handleArgs[2] = { { 0 }, { 0 } };
+    handleArgs[0].pData = moduleName;
+    handleArgs[0].Type = XdrpcArgType_String;
+    handleArgs[1].Type = XdrpcArgType_Buffer;
+    handleArgs[1].Size = sizeof(moduleHandle);
+    handleArgs[1].pOutData = &moduleHandle;
+
+    // XexGetModuleHandle
+    hr = CallFunction(pSession, NULL, "xboxkrnl.exe", 405, 0, handleArgs, 2, &status);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    if (FAILED(status))
     {
-        uint64_t secondBufferAddress = firstBufferAddress + moduleNameSize;
-        WriteUInt64(&pBuffer, secondBufferAddress);
+        LogError("Could not get the handle of %s, error %X.", moduleName, status);
+        return E_FAIL;
     }
 
-    // Append the integer arguments to the buffer
-    for (size_t i = 0; i < numberOfArgs; i++)
-        if (args[i].Type == XdrpcArgType_Integer)
-            WriteUInt64(&pBuffer, *(uint64_t *)(args[i].pData));
+    uint64_t handle = _byteswap_ulong(moduleHandle);
+    uint64_t ordinalValue = ordinal;
+    uint32_t address = 0;
+    XdrpcArgInfo addressArgs[3] = { { 0 }, { 0 }, { 0 } };
+    addressArgs[0].pData = &handle;
+    addressArgs[0].Type = XdrpcArgType_Integer;
+    addressArgs[1].pData = &ordinalValue;
+    addressArgs[1].Type = XdrpcArgType_Integer;
+    addressArgs[2].Type = XdrpcArgType_Buffer;
+    addressArgs[2].Size = sizeof(address);
+    addressArgs[2].pOutData = &address;
+
+    // XexGetProcedureAddress
+    hr = CallFunction(pSession, NULL, "xboxkrnl.exe", 407, 0, addressArgs, 3, &status);
+    if (FAILED(hr))
+        return E_FAIL;
 
-    // Copy the module name
-    memcpy(pBuffer, moduleName, strnlen_s(moduleName, MAX_PATH));
-    pBuffer += moduleNameSize;
+    if (FAILED(status))
+    {
+        LogError("Could not get the address of the function %d of %s, error %X.", ordinal, moduleName, status);
+        return E_FAIL;
+    }
 
-    // Append the string arguments to the buffer
-    for (size_t i = 0; i < numberOfArgs; i++)
-        if (args[i].Type == XdrpcArgType_String)
-            WriteString(&pBuffer, args[i].pData);
+    *pAddress = _byteswap_ulong(address);
 
-    // Send the buffer
-    hr = DmSendBinary(connection, buffer, (uint32_t)bufferSize);
+    return S_OK;
+}
+
+static HRESULT GetExportAddress(Session *pSession, const char *moduleName, uint32_t ordinal, uint32_t *pAddress)
+{
+    HRESULT hr = S_OK;
+
+    if (strlen(moduleName) >= EXPORT_CACHE_MODULE_NAME_SIZE)
+        return S_FALSE;
+
+    // The address is only valid for the build of the module that's currently loaded. The loaded modules are only
+    // walked the first time and after a notification about the module, not every time the module table is
+    // invalidated by loading or unloading another module.
+    VerifiedModule module = { 0 };
+    if (!FindVerifiedModule(&pSession->Exports, moduleName, &module))
+    {
+        const ModuleTable *pLoadedModules = NULL;
+        hr = GetLoadedModules(pSession, &pLoadedModules);
+        if (FAILED(hr))
+            return E_FAIL;
+
+        const DMN_MODLOAD *pModule = FindLoadedModule(pLoadedModules, moduleName);
+        if (pModule == NULL)
+            return S_FALSE;
+
+        strncpy_s(module.Name, sizeof(module.Name), moduleName, _TRUNCATE);
+        module.CheckSum = pModule->CheckSum;
+        module.TimeStamp = pModule->TimeStamp;
+        module.BaseAddress = (uint32_t)(uintptr_t)pModule->BaseAddress;
+        AddVerifiedModule(&pSession->Exports, &module);
+    }
+
+    ExportCacheEntry entry = { 0 };
+    strncpy_s(entry.ModuleName, sizeof(entry.ModuleName), moduleName, _TRUNCATE);
+    entry.Ordinal = ordinal;
+    entry.CheckSum = module.CheckSum;
+    entry.TimeStamp = module.TimeStamp;
+    entry.BaseAddress = module.BaseAddress;
+
+    const ExportCacheEntry *pCachedEntry = FindCachedExport(&pSession->Exports, &entry);
+    if (pCachedEntry != NULL)
+    {
+        *pAddress = pCachedEntry->Address;
+        return S_OK;
+    }
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "LookUpExport", moduleName);
+    hr = LookUpExport(pSession, moduleName, ordinal, &entry.Address);
+    EndTraceSpan(&span, 0, 0);
+    if (FAILED(hr) || entry.Address == 0)
+        return S_FALSE;
+
+    hr = AddCachedExport(&pSession->Exports, &entry);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    *pAddress = entry.Address;
+
+    return S_OK;
+}
+
+static HRESULT GetRpcModuleBuilds(Session *pSession, ModuleBuild *builds)
+{
+    static const char *rpcModuleNames[NUMBER_OF_RPC_MODULES] = { "xboxkrnl.exe", "xbdm.xex", "XDRPC.xex" };
+
+    const ModuleTable *pLoadedModules = NULL;
+    HRESULT hr = GetLoadedModules(pSession, &pLoadedModules);
     if (FAILED(hr))
+        return E_FAIL;
+
+    for (size_t i = 0; i < NUMBER_OF_RPC_MODULES; i++)
     {
-        LogXbdmError(hr);
-        free(buffer);
+        const DMN_MODLOAD *pModule = FindLoadedModule(pLoadedModules, rpcModuleNames[i]);
+        builds[i].CheckSum = pModule != NULL ? pModule->CheckSum : 0;
+        builds[i].TimeStamp = pModule != NULL ? pModule->TimeStamp : 0;
+    }
+
+    return S_OK;
+}
+
+static void ProbeAddressCalls(Session *pSession)
+{
+    HRESULT hr = S_OK;
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "ProbeAddressCalls", pSession->ConsoleName);
+
+    // XGetModuleHandleA("xam.xex") is called with the module name and ordinal then with the address, calling by
+    // address is only used if both calls give the same handle
+    uint32_t address = 0;
+    uint64_t expectedHandle = 0;
+    XdrpcArgInfo args[1] = { { 0 } };
+    args[0].pData = "xam.xex";
+    args[0].Type = XdrpcArgType_String;
+
+    hr = GetExportAddress(pSession, "xam.xex", 1102, &address);
+    if (hr == S_OK)
+        hr = CallFunction(pSession, NULL, "xam.xex", 1102, 0, args, 1, &expectedHandle);
+
+    if (hr != S_OK || expectedHandle == 0)
+    {
+        // Nothing was learned about the console, so the result isn't saved, but the probe isn't sent again
+        // before every RPC of the session either
+        pSession->Exports.AddressCalls = AddressCallSupport_Unsupported;
+    }
+    else
+    {
+        uint64_t handle = 0;
+        hr = CallFunction(pSession, NULL, NULL, 0, address, args, 1, &handle);
 
+        pSession->Exports.AddressCalls = SUCCEEDED(hr) && handle == expectedHandle ? AddressCallSupport_Supported : AddressCallSupport_Unsupported;
+        pSession->Exports.IsDirty = TRUE;
+
+        // The module table was just walked by GetExportAddress so this doesn't cost a round trip
+        if (FAILED(GetRpcModuleBuilds(pSession, pSession->Exports.AddressCallsBuilds)))
+            ZeroMemory(pSession->Exports.AddressCallsBuilds, sizeof(pSession->Exports.AddressCallsBuilds));
+
+        if (pSession->Exports.AddressCalls == AddressCallSupport_Unsupported)
+            LogInfo("%s doesn't run RPCs sent with a function address, the module name and ordinal will keep being sent.", pSession->ConsoleName);
+    }
+
+    EndTraceSpan(&span, 0, 0);
+}
+
+// Returns S_OK with the address of the function if it can be called by address, S_FALSE if the module name and
+// ordinal need to be sent instead. Can only be called from the thread that owns the session.
+static HRESULT ResolveExport(Session *pSession, const char *moduleName, uint32_t ordinal, uint32_t *pAddress)
+{
+    if (!pSession->UseAddressCalls)
+        return S_FALSE;
+
+    if (!pSession->Exports.IsLoaded)
+        LoadExportCache(&pSession->Exports, pSession->ConsoleName);
+
+    // The saved result only holds for the builds it was found with, an update of the kernel or of the module running
+    // the RPCs can change how the buffer is read
+    if (pSession->Exports.AddressCalls != AddressCallSupport_Unknown && !pSession->Exports.AreAddressCallsBuildsChecked)
+    {
+        ModuleBuild builds[NUMBER_OF_RPC_MODULES] = { 0 };
+        if (FAILED(GetRpcModuleBuilds(pSession, builds)) || memcmp(builds, pSession->Exports.AddressCallsBuilds, sizeof(builds)) != 0)
+            pSession->Exports.AddressCalls = AddressCallSupport_Unknown;
+
+        pSession->Exports.AreAddressCallsBuildsChecked = TRUE;
+    }
+
+    if (pSession->Exports.AddressCalls == AddressCallSupport_Unknown)
+        ProbeAddressCalls(pSession);
+
+    if (pSession->Exports.AddressCalls != AddressCallSupport_Supported)
+        return S_FALSE;
+
+    return GetExportAddress(pSession, moduleName, ordinal, pAddress);
+}
+
+HRESULT XdrpcCall(Session *pSession, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue)
+{
+    return XdrpcCallOn(pSession, NULL, moduleName, ordinal, args, numberOfArgs, pReturnValue);
+}
+
+HRESULT XdrpcCallOn(Session *pSession, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue)
+{
+    HRESULT hr = S_OK;
+
+    // Only format the detail when it's going to be recorded
+    char detail[TRACE_DETAIL_SIZE] = { 0 };
+    if (IsTracing())
+        _snprintf_s(detail, sizeof(detail), _TRUNCATE, "%s@%d", moduleName, ordinal);
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "XdrpcCall", detail);
+
+    // Calling by address saves the console from looking up the function and makes the buffer smaller
+    uint32_t functionAddress = 0;
+    if (ResolveExport(pSession, moduleName, ordinal, &functionAddress) == S_OK)
+        hr = CallFunction(pSession, pTarget, NULL, 0, functionAddress, args, numberOfArgs, pReturnValue);
+    else
+        hr = CallFunction(pSession, pTarget, moduleName, ordinal, 0, args, numberOfArgs, pReturnValue);
+
+    EndTraceSpan(&span, 0, 0);
+
+    return hr;
+}
+
+struct _XdrpcAsyncCall
+{
+    Session *pSession;
+    RpcTarget Target;
+
+    // Everything needed to send the RPC from another thread, the strings of the arguments are copied because
+    // CopyOutputBuffers needs their size once the call is done
+    byte Buffer[XDRPC_MAX_BUFFER_SIZE];
+    size_t BufferSize;
+    char ModuleName[MAX_PATH];
+    BOOL IsCalledByAddress;
+    XdrpcArgInfo *pArgs;
+    size_t NumberOfArgs;
+    char *pStrings;
+
+    XdrpcCompletionCallback pCallback;
+    void *pContext;
+
+    // Signaled when the RPC is done
+    HANDLE Thread;
+
+    HRESULT Result;
+    uint64_t ReturnValue;
+
+    // Only added to the stats of the session in XdrpcCloseCall so that the worker thread never touches them
+    Stats Stats;
+};
+
+static DWORD WINAPI RunAsyncCall(void *pParameter)
+{
+    XdrpcAsyncCall *pCall = pParameter;
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "XdrpcCallAsync", pCall->ModuleName);
+
+    // Every RPC in flight needs its own connection since XBDM handles one command at a time per connection
+    PDM_CONNECTION connection = NULL;
+    HRESULT hr = AcquireRpcConnection(pCall->pSession, &connection, &pCall->Stats);
+    if (SUCCEEDED(hr))
+    {
+        // The processor is only picked once the RPC is about to be sent so that the RPCs waiting for a connection
+        // don't count as running
+        DWORD processor = AcquireRpcProcessor(pCall->pSession, &pCall->Target);
+        hr = SendRpc(
+            connection,
+            pCall->pSession->ConsoleType,
+            processor,
+            pCall->Target.ThreadId,
+            pCall->Buffer,
+            pCall->BufferSize,
+            pCall->IsCalledByAddress ? NULL : pCall->ModuleName,
+            pCall->pArgs,
+            pCall->NumberOfArgs,
+            &pCall->Stats,
+            &pCall->ReturnValue
+        );
+        ReleaseRpcProcessor(pCall->pSession, processor);
+
+        // A failed RPC could leave data to receive on the connection
+        ReleaseRpcConnection(pCall->pSession, connection, FAILED(hr));
+    }
+
+    EndTraceSpan(&span, 0, 0);
+
+    pCall->Result = SUCCEEDED(hr) ? S_OK : E_FAIL;
+
+    if (pCall->pCallback != NULL)
+        pCall->pCallback(pCall, pCall->Result, pCall->ReturnValue, pCall->pContext);
+
+    return 0;
+}
+
+static HRESULT CopyArgs(XdrpcAsyncCall *pCall, const XdrpcArgInfo *args, size_t numberOfArgs)
+{
+    if (numberOfArgs == 0)
+        return S_OK;
+
+    pCall->pArgs = malloc(numberOfArgs * sizeof(XdrpcArgInfo));
+    pCall->pStrings = malloc(XDRPC_MAX_BUFFER_SIZE);
+    if (pCall->pArgs == NULL || pCall->pStrings == NULL)
+    {
+        LogError("Could not allocate memory for the arguments of the RPC.");
         return E_FAIL;
     }
 
-    // Receive the response status
-    hr = DmReceiveStatusResponse(connection, response, (DWORD *)&responseSize);
-    if (FAILED(hr))
+    memcpy(pCall->pArgs, args, numberOfArgs * sizeof(XdrpcArgInfo));
+    pCall->NumberOfArgs = numberOfArgs;
+
+    // The strings already fit in the RPC buffer so they fit in a buffer of the same size, the other input data
+    // is already encoded in the RPC buffer and not needed anymore
+    size_t stringsSize = 0;
+    for (size_t i = 0; i < numberOfArgs; i++)
     {
-        LogXbdmError(hr);
-        free(buffer);
+        if (args[i].Type != XdrpcArgType_String)
+        {
+            pCall->pArgs[i].pData = NULL;
+            continue;
+        }
+
+        size_t stringSize = strlen(args[i].pData) + 1;
+        memcpy(pCall->pStrings + stringsSize, args[i].pData, stringSize);
+        pCall->pArgs[i].pData = pCall->pStrings + stringsSize;
+        stringsSize += stringSize;
+    }
+
+    return S_OK;
+}
+
+static void FreeAsyncCall(XdrpcAsyncCall *pCall)
+{
+    if (pCall->Thread != NULL)
+        CloseHandle(pCall->Thread);
+
+    free(pCall->pStrings);
+    free(pCall->pArgs);
+    free(pCall);
+}
 
+HRESULT XdrpcCallAsync(Session *pSession, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, XdrpcCompletionCallback pCallback, void *pContext, XdrpcAsyncCall **ppCall)
+{
+    HRESULT hr = S_OK;
+
+    XdrpcAsyncCall *pCall = calloc(1, sizeof(XdrpcAsyncCall));
+    if (pCall == NULL)
+    {
+        LogError("Could not allocate memory for the RPC.");
         return E_FAIL;
     }
 
-    // Check if an error code was returned
-    if (response[0] != '2')
+    pCall->pSession = pSession;
+    pCall->Target = pTarget != NULL ? *pTarget : pSession->DefaultRpcTarget;
+    pCall->pCallback = pCallback;
+    pCall->pContext = pContext;
+    strncpy_s(pCall->ModuleName, sizeof(pCall->ModuleName), moduleName, _TRUNCATE);
+
+    // The function is resolved on the calling thread since the export cache and the loaded modules belong to it
+    uint32_t functionAddress = 0;
+    pCall->IsCalledByAddress = ResolveExport(pSession, moduleName, ordinal, &functionAddress) == S_OK;
+
+    // The buffer is encoded right away so that the caller doesn't need to keep the input data around
+    hr = EncodeBuffer(
+        pCall->Buffer,
+        &pCall->BufferSize,
+        pCall->IsCalledByAddress ? NULL : moduleName,
+        ordinal,
+        functionAddress,
+        args,
+        numberOfArgs
+    );
+    if (SUCCEEDED(hr))
+        hr = CopyArgs(pCall, args, numberOfArgs);
+
+    if (FAILED(hr))
     {
-        LogError("Unexpected response received: %s", response);
-        free(buffer);
+        FreeAsyncCall(pCall);
+        return E_FAIL;
+    }
+
+    pCall->Thread = CreateThread(NULL, 0, RunAsyncCall, pCall, 0, NULL);
+    if (pCall->Thread == NULL)
+    {
+        LogError("Could not create a thread for the RPC.");
+        FreeAsyncCall(pCall);
 
         return E_FAIL;
     }
 
-    // Fetch the response only if a return value is expected from the function
-    if (pReturnValue != NULL)
+    *ppCall = pCall;
+
+    return S_OK;
+}
+
+HRESULT XdrpcWait(XdrpcAsyncCall *pCall, DWORD timeout, uint64_t *pReturnValue)
+{
+    DWORD result = WaitForSingleObject(pCall->Thread, timeout);
+    if (result == WAIT_TIMEOUT)
+        return E_PENDING;
+
+    if (result != WAIT_OBJECT_0)
+        return E_FAIL;
+
+    if (SUCCEEDED(pCall->Result) && pReturnValue != NULL)
+        *pReturnValue = pCall->ReturnValue;
+
+    return pCall->Result;
+}
+
+HRESULT XdrpcWaitAny(XdrpcAsyncCall **calls, size_t numberOfCalls, DWORD timeout, size_t *pCallIndex)
+{
+    if (numberOfCalls == 0 || numberOfCalls > MAXIMUM_WAIT_OBJECTS)
     {
-        // The return value is the second uint64_t in the buffer
-        void *returnValueLocationInBuffer = buffer + sizeof(*pReturnValue);
+        LogError("Can only wait for 1 to %d RPCs at once.", MAXIMUM_WAIT_OBJECTS);
+        return E_FAIL;
+    }
 
-        ZeroMemory(buffer, bufferSize);
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS] = { 0 };
+    for (size_t i = 0; i < numberOfCalls; i++)
+        threads[i] = calls[i]->Thread;
 
-        // Get the console type
-        uint32_t consoleType = 0;
-        hr = DmGetConsoleType((DWORD *)&consoleType);
-        if (FAILED(hr))
-        {
-            LogXbdmError(hr);
-            free(buffer);
+    DWORD result = WaitForMultipleObjects((DWORD)numberOfCalls, threads, FALSE, timeout);
+    if (result == WAIT_TIMEOUT)
+        return E_PENDING;
 
-            return E_FAIL;
-        }
+    if (result >= WAIT_OBJECT_0 + numberOfCalls)
+        return E_FAIL;
 
-        // It looks like reviewer kits (which is what an RGH is seen as) send 16 bytes of
-        // unknown data instead of 8
-        size_t unknownPacketSize =
-            consoleType == DMCT_REVIEWER_KIT
-                ? sizeof(uint64_t) * 2
-                : sizeof(uint64_t);
+    *pCallIndex = result - WAIT_OBJECT_0;
 
-        // An unknown packet is sent before the actual response buffer, I don't know what information
-        // it's supposed to hold...
-        hr = DmReceiveBinary(connection, buffer, (uint32_t)unknownPacketSize, NULL);
-        if (FAILED(hr))
-        {
-            LogXbdmError(hr);
-            free(buffer);
+    return S_OK;
+}
+
+HRESULT XdrpcWaitAll(XdrpcAsyncCall **calls, size_t numberOfCalls, DWORD timeout)
+{
+    if (numberOfCalls == 0 || numberOfCalls > MAXIMUM_WAIT_OBJECTS)
+    {
+        LogError("Can only wait for 1 to %d RPCs at once.", MAXIMUM_WAIT_OBJECTS);
+        return E_FAIL;
+    }
+
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS] = { 0 };
+    for (size_t i = 0; i < numberOfCalls; i++)
+        threads[i] = calls[i]->Thread;
+
+    DWORD result = WaitForMultipleObjects((DWORD)numberOfCalls, threads, TRUE, timeout);
+    if (result == WAIT_TIMEOUT)
+        return E_PENDING;
 
+    if (result >= WAIT_OBJECT_0 + numberOfCalls)
+        return E_FAIL;
+
+    for (size_t i = 0; i < numberOfCalls; i++)
+        if (FAILED(calls[i]->Result))
             return E_FAIL;
-        }
 
-        // Receive the actual response buffer (which is the buffer that was sent but with the return value in the second uint64_t)
-        hr = DmReceiveBinary(connection, buffer, (uint32_t)bufferSize, NULL);
-        if (FAILED(hr))
+    return S_OK;
+}
+
+void XdrpcCloseCall(XdrpcAsyncCall *pCall)
+{
+    WaitForSingleObject(pCall->Thread, INFINITE);
+
+    AddStats(&pCall->pSession->Stats, &pCall->Stats);
+
+    FreeAsyncCall(pCall);
+}
+
+struct _XdrpcBatch
+{
+    Session *pSession;
+
+    XdrpcAsyncCall **ppCalls;
+    uint64_t **ppReturnValues;
+    size_t NumberOfCalls;
+    size_t CallCapacity;
+
+    // The data of each write is a copy owned by the batch
+    MemoryRequest *pWrites;
+    size_t NumberOfWrites;
+    size_t WriteCapacity;
+
+    // Set when adding an RPC or a write failed, so that the caller only has to check the result of XdrpcRunBatch
+    HRESULT Result;
+};
+
+HRESULT XdrpcCreateBatch(Session *pSession, XdrpcBatch **ppBatch)
+{
+    XdrpcBatch *pBatch = calloc(1, sizeof(XdrpcBatch));
+    if (pBatch == NULL)
+    {
+        LogError("Could not allocate memory for the batch.");
+        return E_FAIL;
+    }
+
+    pBatch->pSession = pSession;
+    pBatch->Result = S_OK;
+    *ppBatch = pBatch;
+
+    return S_OK;
+}
+
+static HRESULT GrowArray(void **ppArray, size_t elementSize, size_t *pCapacity)
+{
+    size_t newCapacity = *pCapacity == 0 ? 16 : *pCapacity * 2;
+
+    void *pArray = realloc(*ppArray, newCapacity * elementSize);
+    if (pArray == NULL)
+        return E_FAIL;
+
+    *ppArray = pArray;
+    *pCapacity = newCapacity;
+
+    return S_OK;
+}
+
+HRESULT XdrpcBatchCall(XdrpcBatch *pBatch, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue)
+{
+    if (pBatch->NumberOfCalls == pBatch->CallCapacity)
+    {
+        size_t capacity = pBatch->CallCapacity;
+        if (FAILED(GrowArray((void **)&pBatch->ppCalls, sizeof(XdrpcAsyncCall *), &capacity)) ||
+            FAILED(GrowArray((void **)&pBatch->ppReturnValues, sizeof(uint64_t *), &pBatch->CallCapacity)))
         {
-            LogXbdmError(hr);
-            free(buffer);
+            LogError("Could not allocate memory for the RPCs of the batch.");
+            pBatch->Result = E_FAIL;
 
             return E_FAIL;
         }
+    }
+
+    XdrpcAsyncCall *pCall = NULL;
+    HRESULT hr = XdrpcCallAsync(pBatch->pSession, pTarget, moduleName, ordinal, args, numberOfArgs, NULL, NULL, &pCall);
+    if (FAILED(hr))
+    {
+        pBatch->Result = E_FAIL;
+        return E_FAIL;
+    }
+
+    pBatch->ppCalls[pBatch->NumberOfCalls] = pCall;
+    pBatch->ppReturnValues[pBatch->NumberOfCalls] = pReturnValue;
+    pBatch->NumberOfCalls++;
+
+    return S_OK;
+}
+
+HRESULT XdrpcBatchWriteMemory(XdrpcBatch *pBatch, uint32_t address, const void *pData, size_t size)
+{
+    void *pDataCopy = malloc(size);
+    if (pDataCopy == NULL || (pBatch->NumberOfWrites == pBatch->WriteCapacity && FAILED(GrowArray((void **)&pBatch->pWrites, sizeof(MemoryRequest), &pBatch->WriteCapacity))))
+    {
+        LogError("Could not allocate memory for the writes of the batch.");
+        free(pDataCopy);
+        pBatch->Result = E_FAIL;
 
-        // The bytes in the buffer need to be swapped because they are in big-endian and the PC's CPU has (most likely)
-        // a little-endian architecture.
-        *pReturnValue = _byteswap_uint64(*(uint64_t *)returnValueLocationInBuffer);
+        return E_FAIL;
     }
 
-    // Cleanup the heap allocated buffer
-    free(buffer);
+    memcpy(pDataCopy, pData, size);
 
-    // Close the XBDM connection
-    DmCloseConnection(connection);
+    MemoryRequest *pWrite = &pBatch->pWrites[pBatch->NumberOfWrites++];
+    pWrite->Type = MemoryRequestType_Write;
+    pWrite->Address = address;
+    pWrite->pData = pDataCopy;
+    pWrite->Size = size;
 
     return S_OK;
 }
 
+HRESULT XdrpcRunBatch(XdrpcBatch *pBatch)
+{
+    HRESULT hr = pBatch->Result;
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "XdrpcRunBatch", NULL);
+
+    // The writes go through the shared connection while the RPCs use the connections of the pool, so they overlap
+    if (pBatch->NumberOfWrites > 0 && FAILED(TransferMemory(pBatch->pSession, pBatch->pWrites, pBatch->NumberOfWrites)))
+        hr = E_FAIL;
+
+    for (size_t firstCall = 0; firstCall < pBatch->NumberOfCalls; firstCall += MAXIMUM_WAIT_OBJECTS)
+    {
+        size_t numberOfCalls = min(pBatch->NumberOfCalls - firstCall, MAXIMUM_WAIT_OBJECTS);
+        if (FAILED(XdrpcWaitAll(&pBatch->ppCalls[firstCall], numberOfCalls, INFINITE)))
+            hr = E_FAIL;
+    }
+
+    for (size_t i = 0; i < pBatch->NumberOfCalls; i++)
+    {
+        // The RPCs are all done so this doesn't wait, it only gets the return values
+        if (FAILED(XdrpcWait(pBatch->ppCalls[i], 0, pBatch->ppReturnValues[i])))
+            hr = E_FAIL;
+
+        XdrpcCloseCall(pBatch->ppCalls[i]);
+    }
+
+    EndTraceSpan(&span, 0, 0);
+
+    for (size_t i = 0; i < pBatch->NumberOfWrites; i++)
+        free(pBatch->pWrites[i].pData);
+
+    free(pBatch->pWrites);
+    free(pBatch->ppReturnValues);
+    free(pBatch->ppCalls);
+    free(pBatch);
+
+    return SUCCEEDED(hr) ? S_OK : E_FAIL;
+}
+
 // ----------------------------------------------------------------
 // Examples of buffer to construct to call different functions
 // ----------------------------------------------------------------
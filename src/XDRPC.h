@@ -3,16 +3,73 @@
 #include <stdint.h>
 #include <Windows.h>
 
+#include "Session.h"
+
+#define XDRPC_MAX_BUFFER_SIZE 0x1000
+
+// There is no float or double type. The buffer only has one 8-byte slot per argument and the slots are given to the
+// function as integers, where floating point values would go in the buffer for f1-f13 is not known. A float can still
+// be passed by pointer with a buffer argument.
 typedef enum _XdrpcArgType
 {
     XdrpcArgType_Integer,
     XdrpcArgType_String,
+    XdrpcArgType_Buffer,
 } XdrpcArgType;
 
 typedef struct _XdrpcArgInfo
 {
     const void *pData;
     XdrpcArgType Type;
+
+    // Only used by buffer arguments. The Size bytes pointed to by pData are copied in the RPC buffer (or zeros
+    // when pData is NULL) and, when pOutData is not NULL, the content of the buffer after the call is copied to it.
+    size_t Size;
+    void *pOutData;
 } XdrpcArgInfo;
 
-HRESULT XdrpcCall(const char *moduleName, uint32_t ordinal, XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue);
+// Runs the RPC where the default RPC target of the session says
+HRESULT XdrpcCall(Session *pSession, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue);
+
+// Runs the RPC on pTarget instead of the default RPC target of the session (which is used if pTarget is NULL)
+HRESULT XdrpcCallOn(Session *pSession, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue);
+
+typedef struct _XdrpcAsyncCall XdrpcAsyncCall;
+
+// Called from the thread the RPC ran on as soon as it's done
+typedef void (*XdrpcCompletionCallback)(XdrpcAsyncCall *pCall, HRESULT result, uint64_t returnValue, void *pContext);
+
+// Starts the RPC on one of the RPC connections of the session and returns right away. The arguments are copied
+// except the output buffers (pOutData), which need to stay valid until the RPC is done. pTarget and pCallback can
+// be NULL, the default RPC target of the session is used if pTarget is.
+HRESULT XdrpcCallAsync(Session *pSession, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, XdrpcCompletionCallback pCallback, void *pContext, XdrpcAsyncCall **ppCall);
+
+// Waits for the RPC to be done and gets its result, timeout is in milliseconds (INFINITE to wait forever)
+HRESULT XdrpcWait(XdrpcAsyncCall *pCall, DWORD timeout, uint64_t *pReturnValue);
+
+// Waits for one of the RPCs to be done, its index in calls is written to pCallIndex
+HRESULT XdrpcWaitAny(XdrpcAsyncCall **calls, size_t numberOfCalls, DWORD timeout, size_t *pCallIndex);
+
+// Waits for all of the RPCs to be done, returns E_FAIL if any of them failed
+HRESULT XdrpcWaitAll(XdrpcAsyncCall **calls, size_t numberOfCalls, DWORD timeout);
+
+// Waits for the RPC to be done if it's not already, adds its stats to the stats of the session and frees it.
+// Needs to be called from the thread that owns the session.
+void XdrpcCloseCall(XdrpcAsyncCall *pCall);
+
+typedef struct _XdrpcBatch XdrpcBatch;
+
+// A batch collects RPCs and memory writes that don't depend on each other and waits for all of them at once. The
+// RPCs start as soon as they're added (on the RPC connections of the session, like XdrpcCallAsync) and the writes are
+// sent together by XdrpcRunBatch while the RPCs are in flight. Can only be used from the thread that owns the session.
+HRESULT XdrpcCreateBatch(Session *pSession, XdrpcBatch **ppBatch);
+
+// Same arguments as XdrpcCallOn, pReturnValue is written by XdrpcRunBatch and needs to stay valid until then
+HRESULT XdrpcBatchCall(XdrpcBatch *pBatch, const RpcTarget *pTarget, const char *moduleName, uint32_t ordinal, const XdrpcArgInfo *args, size_t numberOfArgs, uint64_t *pReturnValue);
+
+// The data is copied, the writes are done in the order they were added
+HRESULT XdrpcBatchWriteMemory(XdrpcBatch *pBatch, uint32_t address, const void *pData, size_t size);
+
+// Sends the writes, waits for all the RPCs and frees the batch. Returns E_FAIL if anything in the batch failed, or if
+// adding something to it did.
+HRESULT XdrpcRunBatch(XdrpcBatch *pBatch);
@@ -0,0 +1,310 @@
+#include "Xex.h"
+
+#include <string.h>
+
+#include "Log.h"
+
+#define XEX2_MAGIC 0x58455832 // "XEX2"
+
+// Offsets in the XEX2 header
+#define XEX_MAGIC_OFFSET 0x00
+#define XEX_MODULE_FLAGS_OFFSET 0x04
+#define XEX_HEADER_SIZE_OFFSET 0x08
+#define XEX_SECURITY_INFO_OFFSET 0x10
+#define XEX_OPTIONAL_HEADER_COUNT_OFFSET 0x14
+#define XEX_OPTIONAL_HEADERS_OFFSET 0x18
+
+// Offsets in the security info
+#define XEX_SECURITY_INFO_IMAGE_SIZE_OFFSET 0x004
+#define XEX_SECURITY_INFO_LOAD_ADDRESS_OFFSET 0x110
+
+// Offsets in the file format info
+#define XEX_FILE_FORMAT_INFO_SIZE_OFFSET 0x00
+#define XEX_FILE_FORMAT_ENCRYPTION_TYPE_OFFSET 0x04
+#define XEX_FILE_FORMAT_COMPRESSION_TYPE_OFFSET 0x06
+#define XEX_FILE_FORMAT_BASIC_BLOCKS_OFFSET 0x08
+
+#define XEX_ENCRYPTION_NONE 0
+#define XEX_COMPRESSION_NONE 0
+#define XEX_COMPRESSION_BASIC 1
+
+// Anything bigger than that is not a real header
+#define XEX_MAX_HEADER_SIZE 0x100000
+
+static uint32_t ReadUInt32(const uint8_t *pLocation)
+{
+    // XEX files are in big-endian and the location is not necessarily aligned
+    uint32_t value = 0;
+    memcpy(&value, pLocation, sizeof(value));
+
+    return _byteswap_ulong(value);
+}
+
+static uint16_t ReadUInt16(const uint8_t *pLocation)
+{
+    uint16_t value = 0;
+    memcpy(&value, pLocation, sizeof(value));
+
+    return _byteswap_ushort(value);
+}
+
+HRESULT XexFindOptionalHeader(const uint8_t *pHeader, size_t headerSize, uint32_t key, uint32_t *pValue)
+{
+    if (headerSize < XEX_OPTIONAL_HEADERS_OFFSET || ReadUInt32(pHeader + XEX_MAGIC_OFFSET) != XEX2_MAGIC)
+    {
+        LogError("Not a valid XEX2 file.");
+        return E_FAIL;
+    }
+
+    // Each optional header is made of a key and a value, the value is the data itself when the lowest byte of the
+    // key is 0 or 1, otherwise it's the offset of the data from the start of the file
+    uint32_t numberOfOptionalHeaders = ReadUInt32(pHeader + XEX_OPTIONAL_HEADER_COUNT_OFFSET);
+    for (uint32_t i = 0; i < numberOfOptionalHeaders; i++)
+    {
+        size_t entryOffset = XEX_OPTIONAL_HEADERS_OFFSET + (size_t)i * sizeof(uint32_t) * 2;
+        if (entryOffset + sizeof(uint32_t) * 2 > headerSize)
+            break;
+
+        if (ReadUInt32(pHeader + entryOffset) == key)
+        {
+            *pValue = ReadUInt32(pHeader + entryOffset + sizeof(uint32_t));
+            return S_OK;
+        }
+    }
+
+    return S_FALSE;
+}
+
+HRESULT XexGetHeaderSize(const uint8_t *pHeader, size_t headerSize, uint32_t *pSize)
+{
+    if (headerSize < XEX_OPTIONAL_HEADERS_OFFSET || ReadUInt32(pHeader + XEX_MAGIC_OFFSET) != XEX2_MAGIC)
+    {
+        LogError("Not a valid XEX2 file.");
+        return E_FAIL;
+    }
+
+    // The headers go from the start of the file to the start of the PE image
+    uint32_t size = ReadUInt32(pHeader + XEX_HEADER_SIZE_OFFSET);
+    if (size < XEX_OPTIONAL_HEADERS_OFFSET || size > XEX_MAX_HEADER_SIZE)
+    {
+        LogError("Invalid XEX2 header size: 0x%X.", size);
+        return E_FAIL;
+    }
+
+    *pSize = size;
+
+    return S_OK;
+}
+
+HRESULT XexGetImportLibraryNames(const uint8_t *pHeader, size_t headerSize, const char **names, size_t maxNames, size_t *pNumberOfNames)
+{
+    *pNumberOfNames = 0;
+
+    uint32_t importLibrariesOffset = 0;
+    HRESULT hr = XexFindOptionalHeader(pHeader, headerSize, XEX_HEADER_IMPORT_LIBRARIES, &importLibrariesOffset);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // The module doesn't import anything
+    if (hr == S_FALSE)
+        return S_OK;
+
+    // The import libraries start with their total size, followed by the size of the string table, the number of
+    // strings in it and the strings themselves (null-terminated and padded with zeros)
+    if ((size_t)importLibrariesOffset + sizeof(uint32_t) * 3 > headerSize)
+    {
+        LogError("The import libraries are outside of the header.");
+        return E_FAIL;
+    }
+
+    uint32_t stringTableSize = ReadUInt32(pHeader + importLibrariesOffset + sizeof(uint32_t));
+    uint32_t numberOfStrings = ReadUInt32(pHeader + importLibrariesOffset + sizeof(uint32_t) * 2);
+    size_t stringTableOffset = (size_t)importLibrariesOffset + sizeof(uint32_t) * 3;
+    if (stringTableOffset + stringTableSize > headerSize)
+    {
+        LogError("The import library names are outside of the header.");
+        return E_FAIL;
+    }
+
+    const char *pStringTable = (const char *)pHeader + stringTableOffset;
+    size_t offset = 0;
+    while (offset < stringTableSize && *pNumberOfNames < numberOfStrings && *pNumberOfNames < maxNames)
+    {
+        // Skip the padding
+        if (pStringTable[offset] == '\0')
+        {
+            offset++;
+            continue;
+        }
+
+        // The last string has to be null-terminated inside the table to be used as is
+        size_t length = strnlen_s(pStringTable + offset, stringTableSize - offset);
+        if (offset + length == stringTableSize)
+            break;
+
+        names[(*pNumberOfNames)++] = pStringTable + offset;
+        offset += length + 1;
+    }
+
+    return S_OK;
+}
+
+HRESULT XexParseHeader(const uint8_t *pHeader, size_t headerSize, XexImageInfo *pInfo)
+{
+    HRESULT hr = S_OK;
+
+    ZeroMemory(pInfo, sizeof(*pInfo));
+
+    hr = XexGetHeaderSize(pHeader, headerSize, &pInfo->HeaderSize);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    if (pInfo->HeaderSize > headerSize)
+    {
+        LogError("The XEX2 header is 0x%X bytes but only 0x%X bytes are available.", pInfo->HeaderSize, (uint32_t)headerSize);
+        return E_FAIL;
+    }
+
+    // Nothing outside of the header is looked at from now on
+    headerSize = pInfo->HeaderSize;
+
+    pInfo->ModuleFlags = ReadUInt32(pHeader + XEX_MODULE_FLAGS_OFFSET);
+
+    // The security info contains the size of the image and the address it's loaded at by default
+    uint32_t securityInfoOffset = ReadUInt32(pHeader + XEX_SECURITY_INFO_OFFSET);
+    if ((size_t)securityInfoOffset + XEX_SECURITY_INFO_LOAD_ADDRESS_OFFSET + sizeof(uint32_t) > headerSize)
+    {
+        LogError("The security info is outside of the header.");
+        return E_FAIL;
+    }
+
+    pInfo->ImageSize = ReadUInt32(pHeader + securityInfoOffset + XEX_SECURITY_INFO_IMAGE_SIZE_OFFSET);
+    pInfo->BaseAddress = ReadUInt32(pHeader + securityInfoOffset + XEX_SECURITY_INFO_LOAD_ADDRESS_OFFSET);
+
+    // The image base address optional header overrides the load address of the security info
+    uint32_t baseAddress = 0;
+    hr = XexFindOptionalHeader(pHeader, headerSize, XEX_HEADER_IMAGE_BASE_ADDRESS, &baseAddress);
+    if (hr == S_OK)
+        pInfo->BaseAddress = baseAddress;
+
+    XexFindOptionalHeader(pHeader, headerSize, XEX_HEADER_ENTRY_POINT, &pInfo->EntryPoint);
+
+    uint32_t checksumTimestampOffset = 0;
+    hr = XexFindOptionalHeader(pHeader, headerSize, XEX_HEADER_CHECKSUM_TIMESTAMP, &checksumTimestampOffset);
+    if (hr == S_OK && (size_t)checksumTimestampOffset + sizeof(uint32_t) * 2 <= headerSize)
+    {
+        pInfo->Checksum = ReadUInt32(pHeader + checksumTimestampOffset);
+        pInfo->Timestamp = ReadUInt32(pHeader + checksumTimestampOffset + sizeof(uint32_t));
+    }
+
+    uint32_t fileFormatInfoOffset = 0;
+    hr = XexFindOptionalHeader(pHeader, headerSize, XEX_HEADER_FILE_FORMAT_INFO, &fileFormatInfoOffset);
+    if (hr == S_OK && (size_t)fileFormatInfoOffset + XEX_FILE_FORMAT_COMPRESSION_TYPE_OFFSET + sizeof(uint16_t) <= headerSize)
+    {
+        pInfo->EncryptionType = ReadUInt16(pHeader + fileFormatInfoOffset + XEX_FILE_FORMAT_ENCRYPTION_TYPE_OFFSET);
+        pInfo->CompressionType = ReadUInt16(pHeader + fileFormatInfoOffset + XEX_FILE_FORMAT_COMPRESSION_TYPE_OFFSET);
+    }
+
+    hr = XexGetImportLibraryNames(pHeader, headerSize, pInfo->ImportLibraryNames, ARRAYSIZE(pInfo->ImportLibraryNames), &pInfo->NumberOfImportLibraries);
+    if (FAILED(hr))
+        return E_FAIL;
+
+    // An image the loader would refuse anyway
+    if (pInfo->ImageSize == 0 || (uint64_t)pInfo->BaseAddress + pInfo->ImageSize > UINT32_MAX)
+    {
+        LogError("Invalid image range: 0x%08X (0x%X bytes).", pInfo->BaseAddress, pInfo->ImageSize);
+        return E_FAIL;
+    }
+
+    if (pInfo->EntryPoint != 0 && (pInfo->EntryPoint < pInfo->BaseAddress || pInfo->EntryPoint >= pInfo->BaseAddress + pInfo->ImageSize))
+    {
+        LogError("The entry point 0x%08X is outside of the image.", pInfo->EntryPoint);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static HRESULT CopyImageData(const uint8_t *pFile, size_t fileSize, size_t *pFileOffset, uint8_t *pImage, size_t imageSize, size_t *pImageOffset, size_t dataSize, size_t zeroSize)
+{
+    if (dataSize > fileSize - *pFileOffset || dataSize + zeroSize > imageSize - *pImageOffset)
+    {
+        LogError("The image data goes past the end of the file or of the image.");
+        return E_FAIL;
+    }
+
+    memcpy(pImage + *pImageOffset, pFile + *pFileOffset, dataSize);
+    ZeroMemory(pImage + *pImageOffset + dataSize, zeroSize);
+
+    *pFileOffset += dataSize;
+    *pImageOffset += dataSize + zeroSize;
+
+    return S_OK;
+}
+
+HRESULT XexExtractImage(const uint8_t *pFile, size_t fileSize, const XexImageInfo *pInfo, uint8_t *pImage)
+{
+    HRESULT hr = S_OK;
+
+    if (pInfo->EncryptionType != XEX_ENCRYPTION_NONE)
+    {
+        LogError("The image is encrypted, only unencrypted images can be extracted.");
+        return E_FAIL;
+    }
+
+    if (pInfo->CompressionType != XEX_COMPRESSION_NONE && pInfo->CompressionType != XEX_COMPRESSION_BASIC)
+    {
+        LogError("The image is compressed with LZX or is a delta patch, only images with no or basic compression can be extracted.");
+        return E_FAIL;
+    }
+
+    // The image data comes right after the headers
+    size_t fileOffset = pInfo->HeaderSize;
+    size_t imageOffset = 0;
+    if (fileOffset > fileSize)
+    {
+        LogError("The image data is outside of the file.");
+        return E_FAIL;
+    }
+
+    if (pInfo->CompressionType == XEX_COMPRESSION_NONE)
+    {
+        size_t dataSize = fileSize - fileOffset < pInfo->ImageSize ? fileSize - fileOffset : pInfo->ImageSize;
+
+        return CopyImageData(pFile, fileSize, &fileOffset, pImage, pInfo->ImageSize, &imageOffset, dataSize, pInfo->ImageSize - dataSize);
+    }
+
+    // Basic compression only removes runs of zeros, the file format info is followed by a list of blocks made
+    // of the size of the data to copy and the number of zeros that come after it
+    uint32_t fileFormatInfoOffset = 0;
+    hr = XexFindOptionalHeader(pFile, pInfo->HeaderSize, XEX_HEADER_FILE_FORMAT_INFO, &fileFormatInfoOffset);
+    if (hr != S_OK || (size_t)fileFormatInfoOffset + XEX_FILE_FORMAT_BASIC_BLOCKS_OFFSET > pInfo->HeaderSize)
+    {
+        LogError("The file format info is missing or outside of the header.");
+        return E_FAIL;
+    }
+
+    uint32_t fileFormatInfoSize = ReadUInt32(pFile + fileFormatInfoOffset + XEX_FILE_FORMAT_INFO_SIZE_OFFSET);
+    if (fileFormatInfoSize < XEX_FILE_FORMAT_BASIC_BLOCKS_OFFSET || (size_t)fileFormatInfoOffset + fileFormatInfoSize > pInfo->HeaderSize)
+    {
+        LogError("Invalid file format info size: 0x%X.", fileFormatInfoSize);
+        return E_FAIL;
+    }
+
+    size_t numberOfBlocks = (fileFormatInfoSize - XEX_FILE_FORMAT_BASIC_BLOCKS_OFFSET) / (sizeof(uint32_t) * 2);
+    const uint8_t *pBlocks = pFile + fileFormatInfoOffset + XEX_FILE_FORMAT_BASIC_BLOCKS_OFFSET;
+    for (size_t i = 0; i < numberOfBlocks; i++)
+    {
+        uint32_t dataSize = ReadUInt32(pBlocks + i * sizeof(uint32_t) * 2);
+        uint32_t zeroSize = ReadUInt32(pBlocks + i * sizeof(uint32_t) * 2 + sizeof(uint32_t));
+
+        hr = CopyImageData(pFile, fileSize, &fileOffset, pImage, pInfo->ImageSize, &imageOffset, dataSize, zeroSize);
+        if (FAILED(hr))
+            return E_FAIL;
+    }
+
+    // The blocks don't necessarily cover the end of the image
+    ZeroMemory(pImage + imageOffset, pInfo->ImageSize - imageOffset);
+
+    return S_OK;
+}
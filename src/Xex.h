@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <Windows.h>
+
+// Keys of the optional headers
+#define XEX_HEADER_FILE_FORMAT_INFO 0x000003FF
+#define XEX_HEADER_ENTRY_POINT 0x00010100
+#define XEX_HEADER_IMAGE_BASE_ADDRESS 0x00010201
+#define XEX_HEADER_IMPORT_LIBRARIES 0x000103FF
+#define XEX_HEADER_CHECKSUM_TIMESTAMP 0x00018002
+
+#define XEX_MAX_IMPORT_LIBRARIES 64
+
+typedef struct _XexImageInfo
+{
+    uint32_t ModuleFlags;
+    uint32_t HeaderSize;
+    uint32_t BaseAddress;
+    uint32_t ImageSize;
+    uint32_t EntryPoint;
+    uint32_t Checksum;
+    uint32_t Timestamp;
+    uint16_t EncryptionType;
+    uint16_t CompressionType;
+
+    // Point to the header that was parsed, nothing is copied
+    const char *ImportLibraryNames[XEX_MAX_IMPORT_LIBRARIES];
+    size_t NumberOfImportLibraries;
+} XexImageInfo;
+
+HRESULT XexFindOptionalHeader(const uint8_t *pHeader, size_t headerSize, uint32_t key, uint32_t *pValue);
+
+HRESULT XexGetHeaderSize(const uint8_t *pHeader, size_t headerSize, uint32_t *pSize);
+
+HRESULT XexGetImportLibraryNames(const uint8_t *pHeader, size_t headerSize, const char **names, size_t maxNames, size_t *pNumberOfNames);
+
+HRESULT XexParseHeader(const uint8_t *pHeader, size_t headerSize, XexImageInfo *pInfo);
+
+// Rebuilds the image the way it's laid out in memory once loaded (before relocations and imports are applied) into
+// pImage, which needs to be pInfo->ImageSize bytes. Only unencrypted images with no or basic compression are supported.
+HRESULT XexExtractImage(const uint8_t *pFile, size_t fileSize, const XexImageInfo *pInfo, uint8_t *pImage);
@@ -1,79 +1,600 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "Daemon.h"
+#include "HotReload.h"
+#include "ImageDiff.h"
 #include "Log.h"
+#include "Manifest.h"
 #include "Modules.h"
+#include "MultiConsole.h"
+#include "ParallelUpload.h"
+#include "Scan.h"
+#include "Session.h"
+#include "Staging.h"
+#include "Stats.h"
+#include "Trace.h"
 #include "Utils.h"
 
-int main(int argc, char **argv)
+// -d takes a list of files and -f a pattern that can be split in several arguments, the other commands take at most 3
+#define MAX_ARGUMENTS 256
+
+typedef struct _Options
 {
-    // The first char * of argv is the name of the program so the number of arguments is argc - 1
-    size_t numberOfArguments = argc - 1;
+    const char *StatsFilePath;
+    const char *TraceFilePath;
+    BOOL Force;
+    BOOL AddressCalls;
+    uint64_t StagingSize;
+    size_t NumberOfConnections;
+    const char *ConsoleName;
+    const char *ConsoleList;
+    BOOL AllConsoles;
+    RpcTarget RpcTarget;
+} Options;
+
+static void InitializeOptions(Options *pOptions)
+{
+    ZeroMemory(pOptions, sizeof(*pOptions));
+    pOptions->StagingSize = DEFAULT_STAGING_SIZE;
+    pOptions->NumberOfConnections = DEFAULT_NUMBER_OF_CONNECTIONS;
+    pOptions->RpcTarget.Processor = RPC_DEFAULT_PROCESSOR;
+}
+
+typedef struct _CommandInfo
+{
+    const char *Flag;
+
+    // Including the flag itself
+    size_t MinArguments;
+    size_t MaxArguments;
+
+    // Logged when fewer arguments are given
+    const char *MissingArgumentsMessage;
+} CommandInfo;
+
+static const CommandInfo s_Commands[] = {
+    { "-h", 1, 1, NULL },
+    { "-i", 2, 2, "You need to specify a local file path." },
+    { "-s", 1, 1, NULL },
+    { "-S", 1, 1, NULL },
+    { "-w", 1, 1, NULL },
+    { "-l", 2, 2, "You need to specify an absolute module path." },
+    { "-u", 2, 2, "You need to specify a module name." },
+    { "-m", 2, 2, "You need to specify a manifest file path." },
+    { "-p", 3, 3, "You need to specify a local file path and an absolute module path." },
+    { "-c", 2, 2, "You need to specify a local file path." },
+    { "-d", 3, MAX_ARGUMENTS, "You need to specify an absolute directory path and at least one local file path." },
+    { "-r", 3, 3, "You need to specify a local file path and an absolute module path." },
+    { "-f", 3, 2 + MAX_PATTERN_SIZE, "You need to specify a module name and a pattern." },
+    { "-x", 3, 3, "You need to specify a module name and a local file path." },
+    { "--daemon", 1, 1, NULL },
+};
+
+static HRESULT ValidateCommand(size_t numberOfArguments, char **arguments)
+{
+    // Case of using ModuleLoader by just providing a module path
+    if (arguments[0][0] != '-')
+    {
+        if (numberOfArguments > 1)
+        {
+            LogError("Maximum number of arguments exceeded. ModuleLoader -h to see the usage.");
+            return E_FAIL;
+        }
+
+        return S_OK;
+    }
+
+    for (size_t i = 0; i < ARRAYSIZE(s_Commands); i++)
+    {
+        const CommandInfo *pCommand = &s_Commands[i];
+        if (strcmp(arguments[0], pCommand->Flag))
+            continue;
+
+        if (numberOfArguments < pCommand->MinArguments)
+        {
+            LogError("%s ModuleLoader -h to see the usage.", pCommand->MissingArgumentsMessage);
+            return E_FAIL;
+        }
+
+        // Extra arguments would otherwise be silently ignored
+        if (numberOfArguments > pCommand->MaxArguments)
+        {
+            LogError("Maximum number of arguments exceeded. ModuleLoader -h to see the usage.");
+            return E_FAIL;
+        }
+
+        return S_OK;
+    }
+
+    LogError("%s is not a valid argument. ModuleLoader -h to see the usage.", arguments[0]);
+
+    return E_FAIL;
+}
+
+static HRESULT ParseOptions(int argc, char **argv, Options *pOptions, char **arguments, size_t *pNumberOfArguments)
+{
+    // Separate the options that can be combined with any command from the arguments of the command itself,
+    // the first char * of argv is the name of the program so it's skipped
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--stats"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify a file to write the stats to. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            pOptions->StatsFilePath = argv[++i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--trace"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify a file to write the trace to. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            pOptions->TraceFilePath = argv[++i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--staging-size"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify the maximum size of the staging area in megabytes. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            // Sizes that don't fit in 64 bits once converted to bytes are rejected instead of wrapping around
+            char *end = NULL;
+            uint64_t stagingSizeInMegabytes = strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || stagingSizeInMegabytes > UINT64_MAX / (1024 * 1024))
+            {
+                LogError("%s is not a valid size in megabytes. ModuleLoader -h to see the usage.", argv[i]);
+                return E_FAIL;
+            }
+
+            pOptions->StagingSize = stagingSizeInMegabytes * 1024 * 1024;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--connections"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify a number of connections. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            char *end = NULL;
+            pOptions->NumberOfConnections = (size_t)strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || pOptions->NumberOfConnections == 0 || pOptions->NumberOfConnections > MAX_NUMBER_OF_CONNECTIONS)
+            {
+                LogError("The number of connections must be between 1 and %d. ModuleLoader -h to see the usage.", MAX_NUMBER_OF_CONNECTIONS);
+                return E_FAIL;
+            }
+
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--processor"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify a processor. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            if (!strcmp(argv[++i], "any"))
+            {
+                pOptions->RpcTarget.Processor = RPC_ANY_PROCESSOR;
+                continue;
+            }
+
+            char *end = NULL;
+            pOptions->RpcTarget.Processor = (DWORD)strtoul(argv[i], &end, 10);
+            if (end == argv[i] || *end != '\0' || pOptions->RpcTarget.Processor >= RPC_NUMBER_OF_PROCESSORS)
+            {
+                LogError("The processor must be between 0 and %d, or any. ModuleLoader -h to see the usage.", RPC_NUMBER_OF_PROCESSORS - 1);
+                return E_FAIL;
+            }
+
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--thread"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify the id of a title thread. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            char *end = NULL;
+            pOptions->RpcTarget.ThreadId = (DWORD)strtoul(argv[++i], &end, 16);
+            if (end == argv[i] || *end != '\0' || pOptions->RpcTarget.ThreadId == 0)
+            {
+                LogError("%s is not a valid thread id. ModuleLoader -h to see the usage.", argv[i]);
+                return E_FAIL;
+            }
+
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--console") || !strcmp(argv[i], "--consoles"))
+        {
+            if (i + 1 >= argc)
+            {
+                LogError("You need to specify the name or IP address of the consoles. ModuleLoader -h to see the usage.");
+                return E_FAIL;
+            }
+
+            if (!strcmp(argv[i], "--console"))
+                pOptions->ConsoleName = argv[++i];
+            else
+                pOptions->ConsoleList = argv[++i];
+
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--all"))
+        {
+            pOptions->AllConsoles = TRUE;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--force"))
+        {
+            pOptions->Force = TRUE;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--address-calls"))
+        {
+            pOptions->AddressCalls = TRUE;
+            continue;
+        }
+
+        // Check to make sure not more than MAX_ARGUMENTS arguments are passed
+        if (*pNumberOfArguments == MAX_ARGUMENTS)
+        {
+            LogError("Maximum number of arguments exceeded. ModuleLoader -h to see the usage.");
+            return E_FAIL;
+        }
+
+        arguments[(*pNumberOfArguments)++] = argv[i];
+    }
+
+    return S_OK;
+}
+
+static int RunCommand(Session *pSession, const Options *pOptions, size_t numberOfArguments, char **arguments)
+{
+    // Case of using ModuleLoader by just providing a module path
+    if (arguments[0][0] != '-')
+        return UnloadThenLoad(pSession, arguments[0], pOptions->Force);
+
+    // Cases of using ModuleLoader with a flag
+
+    // Module list
+    if (!strcmp(arguments[0], "-s"))
+        return ShowLoadedModules(pSession, FALSE);
+    if (!strcmp(arguments[0], "-S"))
+        return ShowLoadedModules(pSession, TRUE);
+
+    // Module events
+    if (!strcmp(arguments[0], "-w"))
+        return WatchLoadedModules(pSession);
+
+    // Loading
+    if (!strcmp(arguments[0], "-l"))
+        return Load(pSession, arguments[1]);
+
+    // Unloading
+    if (!strcmp(arguments[0], "-u"))
+        return Unload(pSession, arguments[1]);
+
+    // Reloading a set of modules
+    if (!strcmp(arguments[0], "-m"))
+        return ReloadManifest(pSession, arguments[1], pOptions->Force);
+
+    // Deploying
+    if (!strcmp(arguments[0], "-p"))
+        return DeployModule(pSession, arguments[1], arguments[2], pOptions->Force);
+
+    // Loading through the staging area
+    if (!strcmp(arguments[0], "-c"))
+        return LoadFromStaging(pSession, arguments[1], pOptions->StagingSize, pOptions->Force);
+
+    // Deploying several files at once
+    if (!strcmp(arguments[0], "-d"))
+        return DeployFiles(pSession, arguments[1], &arguments[2], numberOfArguments - 2, pOptions->NumberOfConnections, pOptions->Force);
+
+    // Hot reloading
+    if (!strcmp(arguments[0], "-r"))
+        return HotReload(pSession, arguments[1], arguments[2], pOptions->Force);
+
+    // Signature scanning
+    if (!strcmp(arguments[0], "-f"))
+    {
+        // The pattern can be given as a single argument or as one argument per byte
+        char pattern[MAX_PATTERN_SIZE * 3 + 1] = { 0 };
+        for (size_t i = 2; i < numberOfArguments; i++)
+        {
+            if ((i > 2 && strncat_s(pattern, sizeof(pattern), " ", _TRUNCATE) != 0) || strncat_s(pattern, sizeof(pattern), arguments[i], _TRUNCATE) != 0)
+            {
+                LogError("The pattern can't be longer than %d bytes.", MAX_PATTERN_SIZE);
+                return EXIT_FAILURE;
+            }
+        }
+
+        return ScanModule(pSession, arguments[1], pattern);
+    }
+
+    // Diffing a loaded module against its XEX file
+    if (!strcmp(arguments[0], "-x"))
+        return DiffModule(pSession, arguments[1], arguments[2]);
+
+    // ValidateCommand rejects any other flag before the session is opened
+    return EXIT_FAILURE;
+}
+
+static HRESULT BuildCommandLineForConsoles(int argc, char **argv, char *commandLine, size_t commandLineSize)
+{
+    // Start from the path of ModuleLoader.exe since argv[0] could be relative to another directory
+    char executablePath[MAX_PATH] = { 0 };
+    DWORD executablePathLength = GetModuleFileNameA(NULL, executablePath, sizeof(executablePath));
+    if (executablePathLength == 0 || executablePathLength == sizeof(executablePath))
+    {
+        LogError("Could not get the path of ModuleLoader.exe.");
+        return E_FAIL;
+    }
+
+    commandLine[0] = '\0';
+    HRESULT hr = AppendQuotedArgument(commandLine, commandLineSize, executablePath);
+
+    // Pass all the arguments through except the ones selecting the consoles, and the trace and the stats since all
+    // the processes would write to the same file (each console gets its own stats file instead)
+    for (int i = 1; i < argc && SUCCEEDED(hr); i++)
+    {
+        if (!strcmp(argv[i], "--consoles") || !strcmp(argv[i], "--trace") || !strcmp(argv[i], "--stats"))
+        {
+            i++;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--all"))
+            continue;
+
+        hr = AppendQuotedArgument(commandLine, commandLineSize, argv[i]);
+    }
 
-    // Add the XDK bin directory to the path to successfully delay load xbdm.dll
-    HRESULT hr = AddXdkBinDirToPath();
+    if (FAILED(hr))
+    {
+        LogError("The command line is too long to run the command on several consoles.");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static int RunCommandOnConsoles(int argc, char **argv, const Options *pOptions)
+{
+    char commandLine[0x1000] = { 0 };
+    HRESULT hr = BuildCommandLineForConsoles(argc, argv, commandLine, sizeof(commandLine));
     if (FAILED(hr))
         return EXIT_FAILURE;
 
-    // Case of using ModuleLoader without providing any arguments
-    if (numberOfArguments == 0)
+    if (!pOptions->AllConsoles)
+        return RunOnConsoles(commandLine, pOptions->ConsoleList, pOptions->StatsFilePath);
+
+    // There is no way to list the consoles registered in Neighborhood, so the ones to target are configured
+    char *consoleList = NULL;
+    size_t consoleListSize = 0;
+    errno_t err = _dupenv_s(&consoleList, &consoleListSize, CONSOLES_ENVIRONMENT_VARIABLE);
+    if (err != 0 || consoleList == NULL)
     {
-        ShowUsage();
-        return EXIT_SUCCESS;
+        LogError("Could not get the value of %s, set it to the comma-separated list of your consoles to use --all.", CONSOLES_ENVIRONMENT_VARIABLE);
+        return EXIT_FAILURE;
     }
 
-    // Check to make sure not more than 2 arguments are passed
-    if (numberOfArguments > 2)
+    int exitCode = RunOnConsoles(commandLine, consoleList, pOptions->StatsFilePath);
+
+    free(consoleList);
+
+    return exitCode;
+}
+
+static void WriteStats(const char *filePath, size_t numberOfArguments, char **arguments, const Stats *pStats, double elapsedMilliseconds, int exitCode)
+{
+    // Rebuild the command line (without the options) to identify the command in the stats
+    char command[2048] = { 0 };
+    for (size_t i = 0; i < numberOfArguments; i++)
     {
-        LogError("Maximum number of arguments exceeded. ModuleLoader -h to see the usage.");
+        if (i > 0)
+            strncat_s(command, sizeof(command), " ", _TRUNCATE);
+
+        strncat_s(command, sizeof(command), arguments[i], _TRUNCATE);
+    }
+
+    LogInfo(
+        "%.3fms, %llu round trips, %llu bytes sent, %llu bytes received.",
+        elapsedMilliseconds,
+        pStats->RoundTrips,
+        pStats->BytesSent,
+        pStats->BytesReceived
+    );
+
+    AppendStats(filePath, command, pStats, elapsedMilliseconds, exitCode);
+}
+
+static BOOL CanRunInDaemon(const Options *pOptions, char **arguments)
+{
+    // The daemon only talks to its own console
+    if (pOptions->ConsoleName != NULL || pOptions->ConsoleList != NULL || pOptions->AllConsoles)
+        return FALSE;
+
+    // Commands that run until Ctrl+C is pressed would keep the daemon from serving other clients
+    return strcmp(arguments[0], "-w") && strcmp(arguments[0], "-r") && strcmp(arguments[0], "--daemon");
+}
+
+static int RunDaemonCommand(Session *pSession, int argc, char **argv)
+{
+    Options options = { 0 };
+    InitializeOptions(&options);
+
+    // The RPCs of the command run where the daemon was told to run them unless the command says otherwise
+    options.RpcTarget = pSession->DefaultRpcTarget;
+
+    char *arguments[MAX_ARGUMENTS] = { 0 };
+    size_t numberOfArguments = 0;
+    HRESULT hr = ParseOptions(argc, argv, &options, arguments, &numberOfArguments);
+    if (FAILED(hr))
+        return EXIT_FAILURE;
+
+    if (numberOfArguments == 0 || !CanRunInDaemon(&options, arguments))
+    {
+        LogError("This command can't be run by the daemon.");
         return EXIT_FAILURE;
     }
 
-    // Case of using ModuleLoader by just providing a module path
-    if (argv[1][0] != '-')
-        return UnloadThenLoad(argv[1]);
+    hr = ValidateCommand(numberOfArguments, arguments);
+    if (FAILED(hr))
+        return EXIT_FAILURE;
 
-    // Cases of using ModuleLoader with a flag
+    double startTime = GetTimeInMilliseconds();
+
+    if (options.TraceFilePath != NULL)
+        StartTrace();
+
+    RpcTarget daemonRpcTarget = pSession->DefaultRpcTarget;
+    BOOL daemonAddressCalls = pSession->UseAddressCalls;
+    pSession->DefaultRpcTarget = options.RpcTarget;
+    pSession->UseAddressCalls = daemonAddressCalls || options.AddressCalls;
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "Command", arguments[0]);
+    int exitCode = RunCommand(pSession, &options, numberOfArguments, arguments);
+    EndTraceSpan(&span, 0, 0);
+
+    pSession->DefaultRpcTarget = daemonRpcTarget;
+    pSession->UseAddressCalls = daemonAddressCalls;
+
+    if (options.TraceFilePath != NULL)
+        WriteTrace(options.TraceFilePath);
+
+    if (options.StatsFilePath != NULL)
+        WriteStats(options.StatsFilePath, numberOfArguments, arguments, &pSession->Stats, GetTimeInMilliseconds() - startTime, exitCode);
+
+    return exitCode;
+}
+
+int main(int argc, char **argv)
+{
+    Options options = { 0 };
+    InitializeOptions(&options);
+    char *arguments[MAX_ARGUMENTS] = { 0 };
+    size_t numberOfArguments = 0;
+    HRESULT hr = ParseOptions(argc, argv, &options, arguments, &numberOfArguments);
+    if (FAILED(hr))
+        return EXIT_FAILURE;
+
+    // Case of using ModuleLoader without providing any arguments
+    if (numberOfArguments == 0)
+    {
+        ShowUsage();
+        return EXIT_SUCCESS;
+    }
+
+    // Reject invalid commands before connecting to the console, or to the daemon
+    hr = ValidateCommand(numberOfArguments, arguments);
+    if (FAILED(hr))
+        return EXIT_FAILURE;
 
     // Usage
-    if (!strcmp(argv[1], "-h"))
+    if (!strcmp(arguments[0], "-h"))
     {
         ShowUsage();
         return EXIT_SUCCESS;
     }
 
-    // Module list
-    if (!strcmp(argv[1], "-s"))
-        return ShowLoadedModules(FALSE);
-    if (!strcmp(argv[1], "-S"))
-        return ShowLoadedModules(TRUE);
+    // Inspecting a local file doesn't need a console
+    if (!strcmp(arguments[0], "-i"))
+        return InspectModule(arguments[1]);
 
-    // Loading
-    if (!strcmp(argv[1], "-l"))
+    // Let the daemon run the command if it's running, it already has everything set up
+    if (CanRunInDaemon(&options, arguments))
     {
-        if (numberOfArguments < 2)
-        {
-            LogError("You need to specify an absolute module path. ModuleLoader -h to see the usage.");
+        int exitCode = EXIT_FAILURE;
+        hr = SendCommandToDaemon(argc, argv, &exitCode);
+        if (hr == S_OK)
+            return exitCode;
+
+        if (FAILED(hr))
             return EXIT_FAILURE;
-        }
+    }
+
+    // Add the XDK bin directory to the path to successfully delay load xbdm.dll
+    hr = AddXdkBinDirToPath();
+    if (FAILED(hr))
+        return EXIT_FAILURE;
 
-        return Load(argv[2]);
+    // Run the command on several consoles at once
+    if (options.ConsoleList != NULL || options.AllConsoles)
+    {
+        if (options.TraceFilePath != NULL)
+            LogInfo("--trace is ignored when running on several consoles, use --console to trace one of them.");
+
+        return RunCommandOnConsoles(argc, argv, &options);
     }
 
-    // Unloading
-    if (!strcmp(argv[1], "-u"))
+    double startTime = GetTimeInMilliseconds();
+
+    // Started before the session is opened so that connecting to the console is part of the trace
+    if (options.TraceFilePath != NULL)
+        StartTrace();
+
+    // Open a single XBDM session that all the operations of the command will reuse
+    Session session = { 0 };
+    hr = OpenSession(&session, options.ConsoleName);
+    if (FAILED(hr))
     {
-        if (numberOfArguments < 2)
-        {
-            LogError("You need to specify a module name. ModuleLoader -h to see the usage.");
-            return EXIT_FAILURE;
-        }
+        if (options.TraceFilePath != NULL)
+            WriteTrace(options.TraceFilePath);
 
-        return Unload(argv[2]);
+        return EXIT_FAILURE;
     }
 
-    // Invalid flag
-    LogError("%s is not a valid argument. ModuleLoader -h to see the usage.", argv[1]);
+    session.DefaultRpcTarget = options.RpcTarget;
+    session.UseAddressCalls = options.AddressCalls;
 
-    return EXIT_FAILURE;
+    // Keep the session open and run the commands sent by other ModuleLoader processes
+    if (!strcmp(arguments[0], "--daemon"))
+    {
+        hr = RunDaemon(&session, RunDaemonCommand);
+        CloseSession(&session);
+
+        return SUCCEEDED(hr) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    TraceSpan span;
+    BeginTraceSpan(&span, TRACE_STEP, "Command", arguments[0]);
+    int exitCode = RunCommand(&session, &options, numberOfArguments, arguments);
+    EndTraceSpan(&span, 0, 0);
+
+    CloseSession(&session);
+
+    if (options.TraceFilePath != NULL)
+        WriteTrace(options.TraceFilePath);
+
+    if (options.StatsFilePath != NULL)
+        WriteStats(options.StatsFilePath, numberOfArguments, arguments, &session.Stats, GetTimeInMilliseconds() - startTime, exitCode);
+
+    return exitCode;
 }
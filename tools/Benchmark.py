@@ -0,0 +1,219 @@
+"""Runs ModuleLoader commands many times against MockConsole.py and reports their latency percentiles.
+
+Every iteration of an operation runs ModuleLoader.exe --console 127.0.0.1 --stats with the commands of the operation
+and records the wall clock time of the processes, the time ModuleLoader measured itself and its round trips and bytes
+from --stats, along with the connections, round trips and bytes the mock console saw. The round trip time and the
+bandwidth of the mock console can be set to model a real network. Needs Windows with the XDK installed and port 730
+to be free.
+
+The results are printed as a table and written as JSON with --output:
+
+{
+    "config": { "iterations": 1000, "rtt_ms": 1.5, "bandwidth_mbps": 100, "moduleloader": "..." },
+    "operations": {
+        "reload": {
+            "iterations": 1000,
+            "wall_ms": { "min": ..., "mean": ..., "p50": ..., "p95": ..., "p99": ..., "max": ... },
+            "moduleloader_ms": { ... },
+            "round_trips": { ... }, "bytes_sent": { ... }, "bytes_received": { ... },
+            "console_connections": { ... }, "console_round_trips": { ... },
+            "failures": 0
+        }
+    }
+}
+
+Usage: python Benchmark.py [--moduleloader <path>] [--iterations <count>] [--rtt-ms <ms>] [--bandwidth-mbps <mbps>]
+                           [--operation <name>]... [--output <file>]
+"""
+
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from MockConsole import Console, MockServer, build_xex
+
+DEFAULT_MODULELOADER_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "build", "Release", "bin", "ModuleLoader.exe")
+
+PLUGIN_PATH = "hdd:\\Plugins\\Plugin.xex"
+PLUGIN_NAME = "Plugin.xex"
+
+SCENARIO = {
+    "name": "MockConsole",
+    "type": "devkit",
+    "modules": [
+        { "name": "xboxkrnl.exe", "base": "0x80040000", "size": "0x200000", "checksum": "0x1", "timestamp": "0x2" },
+        { "name": "xam.xex", "base": "0x81A00000", "size": "0x100000", "checksum": "0x3", "timestamp": "0x4" },
+    ],
+}
+
+# Modules reloaded together by the manifest-reload operation, their handles are looked up in a single batch
+MANIFEST_MODULE_PATHS = [f"hdd:\\Plugins\\Batch{i}.xex" for i in range(8)]
+
+# The commands run by one iteration of each operation, and the ones run once before the first iteration to put the
+# console in the right state (their exit codes are ignored). {manifest} is replaced with the path of a manifest listing
+# MANIFEST_MODULE_PATHS.
+OPERATIONS = {
+    "list": { "setup": [], "commands": [["-s"]] },
+    "load-unload": { "setup": [["-u", PLUGIN_NAME]], "commands": [["-l", PLUGIN_PATH], ["-u", PLUGIN_NAME]] },
+    "reload": { "setup": [["-l", PLUGIN_PATH]], "commands": [[PLUGIN_PATH]] },
+    "manifest-reload": { "setup": [["-m", "{manifest}"]], "commands": [["--force", "-m", "{manifest}"]] },
+}
+
+METRICS = ("wall_ms", "moduleloader_ms", "round_trips", "bytes_sent", "bytes_received", "console_connections", "console_round_trips")
+
+
+def percentile(sorted_values, fraction):
+    # Nearest rank, so that the value was actually measured
+    index = max(0, math.ceil(fraction * len(sorted_values)) - 1)
+    return sorted_values[index]
+
+
+def summarize(values):
+    if not values:
+        return {}
+
+    sorted_values = sorted(values)
+
+    return {
+        "min": sorted_values[0],
+        "mean": sum(sorted_values) / len(sorted_values),
+        "p50": percentile(sorted_values, 0.50),
+        "p95": percentile(sorted_values, 0.95),
+        "p99": percentile(sorted_values, 0.99),
+        "max": sorted_values[-1],
+    }
+
+
+class Benchmark:
+    def __init__(self, moduleloader_path, console, stats_path, manifest_path):
+        self.moduleloader_path = moduleloader_path
+        self.console = console
+        self.stats_path = stats_path
+        self.manifest_path = manifest_path
+
+    def run_command(self, arguments):
+        arguments = [argument.replace("{manifest}", self.manifest_path) for argument in arguments]
+        process = subprocess.run(
+            [self.moduleloader_path, "--console", "127.0.0.1", "--stats", self.stats_path, *arguments],
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            timeout=60,
+        )
+
+        return process.returncode
+
+    def read_stats(self):
+        # ModuleLoader appends one line per command to the stats file
+        if not os.path.exists(self.stats_path):
+            return []
+
+        with open(self.stats_path, "r") as file:
+            lines = file.readlines()
+
+        open(self.stats_path, "w").close()
+
+        return [json.loads(line) for line in lines if line.strip()]
+
+    def run_operation(self, operation, iterations):
+        for command in operation["setup"]:
+            self.run_command(command)
+
+        self.read_stats()
+        self.console.take_counters()
+
+        samples = { metric: [] for metric in METRICS }
+        failures = 0
+
+        for _ in range(iterations):
+            start = time.perf_counter()
+            exit_codes = [self.run_command(command) for command in operation["commands"]]
+            elapsed = (time.perf_counter() - start) * 1000.0
+
+            stats = self.read_stats()
+            counters = self.console.take_counters()
+
+            if any(exit_code != 0 for exit_code in exit_codes) or len(stats) != len(operation["commands"]):
+                failures += 1
+                continue
+
+            samples["wall_ms"].append(elapsed)
+            samples["moduleloader_ms"].append(sum(line["elapsed_ms"] for line in stats))
+            samples["round_trips"].append(sum(line["round_trips"] for line in stats))
+            samples["bytes_sent"].append(sum(line["bytes_sent"] for line in stats))
+            samples["bytes_received"].append(sum(line["bytes_received"] for line in stats))
+            samples["console_connections"].append(counters.connections)
+            samples["console_round_trips"].append(counters.round_trips)
+
+        result = { "iterations": iterations, "failures": failures }
+        for metric in METRICS:
+            result[metric] = summarize(samples[metric])
+
+        return result
+
+
+def print_results(results):
+    print(f"{'operation':<16} {'metric':<20} {'p50':>10} {'p95':>10} {'p99':>10} {'mean':>10}")
+    for name, result in results.items():
+        for metric in METRICS:
+            summary = result[metric]
+            if not summary:
+                continue
+
+            print(f"{name:<16} {metric:<20} {summary['p50']:>10.2f} {summary['p95']:>10.2f} {summary['p99']:>10.2f} {summary['mean']:>10.2f}")
+
+        if result["failures"] > 0:
+            print(f"{name:<16} {result['failures']} failed iteration(s)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure ModuleLoader commands against the mock console.")
+    parser.add_argument("--moduleloader", default=DEFAULT_MODULELOADER_PATH, help="path to ModuleLoader.exe")
+    parser.add_argument("--iterations", type=int, default=1000, help="number of times each operation is run")
+    parser.add_argument("--rtt-ms", type=float, default=0.0, help="round trip time added to every response of the console")
+    parser.add_argument("--bandwidth-mbps", type=float, default=0.0, help="bandwidth of the console, 0 for no limit")
+    parser.add_argument("--operation", action="append", choices=sorted(OPERATIONS), help="operation to run, all of them by default")
+    parser.add_argument("--output", help="JSON file to write the results to")
+    arguments = parser.parse_args()
+
+    scenario = dict(SCENARIO, latency_ms=arguments.rtt_ms, bandwidth_mbps=arguments.bandwidth_mbps)
+    console = Console(scenario, quiet=True)
+    console.files[PLUGIN_PATH.lower()] = bytearray(build_xex(0x1234, 0x5678))
+    for i, path in enumerate(MANIFEST_MODULE_PATHS):
+        console.files[path.lower()] = bytearray(build_xex(0x1000 + i, 0x5678))
+    server = MockServer(console).start()
+
+    results = {}
+    with tempfile.TemporaryDirectory() as directory:
+        manifest_path = os.path.join(directory, "manifest.txt")
+        with open(manifest_path, "w") as file:
+            file.write("\n".join(MANIFEST_MODULE_PATHS) + "\n")
+
+        benchmark = Benchmark(arguments.moduleloader, console, os.path.join(directory, "stats.jsonl"), manifest_path)
+        try:
+            for name in arguments.operation or OPERATIONS:
+                results[name] = benchmark.run_operation(OPERATIONS[name], arguments.iterations)
+        finally:
+            server.stop()
+
+    print_results(results)
+
+    if arguments.output is not None:
+        config = {
+            "iterations": arguments.iterations,
+            "rtt_ms": arguments.rtt_ms,
+            "bandwidth_mbps": arguments.bandwidth_mbps,
+            "moduleloader": os.path.abspath(arguments.moduleloader),
+        }
+        with open(arguments.output, "w") as file:
+            json.dump({ "config": config, "operations": results }, file, indent=4)
+
+    return 1 if any(result["failures"] > 0 for result in results.values()) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
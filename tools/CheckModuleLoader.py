@@ -0,0 +1,167 @@
+"""Runs ModuleLoader against MockConsole.py and checks what it did to the console.
+
+Each check runs ModuleLoader.exe --console 127.0.0.1 with a command, then looks at its exit code, its output and the
+module list of the mock console. Needs Windows with the XDK installed and port 730 to be free.
+
+Usage: python CheckModuleLoader.py [--moduleloader <path to ModuleLoader.exe>]
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+from MockConsole import Console, MockServer, build_xex
+
+DEFAULT_MODULELOADER_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "build", "Release", "bin", "ModuleLoader.exe")
+
+PLUGIN_PATH = "hdd:\\Plugins\\Plugin.xex"
+PLUGIN_CHECKSUM = 0x1234
+PLUGIN_TIMESTAMP = 0x5678
+
+HELPER_PATH = "hdd:\\ModuleLoaderHelper.xex"
+HELPER_FUNCTION = "moduleloaderhelper.xex@1"
+LOAD_FUNCTION = "xboxkrnl.exe@409"
+UNLOAD_FUNCTION = "xboxkrnl.exe@417"
+
+SCENARIO = {
+    "name": "MockConsole",
+    "type": "devkit",
+    "modules": [
+        { "name": "xboxkrnl.exe", "base": "0x80040000", "size": "0x200000", "checksum": "0x1", "timestamp": "0x2" },
+        { "name": "xam.xex", "base": "0x81A00000", "size": "0x100000", "checksum": "0x3", "timestamp": "0x4" },
+    ],
+}
+
+
+class Checker:
+    def __init__(self, moduleloader_path, console):
+        self.moduleloader_path = moduleloader_path
+        self.console = console
+        self.number_of_failures = 0
+
+    def run(self, *arguments):
+        self.console.take_counters()
+        process = subprocess.run(
+            [self.moduleloader_path, "--console", "127.0.0.1", *arguments],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,
+            text=True,
+            timeout=60,
+        )
+
+        return process.returncode, process.stdout, self.console.take_counters()
+
+    def check(self, name, condition, output):
+        print(f"{'PASS' if condition else 'FAIL'} {name}")
+        if not condition:
+            self.number_of_failures += 1
+            print("    " + output.strip().replace("\n", "\n    "))
+
+    def is_loaded(self, name):
+        with self.console.lock:
+            return self.console.find_module(name=name) is not None
+
+
+def run_checks(checker, stats_path):
+    exit_code, output, counters = checker.run("-q")
+    checker.check("an invalid flag fails without connecting to the console", exit_code != 0 and counters.connections == 0, output)
+
+    exit_code, output, counters = checker.run("-l")
+    checker.check("-l without a module path fails without connecting to the console", exit_code != 0 and counters.connections == 0, output)
+
+    exit_code, output, counters = checker.run("-l", PLUGIN_PATH, "b", "c")
+    checker.check("-l with extra arguments fails without connecting to the console", exit_code != 0 and counters.connections == 0, output)
+
+    exit_code, output, _ = checker.run("-s")
+    checker.check("-s lists the loaded modules", exit_code == 0 and "xam.xex" in output and "xboxkrnl.exe" in output, output)
+
+    exit_code, output, _ = checker.run("-l", PLUGIN_PATH)
+    checker.check("-l loads the module", exit_code == 0 and checker.is_loaded("Plugin.xex"), output)
+
+    exit_code, output, _ = checker.run("-l", PLUGIN_PATH)
+    checker.check("-l fails when the module is already loaded", exit_code != 0, output)
+
+    exit_code, output, _ = checker.run("-S")
+    checker.check("-S shows the checksum read from the XEX header", exit_code == 0 and f"0x{PLUGIN_CHECKSUM:X}" in output, output)
+
+    exit_code, output, _ = checker.run("-u", "Plugin.xex")
+    checker.check("-u unloads the module", exit_code == 0 and not checker.is_loaded("Plugin.xex"), output)
+
+    exit_code, output, _ = checker.run("-u", "Plugin.xex")
+    checker.check("-u fails when the module is not loaded", exit_code != 0, output)
+
+    exit_code, output, _ = checker.run("-l", "hdd:\\Plugins\\Missing.xex")
+    checker.check("-l fails when the file doesn't exist", exit_code != 0 and not checker.is_loaded("Missing.xex"), output)
+
+    exit_code, output, _ = checker.run(PLUGIN_PATH)
+    exit_code_reload, output_reload, _ = checker.run(PLUGIN_PATH)
+    checker.check("<module_path> loads then reloads the module", exit_code == 0 and exit_code_reload == 0 and checker.is_loaded("Plugin.xex"), output + output_reload)
+
+    exit_code, output, _ = checker.run("-l", HELPER_PATH)
+    checker.check("-l loads the module helper", exit_code == 0 and checker.is_loaded("ModuleLoaderHelper.xex"), output)
+
+    exit_code, output, counters = checker.run("--force", PLUGIN_PATH)
+    checker.check(
+        "<module_path> reloads the module in a single RPC to the module helper",
+        exit_code == 0
+        and checker.is_loaded("Plugin.xex")
+        and counters.rpc_calls.get(HELPER_FUNCTION) == 1
+        and LOAD_FUNCTION not in counters.rpc_calls
+        and UNLOAD_FUNCTION not in counters.rpc_calls,
+        output + f"\nconsole: {counters.to_dict()}",
+    )
+
+    exit_code, output, counters = checker.run("-u", "Plugin.xex")
+    checker.check(
+        "-u unloads the module with the module helper",
+        exit_code == 0 and not checker.is_loaded("Plugin.xex") and counters.rpc_calls.get(HELPER_FUNCTION) == 1,
+        output + f"\nconsole: {counters.to_dict()}",
+    )
+
+    exit_code, output, counters = checker.run("-u", "ModuleLoaderHelper.xex")
+    checker.check(
+        "-u unloads the module helper itself without the module helper",
+        exit_code == 0 and not checker.is_loaded("ModuleLoaderHelper.xex") and HELPER_FUNCTION not in counters.rpc_calls,
+        output + f"\nconsole: {counters.to_dict()}",
+    )
+
+    exit_code, output, counters = checker.run("--stats", stats_path, "-s")
+    with open(stats_path, "r") as file:
+        stats = json.loads(file.readlines()[-1])
+    checker.check(
+        "--stats writes the round trips of the command",
+        exit_code == 0 and stats["exit_code"] == 0 and stats["round_trips"] > 0 and counters.round_trips > 0,
+        output + json.dumps(stats) + f"\nconsole: {counters.to_dict()}",
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run ModuleLoader against the mock console and check the results.")
+    parser.add_argument("--moduleloader", default=DEFAULT_MODULELOADER_PATH, help="path to ModuleLoader.exe")
+    arguments = parser.parse_args()
+
+    console = Console(SCENARIO, quiet=True)
+    console.files[PLUGIN_PATH.lower()] = bytearray(build_xex(PLUGIN_CHECKSUM, PLUGIN_TIMESTAMP))
+    console.files[HELPER_PATH.lower()] = bytearray(build_xex(0x4321, 0x8765))
+    server = MockServer(console).start()
+
+    with tempfile.TemporaryDirectory() as directory:
+        checker = Checker(arguments.moduleloader, console)
+        try:
+            run_checks(checker, os.path.join(directory, "stats.jsonl"))
+        finally:
+            server.stop()
+
+    if checker.number_of_failures > 0:
+        print(f"{checker.number_of_failures} check(s) failed.")
+        return 1
+
+    print("All the checks passed.")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
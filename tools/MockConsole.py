@@ -0,0 +1,716 @@
+"""Minimal XBDM console to run ModuleLoader against without an Xbox 360.
+
+Listens on the XBDM port and answers the text protocol xbdm.dll speaks for the commands ModuleLoader uses (dbgname,
+consoletype, modules, getfileattributes, getfile, sendfile, writefile, mkdir, delete, setmem, getmem2, rpc, notify
+and notifyat). Loading and unloading modules through XDRPC (XexLoadImage, XexUnloadImage, XGetModuleHandleA,
+XexGetModuleHandle and XexGetProcedureAddress) updates the module list and sends modload/modunload notifications, so
+whole reloads can be run and measured with --stats or --trace. XeCryptSha hashes the memory of the console, for -x to
+only read the chunks that differ. Once a module named ModuleLoaderHelper.xex is loaded, its ordinal 1 runs module
+operation scripts (see ModuleScript.c) the way the helper does, so reloads done in a single RPC can be checked too.
+
+Every command is printed with the time it took (unless --quiet is used), and the connections, round trips and bytes
+are summed up when the server stops. Unknown commands are answered with "200- OK" and printed as unknown.
+
+The console is described by an optional JSON scenario, everything in it is optional:
+
+{
+    "name": "MockConsole",
+    "type": "devkit",                          (devkit, testkit or reviewerkit, reviewer kits send 16 bytes before
+                                                the RPC buffer instead of 8)
+    "latency_ms": 1.5,                         (added before every response, to simulate the round trip time)
+    "bandwidth_mbps": 100,                     (megabits per second, limits how fast data is sent and received)
+    "modules": [
+        { "name": "xam.xex", "base": "0x81A00000", "size": "0x100000", "checksum": "0x1", "timestamp": "0x2" }
+    ],
+    "memory": [ { "address": "0x82000000", "file": "dump.bin" }, { "address": "0x82100000", "hex": "60000000" } ],
+    "files": { "hdd:\\\\Plugins\\\\Plugin.xex": "Plugin.xex" },
+    "rpc": { "xboxkrnl.exe@409": { "delay_ms": 150, "return": "0x0" } }   (by module name and ordinal, or by
+                                                                           "0x<address>" for calls by address)
+}
+
+The addresses returned by XexGetProcedureAddress are remembered, so an RPC sent with one of them runs the same
+function as an RPC sent with its module name and ordinal.
+
+Point ModuleLoader at it with --console 127.0.0.1, xbdm.dll always connects to port 730. The server can also be
+started from another script with MockServer, see CheckModuleLoader.py.
+
+Usage: python MockConsole.py [--scenario <file>] [--address <address>] [--port <port>] [--quiet]
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import socket
+import struct
+import threading
+import time
+
+XBDM_PORT = 730
+
+RPC_BUFFER_ADDRESS = 0x91F00000
+RPC_HEADER_SIZE = 0x40
+
+# Where the modules loaded through XexLoadImage are placed, one after the other
+LOADED_MODULE_BASE = 0x91000000
+LOADED_MODULE_SIZE = 0x100000
+
+# Handles given to the loaded modules, they only need to be unique and non-zero
+MODULE_HANDLE_BASE = 0x80010000
+
+# Addresses given out by XexGetProcedureAddress, they only need to be unique and non-zero
+PROCEDURE_ADDRESS_BASE = 0x81000000
+
+XEX_MAGIC = b"XEX2"
+XEX_HEADER_CHECKSUM_TIMESTAMP = 0x00018002
+
+STATUS_INVALID_PARAMETER = 0xC000000D
+STATUS_DLL_NOT_FOUND = 0xC0000135
+STATUS_NOT_FOUND = 0xC0000225
+
+# The helper module that runs module operation scripts, see ModuleScript.c for the encoding
+MODULE_HELPER_FUNCTION = "moduleloaderhelper.xex@1"
+MODULE_SCRIPT_MAGIC = 0x4D4C5343
+MODULE_SCRIPT_VERSION = 1
+MODULE_OPERATION_GET_HANDLE = 1
+MODULE_OPERATION_SET_LOAD_COUNT = 2
+MODULE_OPERATION_UNLOAD = 3
+MODULE_OPERATION_LOAD = 4
+
+
+def parse_int(value):
+    return int(value, 0) if isinstance(value, str) else int(value)
+
+
+def parse_parameters(line):
+    # name="value with spaces" key=0x10 flag
+    parameters = {}
+    for match in re.finditer(r'(\w+)(?:=("(?:[^"]*)"|\S*))?', line):
+        value = match.group(2)
+        if value is not None and value.startswith('"'):
+            value = value[1:-1]
+        parameters[match.group(1).lower()] = value
+
+    return parameters
+
+
+def read_checksum_timestamp(data):
+    # Same lookup as XexFindOptionalHeader, the optional header count is at 0x14 and the headers start at 0x18
+    if len(data) < 0x18 or data[:4] != XEX_MAGIC:
+        return 0, 0
+
+    (count,) = struct.unpack_from(">I", data, 0x14)
+    for i in range(min(count, (len(data) - 0x18) // 8)):
+        key, value = struct.unpack_from(">II", data, 0x18 + i * 8)
+        if key == XEX_HEADER_CHECKSUM_TIMESTAMP and value + 8 <= len(data):
+            return struct.unpack_from(">II", data, value)
+
+    return 0, 0
+
+
+def build_xex(checksum, timestamp):
+    # Smallest file read_checksum_timestamp accepts, the header of an XEX file with a single optional header
+    data = bytearray(0x30)
+    data[:4] = XEX_MAGIC
+    struct.pack_into(">I", data, 0x14, 1)
+    struct.pack_into(">II", data, 0x18, XEX_HEADER_CHECKSUM_TIMESTAMP, 0x20)
+    struct.pack_into(">II", data, 0x20, checksum, timestamp)
+
+    return bytes(data)
+
+
+def format_module(module):
+    return (
+        f'name="{module["name"]}" base=0x{module["base"]:08x} size=0x{module["size"]:08x} '
+        f'check=0x{module["checksum"]:08x} timestamp=0x{module["timestamp"]:08x} '
+        f'pdata=0x00000000 psize=0x00000000 thread=0x00000000 osize=0x{module["size"]:08x}'
+    )
+
+
+class Counters:
+    def __init__(self):
+        self.connections = 0
+        self.round_trips = 0
+        self.bytes_received = 0
+        self.bytes_sent = 0
+
+        # Number of RPCs by function, "<module>@<ordinal>" or the address for unknown calls by address
+        self.rpc_calls = {}
+
+    def to_dict(self):
+        return dict(self.__dict__)
+
+
+class Console:
+    def __init__(self, scenario=None, base_directory=None, quiet=False):
+        scenario = scenario or {}
+        base_directory = base_directory or os.getcwd()
+
+        self.lock = threading.RLock()
+        self.quiet = quiet
+        self.name = scenario.get("name", "MockConsole")
+        self.type = scenario.get("type", "devkit")
+        self.latency = float(scenario.get("latency_ms", 0)) / 1000.0
+        self.rpc = scenario.get("rpc", {})
+
+        # Bytes per second, 0 for no limit
+        self.bandwidth = float(scenario.get("bandwidth_mbps", 0)) * 1000 * 1000 / 8
+
+        self.modules = []
+        for module in scenario.get("modules", []):
+            self.modules.append(
+                {
+                    "name": module["name"],
+                    "base": parse_int(module.get("base", 0)),
+                    "size": parse_int(module.get("size", 0)),
+                    "checksum": parse_int(module.get("checksum", 0)),
+                    "timestamp": parse_int(module.get("timestamp", 0)),
+                    "handle": MODULE_HANDLE_BASE + len(self.modules) * 0x100,
+                }
+            )
+
+        self.memory = {}
+        for region in scenario.get("memory", []):
+            if "file" in region:
+                with open(os.path.join(base_directory, region["file"]), "rb") as file:
+                    data = file.read()
+            else:
+                data = bytes.fromhex(region.get("hex", ""))
+            self.write_memory(parse_int(region["address"]), data)
+
+        self.files = {}
+        for remote_path, local_path in scenario.get("files", {}).items():
+            with open(os.path.join(base_directory, local_path), "rb") as file:
+                self.files[remote_path.lower()] = bytearray(file.read())
+
+        self.next_module_base = LOADED_MODULE_BASE
+        self.next_handle = MODULE_HANDLE_BASE + 0x10000
+
+        # "0x<address>" -> "<module>@<ordinal>" for the addresses given out by XexGetProcedureAddress
+        self.procedures = {}
+
+        self.notification_channels = []
+        self.counters = Counters()
+
+    def log(self, message):
+        if not self.quiet:
+            print(f"[MockConsole] {message}", flush=True)
+
+    def take_counters(self):
+        # Returns the counters since the last call, to measure a single command
+        with self.lock:
+            counters = self.counters
+            self.counters = Counters()
+
+        return counters
+
+    # Memory is sparse, stored by 4KB pages
+    def write_memory(self, address, data):
+        for offset, byte in enumerate(data):
+            page, index = divmod(address + offset, 0x1000)
+            self.memory.setdefault(page, bytearray(0x1000))[index] = byte
+
+    def read_memory(self, address, size):
+        data = bytearray(size)
+        for offset in range(size):
+            page, index = divmod(address + offset, 0x1000)
+            if page in self.memory:
+                data[offset] = self.memory[page][index]
+
+        return bytes(data)
+
+    def find_module(self, name=None, handle=None):
+        for module in self.modules:
+            if (name is not None and module["name"].lower() == name.lower()) or (handle is not None and module["handle"] == handle):
+                return module
+
+        return None
+
+    def notify(self, line):
+        with self.lock:
+            channels = list(self.notification_channels)
+
+        for channel in channels:
+            try:
+                channel.sendall(line.encode("latin-1") + b"\r\n")
+            except OSError:
+                with self.lock:
+                    if channel in self.notification_channels:
+                        self.notification_channels.remove(channel)
+
+
+class Connection:
+    def __init__(self, console, client, address):
+        self.console = console
+        self.client = client
+        self.address = address
+        self.buffer = b""
+        self.is_notification_channel = False
+
+    def throttle(self, size):
+        if self.console.bandwidth > 0:
+            time.sleep(size / self.console.bandwidth)
+
+    def count(self, bytes_sent=0, bytes_received=0):
+        with self.console.lock:
+            self.console.counters.bytes_sent += bytes_sent
+            self.console.counters.bytes_received += bytes_received
+
+    def send(self, data):
+        self.throttle(len(data))
+        self.client.sendall(data)
+        self.count(bytes_sent=len(data))
+
+    def send_line(self, line):
+        self.send(line.encode("latin-1") + b"\r\n")
+
+    def receive_line(self):
+        while b"\r\n" not in self.buffer:
+            data = self.client.recv(0x10000)
+            if not data:
+                return None
+            self.buffer += data
+
+        line, self.buffer = self.buffer.split(b"\r\n", 1)
+        self.count(bytes_received=len(line) + 2)
+
+        return line.decode("latin-1")
+
+    def receive_binary(self, size):
+        while len(self.buffer) < size:
+            data = self.client.recv(0x10000)
+            if not data:
+                raise ConnectionError("connection closed while receiving binary data")
+            self.buffer += data
+
+        data, self.buffer = self.buffer[:size], self.buffer[size:]
+        self.throttle(size)
+        self.count(bytes_received=size)
+
+        return data
+
+    def run(self):
+        with self.console.lock:
+            self.console.counters.connections += 1
+
+        self.send_line("201- connected")
+
+        while not self.is_notification_channel:
+            line = self.receive_line()
+            if line is None:
+                return
+
+            start_time = time.perf_counter()
+            if self.console.latency > 0:
+                time.sleep(self.console.latency)
+
+            command = line.split(" ", 1)[0].lower()
+            handler = getattr(self, "on_" + command, None)
+            if handler is None:
+                self.console.log(f"unknown command: {line}")
+                self.send_line("200- OK")
+            else:
+                handler(parse_parameters(line))
+
+            with self.console.lock:
+                self.console.counters.round_trips += 1
+
+            self.console.log(f"{(time.perf_counter() - start_time) * 1000:8.3f}ms {line}")
+
+            if command == "bye":
+                return
+
+        # The connection now only carries notifications, it's kept open until the PC closes it
+        while self.client.recv(0x1000):
+            pass
+
+    def on_bye(self, parameters):
+        self.send_line("200- bye")
+
+    def on_dbgname(self, parameters):
+        self.send_line(f"200- {self.console.name}")
+
+    def on_consoletype(self, parameters):
+        self.send_line(f"200- {self.console.type}")
+
+    def on_notify(self, parameters):
+        # The connection becomes a notification channel
+        self.send_line("205- now a notification channel")
+        self.is_notification_channel = True
+        with self.console.lock:
+            self.console.notification_channels.append(self.client)
+
+    def on_notifyat(self, parameters):
+        port = parse_int(parameters.get("port") or "0")
+        address = parameters.get("addr") or self.address[0]
+        if "drop" in parameters:
+            self.send_line("200- OK")
+            return
+
+        # The console connects back to the PC and sends the notifications on that connection
+        try:
+            channel = socket.create_connection((address, port), timeout=5)
+        except OSError:
+            self.send_line("402- could not connect")
+            return
+
+        channel.settimeout(None)
+        with self.console.lock:
+            self.console.notification_channels.append(channel)
+        self.send_line("200- OK")
+
+    def on_modules(self, parameters):
+        self.send_line("202- multiline response follows")
+        with self.console.lock:
+            for module in self.console.modules:
+                self.send_line(format_module(module))
+        self.send_line(".")
+
+    def on_getfileattributes(self, parameters):
+        data = self.console.files.get((parameters.get("name") or "").lower())
+        if data is None:
+            self.send_line("402- file not found")
+            return
+
+        self.send_line("202- multiline response follows")
+        self.send_line(f"sizehi=0x0 sizelo=0x{len(data):08x} createhi=0x0 createlo=0x0 changehi=0x0 changelo=0x0")
+        self.send_line(".")
+
+    def on_getfile(self, parameters):
+        data = self.console.files.get((parameters.get("name") or "").lower())
+        if data is None:
+            self.send_line("402- file not found")
+            return
+
+        offset = parse_int(parameters.get("offset") or "0")
+        size = parse_int(parameters.get("size") or str(len(data)))
+        part = bytes(data[offset : offset + size])
+
+        self.send_line("203- binary response follows")
+        self.send(struct.pack("<I", len(part)) + part)
+
+    def on_sendfile(self, parameters):
+        length = parse_int(parameters.get("length") or "0")
+        self.send_line("204- send binary data")
+        self.console.files[(parameters.get("name") or "").lower()] = bytearray(self.receive_binary(length))
+        self.send_line("200- OK")
+
+    def on_writefile(self, parameters):
+        name = (parameters.get("name") or "").lower()
+        offset = parse_int(parameters.get("offset") or "0")
+        length = parse_int(parameters.get("length") or "0")
+
+        self.send_line("204- send binary data")
+        data = self.receive_binary(length)
+
+        file = self.console.files.setdefault(name, bytearray())
+        if len(file) < offset + length:
+            file.extend(bytes(offset + length - len(file)))
+        file[offset : offset + length] = data
+
+        self.send_line(f"200- set {length} bytes")
+
+    def on_mkdir(self, parameters):
+        self.send_line("200- OK")
+
+    def on_delete(self, parameters):
+        self.console.files.pop((parameters.get("name") or "").lower(), None)
+        self.send_line("200- OK")
+
+    def on_setmem(self, parameters):
+        data = bytes.fromhex(parameters.get("data") or "")
+        with self.console.lock:
+            self.console.write_memory(parse_int(parameters.get("addr") or "0"), data)
+        self.send_line(f"200- set {len(data)} bytes")
+
+    def on_getmem2(self, parameters):
+        address = parse_int(parameters.get("addr") or "0")
+        length = parse_int(parameters.get("length") or "0")
+        with self.console.lock:
+            data = self.console.read_memory(address, length)
+
+        self.send_line("203- binary response follows")
+        self.send(data)
+
+    def on_rpc(self, parameters):
+        buffer_size = parse_int(parameters.get("buf_size") or "0")
+        self.send_line(f"204- buf_addr={RPC_BUFFER_ADDRESS:x}")
+        buffer = bytearray(self.receive_binary(buffer_size))
+
+        return_value = self.run_function(buffer)
+        struct.pack_into(">Q", buffer, 8, return_value & 0xFFFFFFFFFFFFFFFF)
+
+        self.send_line("200- rpc done")
+        unknown_packet_size = 16 if self.console.type == "reviewerkit" else 8
+        self.send(bytes(unknown_packet_size) + bytes(buffer))
+
+    def run_function(self, buffer):
+        (number_of_args,) = struct.unpack_from(">Q", buffer, 0x20)
+        function_address, module_name_address, ordinal = struct.unpack_from(">QQQ", buffer, 0x28)
+        args = [struct.unpack_from(">Q", buffer, RPC_HEADER_SIZE + i * 8)[0] for i in range(number_of_args)]
+        memory = RpcMemory(self.console, buffer)
+
+        if module_name_address != 0:
+            function = f"{memory.read_string(module_name_address).lower()}@{ordinal}"
+        else:
+            function = f"0x{function_address:08x}"
+
+        behavior = self.console.rpc.get(function, {})
+
+        # Calls by address run the function the address was given out for
+        with self.console.lock:
+            function = self.console.procedures.get(function, function)
+            self.console.counters.rpc_calls[function] = self.console.counters.rpc_calls.get(function, 0) + 1
+
+        behavior = self.console.rpc.get(function, behavior)
+        if "delay_ms" in behavior:
+            time.sleep(float(behavior["delay_ms"]) / 1000.0)
+
+        return_value = self.run_known_function(function, args, memory)
+        if "return" in behavior:
+            return_value = parse_int(behavior["return"])
+
+        self.console.log(f"rpc {function} -> 0x{return_value:x}")
+
+        return return_value
+
+    def run_known_function(self, function, args, memory):
+        with self.console.lock:
+            # XGetModuleHandleA
+            if function == "xam.xex@1102":
+                module = self.console.find_module(name=os.path.basename(memory.read_string(args[0]).replace("\\", "/")))
+                return module["handle"] if module is not None else 0
+
+            # XexGetModuleHandle, writes the handle to its second argument
+            if function == "xboxkrnl.exe@405":
+                module = self.console.find_module(name=memory.read_string(args[0]))
+                if module is None:
+                    return STATUS_DLL_NOT_FOUND
+                memory.write(args[1], struct.pack(">I", module["handle"]))
+                return 0
+
+            # XexGetProcedureAddress, the address is remembered so that calling it runs the same function
+            if function == "xboxkrnl.exe@407":
+                module = self.console.find_module(handle=args[0] & 0xFFFFFFFF)
+                if module is None:
+                    return STATUS_NOT_FOUND
+                procedure = f"{module['name'].lower()}@{args[1]}"
+                address = next((a for a, p in self.console.procedures.items() if p == procedure), None)
+                if address is None:
+                    address = f"0x{PROCEDURE_ADDRESS_BASE + len(self.console.procedures) * 4:08x}"
+                    self.console.procedures[address] = procedure
+                memory.write(args[2], struct.pack(">I", parse_int(address)))
+                return 0
+
+            # XeCryptSha, hashes up to three inputs and writes as much of the SHA-1 digest as fits in the output
+            if function == "xboxkrnl.exe@402":
+                sha = hashlib.sha1()
+                for i in range(0, 6, 2):
+                    if args[i + 1] > 0:
+                        sha.update(memory.read(args[i] & 0xFFFFFFFF, args[i + 1]))
+                memory.write(args[6] & 0xFFFFFFFF, sha.digest()[: args[7]])
+                return 0
+
+            # XexLoadImage
+            if function == "xboxkrnl.exe@409":
+                return self.load_image(memory.read_string(args[0]))
+
+            # XexUnloadImage
+            if function == "xboxkrnl.exe@417":
+                return self.unload_image(args[0] & 0xFFFFFFFF)
+
+            # RunModuleScript of the helper, only when the helper is loaded like on a real console
+            if function == MODULE_HELPER_FUNCTION and self.console.find_module(name="ModuleLoaderHelper.xex") is not None:
+                return self.run_module_script(memory.read(args[0] & 0xFFFFFFFF, args[1]), args[2] & 0xFFFFFFFF, args[3], memory)
+
+        self.console.log(f"rpc {function} is not emulated, 0 is returned")
+
+        return 0
+
+    def load_image(self, path):
+        name = path.replace("\\", "/").split("/")[-1]
+        if self.console.find_module(name=name) is not None:
+            return 0
+        data = self.console.files.get(path.lower())
+        if data is None:
+            return STATUS_NOT_FOUND
+        checksum, timestamp = read_checksum_timestamp(bytes(data))
+        module = {
+            "name": name,
+            "base": self.console.next_module_base,
+            "size": LOADED_MODULE_SIZE,
+            "checksum": checksum,
+            "timestamp": timestamp,
+            "handle": self.console.next_handle,
+        }
+        self.console.modules.append(module)
+        self.console.next_module_base += LOADED_MODULE_SIZE
+        self.console.next_handle += 0x100
+        self.console.notify("modload " + format_module(module))
+        return 0
+
+    def unload_image(self, handle):
+        module = self.console.find_module(handle=handle)
+        if module is None:
+            return STATUS_NOT_FOUND
+        self.console.modules.remove(module)
+        self.console.notify("modunload " + format_module(module))
+        return 0
+
+    def run_module_script(self, script, results_address, results_size, memory):
+        # Runs the operations in order and stops after the first one that fails, like the helper does
+        if len(script) < 8:
+            return 0
+        magic, version, number_of_operations = struct.unpack_from(">IHH", script, 0)
+        if magic != MODULE_SCRIPT_MAGIC or version != MODULE_SCRIPT_VERSION:
+            return 0
+
+        offset = 8
+        handles = {}
+        results = bytearray()
+        for index in range(number_of_operations):
+            if offset + 4 > len(script) or len(results) + 8 > results_size:
+                break
+            operation_type, handle_index, data_size = struct.unpack_from(">BBH", script, offset)
+            data = script[offset + 4 : offset + 4 + data_size]
+            offset += 4 + ((data_size + 3) & ~3)
+
+            handle = handles.get(handle_index, 0)
+            status = 0
+            value = 0
+            if operation_type == MODULE_OPERATION_GET_HANDLE:
+                path = data.split(b"\0")[0].decode("latin-1")
+                module = self.console.find_module(name=path.replace("\\", "/").split("/")[-1])
+                if module is None:
+                    status = STATUS_DLL_NOT_FOUND
+                else:
+                    value = module["handle"]
+                    handles[index] = value
+            elif operation_type == MODULE_OPERATION_SET_LOAD_COUNT and handle != 0 and len(data) >= 2:
+                self.console.write_memory(handle + 0x40, data[:2])
+            elif operation_type == MODULE_OPERATION_UNLOAD and handle != 0:
+                status = self.unload_image(handle)
+            elif operation_type == MODULE_OPERATION_LOAD and len(data) > 4:
+                status = self.load_image(data[4:].split(b"\0")[0].decode("latin-1"))
+            else:
+                status = STATUS_INVALID_PARAMETER
+
+            results += struct.pack(">II", status, value)
+            if status & 0x80000000:
+                break
+
+        memory.write(results_address, bytes(results))
+
+        return len(results) // 8
+
+
+class RpcMemory:
+    # Pointers passed to an RPC either point to the RPC buffer or to the memory of the console
+    def __init__(self, console, buffer):
+        self.console = console
+        self.buffer = buffer
+
+    def read(self, address, size):
+        offset = address - RPC_BUFFER_ADDRESS
+        if 0 <= offset and offset + size <= len(self.buffer):
+            return bytes(self.buffer[offset : offset + size])
+
+        return self.console.read_memory(address, size)
+
+    def read_string(self, address):
+        offset = address - RPC_BUFFER_ADDRESS
+        if 0 <= offset < len(self.buffer):
+            end = self.buffer.find(b"\0", offset)
+            return bytes(self.buffer[offset : end if end >= 0 else len(self.buffer)]).decode("latin-1")
+
+        string = bytearray()
+        while len(string) < 0x1000:
+            byte = self.console.read_memory(address + len(string), 1)
+            if byte == b"\0":
+                break
+            string += byte
+
+        return string.decode("latin-1")
+
+    def write(self, address, data):
+        offset = address - RPC_BUFFER_ADDRESS
+        if 0 <= offset and offset + len(data) <= len(self.buffer):
+            self.buffer[offset : offset + len(data)] = data
+        else:
+            self.console.write_memory(address, data)
+
+
+class MockServer:
+    # Runs the console on a background thread, for the scripts driving ModuleLoader against it
+    def __init__(self, console, address="127.0.0.1", port=XBDM_PORT):
+        self.console = console
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind((address, port))
+        self.server.listen()
+        self.thread = threading.Thread(target=self.accept_connections, daemon=True)
+
+    def start(self):
+        self.thread.start()
+        return self
+
+    def stop(self):
+        self.server.close()
+
+    def accept_connections(self):
+        while True:
+            try:
+                client, address = self.server.accept()
+            except OSError:
+                return
+
+            client.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self.serve, args=(client, address), daemon=True).start()
+
+    def serve(self, client, address):
+        try:
+            Connection(self.console, client, address).run()
+        except (ConnectionError, OSError):
+            pass
+        finally:
+            client.close()
+
+
+def load_scenario(path):
+    if path is None:
+        return {}, os.getcwd()
+
+    with open(path, "r") as file:
+        return json.load(file), os.path.dirname(os.path.abspath(path))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Minimal XBDM console to run ModuleLoader against.")
+    parser.add_argument("--scenario", help="JSON file describing the console")
+    parser.add_argument("--address", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=XBDM_PORT)
+    parser.add_argument("--quiet", action="store_true", help="don't print every command")
+    arguments = parser.parse_args()
+
+    scenario, base_directory = load_scenario(arguments.scenario)
+    console = Console(scenario, base_directory, arguments.quiet)
+    server = MockServer(console, arguments.address, arguments.port).start()
+    print(f"[MockConsole] {console.name} listening on {arguments.address}:{arguments.port}, press Ctrl+C to stop.")
+
+    try:
+        while server.thread.is_alive():
+            server.thread.join(0.5)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.stop()
+        counters = console.counters
+        print(
+            f"[MockConsole] {counters.connections} connections, {counters.round_trips} round trips, "
+            f"{counters.bytes_received} bytes received, {counters.bytes_sent} bytes sent."
+        )
+
+
+if __name__ == "__main__":
+    main()